@@ -53,5 +53,16 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += external/zlib external/bzip2
 LOCAL_STATIC_LIBRARIES += libz libbz
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bspatch_bench.c bspatch.c bsdiff.c
+LOCAL_MODULE := bspatch_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += external/bzip2 bootable/recovery
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 
 include $(BUILD_HOST_EXECUTABLE)
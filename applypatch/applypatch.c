@@ -19,14 +19,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "mtdutils/block_io.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
@@ -37,6 +40,84 @@ static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 
 static int mtd_partitions_scanned = 0;
 
+// SHA-1s of files this process has already loaded, so that the
+// apply_patch_check(), apply_patch() and read_file() calls an updater
+// script makes on the same file only hash it once.  Entries are keyed
+// by the file's identity and timestamps.  A file whose timestamps are
+// not older than the second its hash started could still be changing
+// without its mtime moving, so it isn't remembered.
+#define SHA_CACHE_ENTRIES 16
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    int retouch_flag;       // masked and unmasked hashes differ
+    uint8_t sha1[SHA_DIGEST_SIZE];
+} ShaCacheEntry;
+
+static ShaCacheEntry sha_cache[SHA_CACHE_ENTRIES];
+static int sha_cache_count = 0;
+static int sha_cache_next = 0;
+
+static ShaCacheEntry* FindShaCacheEntry(const struct stat* st,
+                                        int retouch_flag) {
+    int i;
+    for (i = 0; i < sha_cache_count; ++i) {
+        ShaCacheEntry* e = sha_cache + i;
+        if (e->dev == st->st_dev && e->ino == st->st_ino &&
+            e->retouch_flag == retouch_flag) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static int LookupCachedSha1(const struct stat* st, int retouch_flag,
+                            uint8_t* sha1) {
+    ShaCacheEntry* e = FindShaCacheEntry(st, retouch_flag);
+    if (e == NULL || e->size != st->st_size ||
+        e->mtime != st->st_mtime || e->ctime != st->st_ctime) {
+        return -1;
+    }
+    memcpy(sha1, e->sha1, SHA_DIGEST_SIZE);
+    return 0;
+}
+
+static void CacheSha1(const struct stat* st, int retouch_flag,
+                      const uint8_t* sha1, time_t started) {
+    if (st->st_mtime >= started || st->st_ctime >= started) return;
+
+    ShaCacheEntry* e = FindShaCacheEntry(st, retouch_flag);
+    if (e == NULL) {
+        e = sha_cache + sha_cache_next;
+        sha_cache_next = (sha_cache_next + 1) % SHA_CACHE_ENTRIES;
+        if (sha_cache_count < SHA_CACHE_ENTRIES) ++sha_cache_count;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->ctime = st->st_ctime;
+    e->retouch_flag = retouch_flag;
+    memcpy(e->sha1, sha1, SHA_DIGEST_SIZE);
+}
+
+// apply_patch[_check] functions are blind to randomization. Randomization
+// is taken care of in [Undo]RetouchBinariesFn. If there is a mismatch
+// within a file, this means the file is assumed "corrupt" for simplicity.
+static int MaskRetouchedData(FileContents* file) {
+    int32_t desired_offset = 0;
+    if (retouch_mask_data(file->data, file->size,
+                          &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
+        printf("error trying to mask retouch entries\n");
+        return -1;
+    }
+    return 0;
+}
+
 // Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
 // the retouched entries back to their original value (such that SHA-1 checks
 // don't fail due to randomization); store the file contents and associated
@@ -46,6 +127,7 @@ static int mtd_partitions_scanned = 0;
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
@@ -59,6 +141,7 @@ int LoadFileContents(const char* filename, FileContents* file,
         return -1;
     }
 
+    time_t started = time(NULL);
     file->size = file->st.st_size;
     file->data = malloc(file->size);
 
@@ -80,24 +163,115 @@ int LoadFileContents(const char* filename, FileContents* file,
     }
     fclose(f);
 
-    // apply_patch[_check] functions are blind to randomization. Randomization
-    // is taken care of in [Undo]RetouchBinariesFn. If there is a mismatch
-    // within a file, this means the file is assumed "corrupt" for simplicity.
-    if (retouch_flag) {
-        int32_t desired_offset = 0;
-        if (retouch_mask_data(file->data, file->size,
-                              &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
-            printf("error trying to mask retouch entries\n");
-            free(file->data);
-            file->data = NULL;
-            return -1;
+    if (retouch_flag && MaskRetouchedData(file) != 0) {
+        free(file->data);
+        file->data = NULL;
+        return -1;
+    }
+
+    if (LookupCachedSha1(&file->st, retouch_flag, file->sha1) != 0) {
+        SHA(file->data, file->size, file->sha1);
+        CacheSha1(&file->st, retouch_flag, file->sha1, started);
+    }
+    return 0;
+}
+
+// Hashes a mapped file a chunk at a time, asking for the next chunk to
+// be read in while the current one is hashed, so the faults mostly
+// find their pages already on the way.
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+static void HashMapping(const unsigned char* data, ssize_t size,
+                        uint8_t* digest) {
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t pos = 0;
+    madvise((void*)data, size < HASH_CHUNK_SIZE ? size : HASH_CHUNK_SIZE,
+            MADV_WILLNEED);
+    while (pos < size) {
+        ssize_t len = size - pos < HASH_CHUNK_SIZE ? size - pos : HASH_CHUNK_SIZE;
+        ssize_t next = pos + len;
+        if (next < size) {
+            madvise((void*)(data + next),
+                    size - next < HASH_CHUNK_SIZE ? size - next : HASH_CHUNK_SIZE,
+                    MADV_WILLNEED);
         }
+        SHA_update(&ctx, data + pos, len);
+        pos = next;
     }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+}
 
-    SHA(file->data, file->size, file->sha1);
+// Like LoadFileContents, but maps a regular file instead of reading it,
+// so its pages come from the page cache only as they are used and can
+// be dropped again under memory pressure.  The mapping is private; when
+// retouch entries have to be masked, only the pages they fall in are
+// copied.  Partitions and empty files are loaded into memory as usual.
+// The file must not be truncated while it is mapped.  Release the
+// contents with UnloadFileContents.
+//
+// Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(file->st.st_mode) || file->st.st_size == 0) {
+        close(fd);
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+
+    time_t started = time(NULL);
+    file->size = file->st.st_size;
+    int prot = retouch_flag ? PROT_READ | PROT_WRITE : PROT_READ;
+    unsigned char* data = mmap(NULL, file->size, prot, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("failed to map \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    file->data = data;
+    file->mapped = 1;
+
+    if (retouch_flag && MaskRetouchedData(file) != 0) {
+        UnloadFileContents(file);
+        return -1;
+    }
+
+    if (LookupCachedSha1(&file->st, retouch_flag, file->sha1) != 0) {
+        HashMapping(file->data, file->size, file->sha1);
+        CacheSha1(&file->st, retouch_flag, file->sha1, started);
+    }
     return 0;
 }
 
+// Releases the data of a FileContents filled in by LoadFileContents or
+// MapFileContents, leaving data NULL.
+void UnloadFileContents(FileContents* file) {
+    if (file->mapped) {
+        if (file->data != NULL) munmap(file->data, file->size);
+        file->mapped = 0;
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -353,90 +527,196 @@ int SaveFileContents(const char* filename, FileContents file) {
     return 0;
 }
 
-// Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
-int WriteToPartition(unsigned char* data, size_t len,
-                        const char* target) {
-    char* copy = strdup(target);
-    const char* magic = strtok(copy, ":");
+// Replaces file->data, which was just saved to CACHE_TEMP_SOURCE, with a
+// read-only mapping of the saved copy, after checking that the copy
+// hashes the same.  Patching then reads the source through the page
+// cache, which can give the memory back under pressure, instead of from
+// the heap, and the original is no longer held open.  The old contents
+// are released first so the two never coexist; on failure file->data
+// is NULL.  Return 0 on success.
+static int MapBackupContents(FileContents* file) {
+    UnloadFileContents(file);
+
+    int fd = open(CACHE_TEMP_SOURCE, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", CACHE_TEMP_SOURCE, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != file->size || file->size == 0) {
+        printf("%s is not the expected size\n", CACHE_TEMP_SOURCE);
+        close(fd);
+        return -1;
+    }
+    unsigned char* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("failed to map %s: %s\n", CACHE_TEMP_SOURCE, strerror(errno));
+        return -1;
+    }
+
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    HashMapping(data, file->size, sha1);
+    if (memcmp(sha1, file->sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("%s doesn't match what was saved\n", CACHE_TEMP_SOURCE);
+        munmap(data, file->size);
+        return -1;
+    }
+    file->data = data;
+    file->mapped = 1;
+    return 0;
+}
 
+// Streams data to a partition as it is produced, so writing an image
+// never takes memory the size of the image.  MTD writes go through
+// mtd_write_data a block at a time; EMMC writes go through a BlockWriter,
+// which keeps one buffer in flight while the next is filled.
+typedef struct {
     enum PartitionType type;
+    char* copy;
+    const char* partition;
+    MtdWriteContext* mtd;
+    int fd;
+    BlockWriter* writer;
+    ssize_t size;           // the sink refuses more than this
+    ssize_t written;
+} PartitionSinkInfo;
+
+// Opens 'target', a string of the form "MTD:<partition>[:...]" or
+// "EMMC:<partition_device>:", for writing at most 'size' bytes.  Return
+// 0 on success.
+static int OpenPartitionSink(const char* target, ssize_t size,
+                             PartitionSinkInfo* psi) {
+    psi->copy = strdup(target);
+    const char* magic = strtok(psi->copy, ":");
+    psi->mtd = NULL;
+    psi->fd = -1;
+    psi->writer = NULL;
+    psi->size = size;
+    psi->written = 0;
+
     if (strcmp(magic, "MTD") == 0) {
-        type = MTD;
+        psi->type = MTD;
     } else if (strcmp(magic, "EMMC") == 0) {
-        type = EMMC;
+        psi->type = EMMC;
     } else {
-        printf("WriteToPartition called with bad target (%s)\n", target);
+        printf("OpenPartitionSink called with bad target (%s)\n", target);
+        free(psi->copy);
         return -1;
     }
-    const char* partition = strtok(NULL, ":");
+    psi->partition = strtok(NULL, ":");
 
-    if (partition == NULL) {
+    if (psi->partition == NULL) {
         printf("bad partition target name \"%s\"\n", target);
+        free(psi->copy);
         return -1;
     }
 
-    switch (type) {
+    switch (psi->type) {
         case MTD:
             if (!mtd_partitions_scanned) {
                 mtd_scan_partitions();
                 mtd_partitions_scanned = 1;
             }
 
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            const MtdPartition* mtd = mtd_find_partition_by_name(psi->partition);
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
-                       partition);
+                       psi->partition);
+                free(psi->copy);
                 return -1;
             }
 
-            MtdWriteContext* ctx = mtd_write_partition(mtd);
-            if (ctx == NULL) {
+            psi->mtd = mtd_write_partition(mtd);
+            if (psi->mtd == NULL) {
                 printf("failed to init mtd partition \"%s\" for writing\n",
-                       partition);
+                       psi->partition);
+                free(psi->copy);
                 return -1;
             }
+            break;
 
-            size_t written = mtd_write_data(ctx, (char*)data, len);
-            if (written != len) {
-                printf("only wrote %d of %d bytes to MTD %s\n",
-                       written, len, partition);
-                mtd_write_close(ctx);
+        case EMMC:
+            psi->fd = block_io_open(psi->partition, O_WRONLY | O_CREAT | O_TRUNC,
+                                    BLOCK_IO_DIRECT);
+            if (psi->fd < 0) {
+                printf("failed to open %s for write: %s\n",
+                       psi->partition, strerror(errno));
+                free(psi->copy);
                 return -1;
             }
-
-            if (mtd_erase_blocks(ctx, -1) < 0) {
-                printf("error finishing mtd write of %s\n", partition);
-                mtd_write_close(ctx);
+            psi->writer = block_writer_open(psi->fd);
+            if (psi->writer == NULL) {
+                printf("failed to start writing %s\n", psi->partition);
+                close(psi->fd);
+                free(psi->copy);
                 return -1;
             }
+            break;
+    }
+    return 0;
+}
 
-            if (mtd_write_close(ctx)) {
-                printf("error closing mtd write of %s\n", partition);
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionSinkInfo* psi = (PartitionSinkInfo*)token;
+    if (psi->size - psi->written < len) {
+        printf("output for %s is bigger than expected\n", psi->partition);
+        return -1;
+    }
+    switch (psi->type) {
+        case MTD:
+            ;
+            ssize_t written = mtd_write_data(psi->mtd, (char*)data, len);
+            if (written != len) {
+                printf("only wrote %ld of %ld bytes to MTD %s\n",
+                       (long)written, (long)len, psi->partition);
                 return -1;
             }
             break;
 
         case EMMC:
-            ;
-            FILE* f = fopen(partition, "wb");
-            if (fwrite(data, 1, len, f) != len) {
+            if (block_writer_write(psi->writer, data, len) != 0) {
                 printf("short write writing to %s (%s)\n",
-                       partition, strerror(errno));
-                return -1;
-            }
-            if (fclose(f) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
+                       psi->partition, strerror(errno));
                 return -1;
             }
             break;
     }
-
-    free(copy);
-    return 0;
+    psi->written += len;
+    return len;
 }
 
+// Finishes writing the partition (erasing the rest of an MTD partition,
+// syncing an EMMC one) and frees the sink.  A partition nothing was
+// written to is left alone.  Return 0 on success.
+static int ClosePartitionSink(PartitionSinkInfo* psi) {
+    int result = 0;
+    switch (psi->type) {
+        case MTD:
+            if (psi->written > 0 && mtd_erase_blocks(psi->mtd, -1) < 0) {
+                printf("error finishing mtd write of %s\n", psi->partition);
+                result = -1;
+            }
+            if (mtd_write_close(psi->mtd)) {
+                printf("error closing mtd write of %s\n", psi->partition);
+                result = -1;
+            }
+            break;
+
+        case EMMC:
+            if (block_writer_close(psi->writer) != 0) {
+                printf("error writing %s (%s)\n", psi->partition, strerror(errno));
+                result = -1;
+            }
+            if (close(psi->fd) != 0) {
+                printf("error closing %s (%s)\n", psi->partition, strerror(errno));
+                result = -1;
+            }
+            break;
+    }
+    free(psi->copy);
+    return result;
+}
 
 // Take a string 'str' of 40 hex digits and parse it into the 20
 // byte array 'digest'.  'str' may contain only the digest or be of
@@ -491,18 +771,19 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
-    // LoadFileContents is successful.  (Useful for reading
+    // MapFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    if (LoadFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
+    if (MapFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
+        UnloadFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -510,19 +791,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            UnloadFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    UnloadFileContents(&file);
     return 0;
 }
 
@@ -546,22 +827,6 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    ssize_t size;
-    ssize_t pos;
-} MemorySinkInfo;
-
-ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
-    MemorySinkInfo* msi = (MemorySinkInfo*)token;
-    if (msi->size - msi->pos < len) {
-        return -1;
-    }
-    memcpy(msi->buffer + msi->pos, data, len);
-    msi->pos += len;
-    return len;
-}
-
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -636,13 +901,14 @@ int applypatch(const char* source_filename,
     int made_copy = 0;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    if (MapFileContents(target_filename, &source_file,
+                        RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
+            UnloadFileContents(&source_file);
             return 0;
         }
     }
@@ -652,9 +918,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        UnloadFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
+                        RETOUCH_DO_MASK);
     }
 
     if (source_file.data != NULL) {
@@ -666,11 +932,11 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
+        UnloadFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
-                             RETOUCH_DO_MASK) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
+                            RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -685,6 +951,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
+            UnloadFileContents(&copy_file);
             return 1;
         }
     }
@@ -692,10 +959,19 @@ int applypatch(const char* source_filename,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    PartitionSinkInfo psi;
     FileContents* source_to_use;
+    const Value* patch;
     char* outname;
 
+    if (source_patch_value != NULL) {
+        source_to_use = &source_file;
+        patch = source_patch_value;
+    } else {
+        source_to_use = &copy_file;
+        patch = copy_patch_value;
+    }
+
     // assume that target_filename (eg "/system/app/Foo.apk") is located
     // on the same filesystem as its top-level directory ("/system").
     // We need something that exists for calling statfs().
@@ -715,23 +991,31 @@ int applypatch(const char* source_filename,
 
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
-
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file.size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
+            // If the target is a partition, the output is written to
+            // it as the patch produces it, so the original source has
+            // to be safe in cache first, in case the write fails or is
+            // interrupted.  (If the source was bad, the copy in cache
+            // is what we're patching already.)
+            if (source_patch_value != NULL) {
+                if (MakeFreeSpaceOnCache(source_file.size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    UnloadFileContents(source_to_use);
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    UnloadFileContents(source_to_use);
+                    return 1;
+                }
             }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+            made_copy = 1;
+
+            // Patch from the copy, which also checks that it's good
+            // before the partition is touched.
+            if (MapBackupContents(source_to_use) != 0) {
                 printf("failed to back up source file\n");
                 return 1;
             }
-            made_copy = 1;
             retry = 0;
         } else {
             int enough_space = 0;
@@ -760,19 +1044,30 @@ int applypatch(const char* source_filename,
                     // we're ever in a state where we need to do this, fail.
                     printf("not enough free space for target but source "
                            "is partition\n");
+                    UnloadFileContents(source_to_use);
                     return 1;
                 }
 
                 if (MakeFreeSpaceOnCache(source_file.size) < 0) {
                     printf("not enough free space on /cache\n");
+                    UnloadFileContents(source_to_use);
                     return 1;
                 }
 
                 if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
                     printf("failed to back up source file\n");
+                    UnloadFileContents(source_to_use);
                     return 1;
                 }
                 made_copy = 1;
+
+                // Patch from the copy, so that the mapping of the
+                // original doesn't keep its blocks allocated after
+                // the unlink.
+                if (MapBackupContents(source_to_use) != 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -780,17 +1075,21 @@ int applypatch(const char* source_filename,
             }
         }
 
-        const Value* patch;
-        if (source_patch_value != NULL) {
-            source_to_use = &source_file;
-            patch = source_patch_value;
-        } else {
-            source_to_use = &copy_file;
-            patch = copy_patch_value;
-        }
-
         if (patch->type != VAL_BLOB) {
             printf("patch is not a blob\n");
+            UnloadFileContents(source_to_use);
+            return 1;
+        }
+
+        // Know the patch type before opening the output; opening a
+        // partition commits to rewriting it.
+        char* header = patch->data;
+        ssize_t header_bytes_read = patch->size;
+        int is_bsdiff = header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0;
+        int is_imgdiff = header_bytes_read >= 8 && memcmp(header, "IMGDIFF2", 8) == 0;
+        if (!is_bsdiff && !is_imgdiff) {
+            printf("Unknown patch file format\n");
+            UnloadFileContents(source_to_use);
             return 1;
         }
 
@@ -800,17 +1099,13 @@ int applypatch(const char* source_filename,
         outname = NULL;
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
+            // We write the decoded output straight to the partition.
+            if (OpenPartitionSink(target_filename, target_size, &psi) != 0) {
+                UnloadFileContents(source_to_use);
                 return 1;
             }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
+            sink = PartitionSink;
+            token = &psi;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
             outname = (char*)malloc(strlen(target_filename) + 10);
@@ -821,40 +1116,37 @@ int applypatch(const char* source_filename,
             if (output < 0) {
                 printf("failed to open output file %s: %s\n",
                        outname, strerror(errno));
+                UnloadFileContents(source_to_use);
                 return 1;
             }
             sink = FileSink;
             token = &output;
         }
 
-        char* header = patch->data;
-        ssize_t header_bytes_read = patch->size;
-
         SHA_init(&ctx);
 
         int result;
 
-        if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+        if (is_bsdiff) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
-        } else if (header_bytes_read >= 8 &&
-                   memcmp(header, "IMGDIFF2", 8) == 0) {
+        } else {
             result = ApplyImagePatch(source_to_use->data, source_to_use->size,
                                      patch, sink, token, &ctx);
-        } else {
-            printf("Unknown patch file format\n");
-            return 1;
         }
 
         if (output >= 0) {
             fsync(output);
             close(output);
+        } else if (ClosePartitionSink(&psi) != 0 && result == 0) {
+            printf("write of patched data to %s failed\n", target_filename);
+            result = -1;
         }
 
         if (result != 0) {
             if (retry == 0) {
                 printf("applying patch failed\n");
+                UnloadFileContents(source_to_use);
                 return result != 0;
             } else {
                 printf("applying patch failed; retrying\n");
@@ -868,20 +1160,14 @@ int applypatch(const char* source_filename,
         }
     } while (retry-- > 0);
 
+    UnloadFileContents(source_to_use);
     const uint8_t* current_target_sha1 = SHA_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
+    if (output >= 0) {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
         if (chmod(outname, source_to_use->st.st_mode) != 0) {
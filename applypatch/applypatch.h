@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;       // data is a file mapping, not a heap block
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -62,6 +63,9 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
+void UnloadFileContents(FileContents* file);
 int SaveFileContents(const char* filename, FileContents file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char** const patch_sha1_str,
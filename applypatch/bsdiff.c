@@ -210,6 +210,22 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Builds the suffix array that bsdiff() searches 'old' with into *IP,
+// unless *IP is already set.  Callers that run several bsdiff()s
+// against the same 'old' at once call this first, so that they don't
+// all try to build it.
+void bsdiff_sort(u_char* old, off_t oldsize, off_t** IP)
+{
+        if (*IP == NULL) {
+            off_t *I, *V;
+            if (((I = malloc((oldsize+1) * sizeof(off_t))) == NULL) ||
+                ((V = malloc((oldsize+1) * sizeof(off_t))) == NULL)) err(1, NULL);
+            qsufsort(I, V, old, oldsize);
+            free(V);
+            *IP = I;
+        }
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
@@ -240,13 +256,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	BZFILE * pfbz2;
 	int bz2err;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
+        bsdiff_sort(old, oldsize, IP);
         I = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
@@ -25,9 +25,16 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include <bzlib.h>
 
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 
@@ -97,32 +104,125 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+// Where the patched data goes.  ApplyBSDiffPatchMem decodes straight
+// into the whole new file; ApplyBSDiffPatch decodes into a fixed size
+// window that is passed to the sink (and the hash) each time it fills,
+// so its memory use doesn't grow with the size of the target.
+typedef struct {
+    unsigned char* buffer;
+    ssize_t size;
+    ssize_t len;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+} PatchOutput;
+
+#define BSPATCH_WINDOW_SIZE (256 * 1024)
+
+static int FlushOutput(PatchOutput* out) {
+    if (out->sink == NULL || out->len == 0) {
+        return 0;
     }
-
-    if (sink(new_data, new_size, token) < new_size) {
+    if (out->sink(out->buffer, out->len, out->token) < out->len) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    if (out->ctx) {
+        SHA_update(out->ctx, out->buffer, out->len);
+    }
+    out->len = 0;
+    return 0;
+}
+
+// Adds src to dst bytewise (mod 256), sixteen bytes at a time where the
+// CPU has vector adds.
+static void AddBytes(unsigned char* dst, const unsigned char* src, ssize_t len) {
+    ssize_t i = 0;
+#if defined(__ARM_NEON__)
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(a, b));
+    }
+#else
+    // A word at a time: the low seven bits of each byte are added
+    // without carrying into the next byte, and the top bits are xored
+    // back in.
+    const unsigned long high = ~0UL / 255 * 0x80;
+    for (; i + (ssize_t)sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+        unsigned long a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a = ((a & ~high) + (b & ~high)) ^ ((a ^ b) & high);
+        memcpy(dst + i, &a, sizeof(a));
+    }
+#endif
+    for (; i < len; ++i) {
+        dst[i] += src[i];
     }
-    free(new_data);
+}
 
+// Adds the old file, starting at oldpos, to len bytes of diff data.
+// Only the part that overlaps the old file is touched; bytes before its
+// start or past its end are left as they are.
+static void AddOldData(unsigned char* p, ssize_t len,
+                       const unsigned char* old_data, ssize_t old_size,
+                       off_t oldpos) {
+    off_t start = oldpos < 0 ? -oldpos : 0;
+    off_t end = old_size - oldpos < len ? old_size - oldpos : len;
+    if (start < end) {
+        AddBytes(p + start, old_data + oldpos + start, end - start);
+    }
+}
+
+// Decodes len bytes of the diff or extra stream into the output.  Diff
+// data (old_data != NULL) is added bytewise to the old file starting at
+// oldpos.
+static int DecodeSegment(PatchOutput* out, bz_stream* stream, off_t len,
+                         const unsigned char* old_data, ssize_t old_size,
+                         off_t oldpos) {
+    while (len > 0) {
+        if (out->len == out->size && FlushOutput(out) != 0) {
+            return 1;
+        }
+        ssize_t n = out->size - out->len;
+        if (n > len) n = len;
+        unsigned char* p = out->buffer + out->len;
+        if (FillBuffer(p, n, stream) != 0) {
+            return -1;
+        }
+        if (old_data != NULL) {
+            AddOldData(p, n, old_data, old_size, oldpos);
+            oldpos += n;
+        }
+        out->len += n;
+        len -= n;
+    }
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+// Checks the patch header and returns the size of the new file, or -1.
+static ssize_t BSDiffNewSize(const Value* patch, ssize_t patch_offset) {
+    unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (memcmp(header, "BSDIFF40", 8) != 0) {
+        printf("corrupt bsdiff patch file header (magic number)\n");
+        return -1;
+    }
+    ssize_t new_size = offtin(header+24);
+    if (offtin(header+8) < 0 || offtin(header+16) < 0 || new_size < 0) {
+        printf("corrupt patch file header (data lengths)\n");
+        return -1;
+    }
+    return new_size;
+}
+
+static int ApplyBSDiffPatchToOutput(const unsigned char* old_data, ssize_t old_size,
+                                    const Value* patch, ssize_t patch_offset,
+                                    ssize_t new_size, PatchOutput* out) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -136,22 +236,12 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // extra block; seek forwards in oldfile by z bytes".
 
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
-        printf("corrupt bsdiff patch file header (magic number)\n");
-        return 1;
-    }
-
     ssize_t ctrl_len, data_len;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    *new_size = offtin(header+24);
-
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
-        printf("corrupt patch file header (data lengths)\n");
-        return 1;
-    }
 
     int bzerr;
+    int result = 1;
 
     bz_stream cstream;
     cstream.next_in = patch->data + patch_offset + 32;
@@ -183,45 +273,30 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         printf("failed to bzinit extra stream (%d)\n", bzerr);
     }
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
-    }
-
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
         if (FillBuffer(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
-
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
-            }
+        // Read diff string and add old data to it
+        int r = DecodeSegment(out, &dstream, ctrl[0], old_data, old_size, oldpos);
+        if (r != 0) {
+            if (r < 0) printf("error while reading diff stream\n");
+            goto done;
         }
 
         // Adjust pointers
@@ -229,24 +304,86 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         oldpos += ctrl[0];
 
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (ctrl[1] < 0 || newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        r = DecodeSegment(out, &estream, ctrl[1], NULL, 0, 0);
+        if (r != 0) {
+            if (r < 0) printf("error while reading extra stream\n");
+            goto done;
         }
 
         // Adjust pointers
         newpos += ctrl[1];
         oldpos += ctrl[2];
     }
+    result = FlushOutput(out);
 
+done:
     BZ2_bzDecompressEnd(&cstream);
     BZ2_bzDecompressEnd(&dstream);
     BZ2_bzDecompressEnd(&estream);
-    return 0;
+    return result;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t new_size = BSDiffNewSize(patch, patch_offset);
+    if (new_size < 0) {
+        return 1;
+    }
+
+    PatchOutput out;
+    out.size = new_size < BSPATCH_WINDOW_SIZE ? new_size : BSPATCH_WINDOW_SIZE;
+    out.buffer = malloc(out.size > 0 ? out.size : 1);
+    if (out.buffer == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)out.size);
+        return 1;
+    }
+    out.len = 0;
+    out.sink = sink;
+    out.token = token;
+    out.ctx = ctx;
+
+    int result = ApplyBSDiffPatchToOutput(old_data, old_size, patch, patch_offset,
+                                          new_size, &out);
+    free(out.buffer);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    *new_size = BSDiffNewSize(patch, patch_offset);
+    if (*new_size < 0) {
+        return 1;
+    }
+
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    PatchOutput out;
+    out.buffer = *new_data;
+    out.size = *new_size;
+    out.len = 0;
+    out.sink = NULL;
+    out.token = NULL;
+    out.ctx = NULL;
+
+    int result = ApplyBSDiffPatchToOutput(old_data, old_size, patch, patch_offset,
+                                          *new_size, &out);
+    if (result != 0) {
+        free(*new_data);
+        *new_data = NULL;
+    }
+    return result;
 }
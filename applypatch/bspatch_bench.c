@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how fast bsdiff patches are applied.
+//
+//   bspatch_bench [-n <runs>] <oldfile> <patchfile>
+//   bspatch_bench [-n <runs>] -s <size in MB>
+//
+// The first form times a real patch.  The second makes up an old file of
+// the given size, and a new file that differs from it by small edits
+// every few kilobytes (the shape of most system file patches), diffs them
+// with bsdiff and times applying the result.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "applypatch.h"
+
+int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+           const char* patch_filename);
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned char* ReadFile(const char* filename, ssize_t* size) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        printf("failed to stat \"%s\"\n", filename);
+        return NULL;
+    }
+    unsigned char* data = malloc(st.st_size > 0 ? st.st_size : 1);
+    FILE* f = fopen(filename, "rb");
+    if (data == NULL || f == NULL ||
+        fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        printf("failed to read \"%s\"\n", filename);
+        if (f) fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+    *size = st.st_size;
+    return data;
+}
+
+static ssize_t total_written;
+
+static ssize_t NullSink(unsigned char* data, ssize_t len, void* token) {
+    total_written += len;
+    return len;
+}
+
+// Builds the synthetic old and new files, and the patch between them in
+// patch_filename.
+static int MakeSyntheticPatch(ssize_t size, unsigned char** old_data,
+                              const char* patch_filename) {
+    unsigned char* old = malloc(size);
+    unsigned char* new = malloc(size + size / 64);
+    if (old == NULL || new == NULL) {
+        printf("failed to allocate %ld bytes\n", (long)size);
+        return -1;
+    }
+    unsigned int seed = 1;
+    ssize_t i;
+    for (i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        // mostly a small alphabet, like code and text
+        old[i] = (seed >> 16) % 23 == 0 ? seed >> 24 : 'a' + (seed >> 16) % 16;
+    }
+
+    ssize_t newsize = 0;
+    for (i = 0; i < size; ) {
+        seed = seed * 1103515245 + 12345;
+        ssize_t run = 1024 + (seed >> 16) % 8192;
+        if (run > size - i) run = size - i;
+        memcpy(new + newsize, old + i, run);
+        newsize += run;
+        i += run;
+        switch ((seed >> 8) % 3) {
+            case 0:     // changed bytes, as from relocated addresses
+                if (newsize >= 4) new[newsize-4] += 1 + (seed & 7);
+                break;
+            case 1:     // inserted bytes
+                new[newsize++] = seed >> 24;
+                break;
+            case 2:     // deleted bytes
+                i += 8;
+                break;
+        }
+    }
+
+    off_t* I = NULL;
+    int result = bsdiff(old, size, &I, new, newsize, patch_filename);
+    free(I);
+    free(new);
+    *old_data = old;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    int runs = 5;
+    ssize_t synthetic_size = 0;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+            case 'n': runs = atoi(optarg); break;
+            case 's': synthetic_size = (ssize_t)atoi(optarg) << 20; break;
+            default: return 2;
+        }
+    }
+
+    unsigned char* old_data;
+    ssize_t old_size;
+    const char* patch_filename;
+    char temp_filename[] = "/tmp/bspatch_bench.XXXXXX";
+    if (synthetic_size > 0) {
+        int fd = mkstemp(temp_filename);
+        if (fd < 0) {
+            printf("failed to create temp file\n");
+            return 1;
+        }
+        close(fd);
+        patch_filename = temp_filename;
+        old_size = synthetic_size;
+        if (MakeSyntheticPatch(synthetic_size, &old_data, patch_filename) != 0) {
+            unlink(temp_filename);
+            return 1;
+        }
+    } else if (optind + 2 == argc) {
+        old_data = ReadFile(argv[optind], &old_size);
+        patch_filename = argv[optind + 1];
+        if (old_data == NULL) return 1;
+    } else {
+        printf("usage: %s [-n <runs>] <oldfile> <patchfile>\n"
+               "       %s [-n <runs>] -s <size in MB>\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.data = (char*)ReadFile(patch_filename, &patch.size);
+    if (synthetic_size > 0) unlink(temp_filename);
+    if (patch.data == NULL) return 1;
+
+    double best = 0, best_sha = 0;
+    ssize_t new_size = 0;
+    int i;
+    for (i = 0; i < runs; ++i) {
+        total_written = 0;
+        double start = now();
+        if (ApplyBSDiffPatch(old_data, old_size, &patch, 0, NullSink, NULL, NULL) != 0) {
+            printf("patch failed\n");
+            return 1;
+        }
+        double t = now() - start;
+        if (i == 0 || t < best) best = t;
+        new_size = total_written;
+
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        start = now();
+        if (ApplyBSDiffPatch(old_data, old_size, &patch, 0, NullSink, NULL, &ctx) != 0) {
+            printf("patch failed\n");
+            return 1;
+        }
+        t = now() - start;
+        if (i == 0 || t < best_sha) best_sha = t;
+    }
+
+    double mb = new_size / 1048576.0;
+    printf("old %ld bytes, patch %ld bytes, new %ld bytes\n",
+           (long)old_size, (long)patch.size, (long)new_size);
+    printf("apply:          %.1f MB/s (%.3fs)\n", mb / best, best);
+    printf("apply and sha1: %.1f MB/s (%.3fs)\n", mb / best_sha, best_sha);
+    return 0;
+}
@@ -114,6 +114,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -173,6 +174,60 @@ static int fileentry_compare(const void* a, const void* b) {
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+void bsdiff_sort(u_char* old, off_t oldsize, off_t** IP);
+
+/*
+ * A minimal work queue: calls fn(cookie, i) for every i in [0, count)
+ * on up to 'jobs' threads (the caller's included), handing out the
+ * indices in order.  With one job everything runs on the calling
+ * thread.
+ */
+typedef void (*WorkFn)(void* cookie, int index);
+
+typedef struct {
+  WorkFn fn;
+  void* cookie;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} WorkQueue;
+
+static void* WorkThread(void* arg) {
+  WorkQueue* q = (WorkQueue*)arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->count) break;
+    q->fn(q->cookie, i);
+  }
+  return NULL;
+}
+
+void RunParallel(int jobs, int count, WorkFn fn, void* cookie) {
+  WorkQueue q;
+  q.fn = fn;
+  q.cookie = cookie;
+  q.count = count;
+  q.next = 0;
+  pthread_mutex_init(&q.lock, NULL);
+
+  if (jobs > count) jobs = count;
+  pthread_t* threads = malloc(jobs * sizeof(pthread_t));
+  int started = 0;
+  int i;
+  for (i = 1; i < jobs; ++i) {
+    if (pthread_create(threads+started, NULL, WorkThread, &q) == 0) {
+      ++started;
+    }
+  }
+  WorkThread(&q);
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+}
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -557,6 +612,19 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   return 0;
 }
 
+// We only check two combinations of encoder parameters:  level 6
+// (the default) and level 9 (the maximum).
+#define NUM_DEFLATE_LEVELS 2
+static const int deflate_levels[NUM_DEFLATE_LEVELS] = { 6, 9 };
+
+static void SetDeflateParameters(ImageChunk* chunk, int level) {
+  chunk->level = level;
+  chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
+  chunk->memLevel = 8;      // the default value.
+  chunk->method = Z_DEFLATED;
+  chunk->strategy = Z_DEFAULT_STRATEGY;
+}
+
 /*
  * Verify that we can reproduce exactly the same compressed data that
  * we started with.  Sets the level, method, windowBits, memLevel, and
@@ -572,14 +640,9 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   size_t p = 0;
   unsigned char* out = malloc(BUFFER_SIZE);
 
-  // We only check two combinations of encoder parameters:  level 6
-  // (the default) and level 9 (the maximum).
-  for (chunk->level = 6; chunk->level <= 9; chunk->level += 3) {
-    chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
-    chunk->memLevel = 8;      // the default value.
-    chunk->method = Z_DEFLATED;
-    chunk->strategy = Z_DEFAULT_STRATEGY;
-
+  int i;
+  for (i = 0; i < NUM_DEFLATE_LEVELS; ++i) {
+    SetDeflateParameters(chunk, deflate_levels[i]);
     if (TryReconstruction(chunk, out) == 0) {
       free(out);
       return 0;
@@ -590,6 +653,88 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+/*
+ * One trial recompression of a deflate chunk at one level.  Trials
+ * only read the chunk, so any number of them can run at once.
+ */
+typedef struct {
+  ImageChunk* chunk;
+  int level;
+  int matched;
+} DeflateTrial;
+
+static void RunDeflateTrial(void* cookie, int index) {
+  DeflateTrial* t = ((DeflateTrial*)cookie) + index;
+  ImageChunk trial = *(t->chunk);
+  SetDeflateParameters(&trial, t->level);
+  unsigned char* out = malloc(BUFFER_SIZE);
+  t->matched = TryReconstruction(&trial, out) == 0;
+  free(out);
+}
+
+static void RunReconstructDeflateChunk(void* cookie, int index) {
+  DeflateTrial* t = ((DeflateTrial*)cookie) + index;
+  t->matched = ReconstructDeflateChunk(t->chunk) == 0;
+}
+
+/*
+ * ReconstructDeflateChunk for every deflate chunk in the list, storing
+ * its result in result[i] (normal chunks are left alone).  With more
+ * jobs than deflate chunks (a boot image has two), the levels of each
+ * chunk are also tried at once, rather than the next level only after
+ * the last one failed; a chunk still ends up with the lowest level
+ * that reproduces it.
+ */
+void ReconstructDeflateChunks(ImageChunk* chunks, int num_chunks,
+                              int jobs, int* result) {
+  int i, j;
+  int num_deflate = 0;
+  for (i = 0; i < num_chunks; ++i) {
+    if (chunks[i].type == CHUNK_DEFLATE) ++num_deflate;
+  }
+
+  if (jobs <= 1 || num_deflate >= jobs) {
+    DeflateTrial* trials = malloc(num_deflate * sizeof(DeflateTrial));
+    for (i = 0, j = 0; i < num_chunks; ++i) {
+      if (chunks[i].type == CHUNK_DEFLATE) trials[j++].chunk = chunks+i;
+    }
+    RunParallel(jobs, num_deflate, RunReconstructDeflateChunk, trials);
+    for (j = 0; j < num_deflate; ++j) {
+      result[trials[j].chunk - chunks] = trials[j].matched ? 0 : -1;
+    }
+    free(trials);
+    return;
+  }
+
+  DeflateTrial* trials =
+      malloc(num_chunks * NUM_DEFLATE_LEVELS * sizeof(DeflateTrial));
+  int num_trials = 0;
+  for (i = 0; i < num_chunks; ++i) {
+    if (chunks[i].type != CHUNK_DEFLATE) continue;
+    for (j = 0; j < NUM_DEFLATE_LEVELS; ++j) {
+      trials[num_trials].chunk = chunks+i;
+      trials[num_trials].level = deflate_levels[j];
+      trials[num_trials].matched = 0;
+      ++num_trials;
+    }
+  }
+
+  RunParallel(jobs, num_trials, RunDeflateTrial, trials);
+
+  for (i = 0; i < num_trials; i += NUM_DEFLATE_LEVELS) {
+    ImageChunk* chunk = trials[i].chunk;
+    result[chunk - chunks] = -1;
+    for (j = 0; j < NUM_DEFLATE_LEVELS; ++j) {
+      if (trials[i+j].matched) {
+        SetDeflateParameters(chunk, trials[i+j].level);
+        result[chunk - chunks] = 0;
+        break;
+      }
+    }
+  }
+  free(trials);
+}
+
 /*
  * Given source and target chunks, compute a bsdiff patch between them
  * by running bsdiff in a subprocess.  Return the patch data, placing
@@ -763,6 +908,36 @@ ImageChunk* FindChunkByName(const char* name,
   return NULL;
 }
 
+/*
+ * One chunk's bsdiff, for running on the work queue.  Jobs are handed
+ * out largest target first, so that a big chunk doesn't start last and
+ * leave the other threads idle while it finishes.
+ */
+typedef struct {
+  int index;
+  ImageChunk* src;
+  ImageChunk* tgt;
+  unsigned char* data;
+  size_t size;
+} PatchJob;
+
+static int patchjob_compare(const void* a, const void* b) {
+  size_t al = ((PatchJob*)a)->tgt->len;
+  size_t bl = ((PatchJob*)b)->tgt->len;
+  if (al > bl) {
+    return -1;
+  } else if (al < bl) {
+    return 1;
+  } else {
+    return ((PatchJob*)a)->index - ((PatchJob*)b)->index;
+  }
+}
+
+static void RunPatchJob(void* cookie, int index) {
+  PatchJob* job = ((PatchJob*)cookie) + index;
+  job->data = MakePatch(job->src, job->tgt, &(job->size));
+}
+
 void DumpChunks(ImageChunk* chunks, int num_chunks) {
     int i;
     for (i = 0; i < num_chunks; ++i) {
@@ -772,19 +947,31 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 }
 
 int main(int argc, char** argv) {
-  if (argc != 4 && argc != 5) {
-    usage:
-    printf("usage: %s [-z] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
-    return 2;
-  }
-
+  const char* progname = argv[0];
   int zip_mode = 0;
+  int jobs = 1;
+
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+      char* end;
+      jobs = strtol(argv[2], &end, 10);
+      if (*end != '\0' || jobs < 1) goto usage;
+      argc -= 2;
+      argv += 2;
+    } else {
+      goto usage;
+    }
+  }
 
-  if (strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  if (argc != 4) {
+    usage:
+    printf("usage: %s [-j <jobs>] [-z] <src-img> <tgt-img> <patch-file>\n",
+            progname);
+    return 2;
   }
 
 
@@ -844,13 +1031,16 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the
+  // input target image.  If this fails, treat the chunk as a normal
+  // non-deflated chunk.
+  int* reconstructed = malloc(num_tgt_chunks * sizeof(int));
+  ReconstructDeflateChunks(tgt_chunks, num_tgt_chunks, jobs, reconstructed);
+
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
-      // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      if (reconstructed[i] < 0) {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -886,6 +1076,7 @@ int main(int argc, char** argv) {
       }
     }
   }
+  free(reconstructed);
 
   // Merging neighboring normal chunks.
   if (zip_mode) {
@@ -910,21 +1101,48 @@ int main(int argc, char** argv) {
   // data, in the case of deflate chunks).
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* patch_jobs = malloc(num_tgt_chunks * sizeof(PatchJob));
   for (i = 0; i < num_tgt_chunks; ++i) {
+    ImageChunk* src;
     if (zip_mode) {
-      ImageChunk* src;
-      if (tgt_chunks[i].type == CHUNK_DEFLATE &&
+      if (tgt_chunks[i].type != CHUNK_DEFLATE ||
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
-                                 num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
-      } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+                                 num_src_chunks)) == NULL) {
+        src = src_chunks;
       }
     } else {
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      src = src_chunks+i;
     }
+    patch_jobs[i].index = i;
+    patch_jobs[i].src = src;
+    patch_jobs[i].tgt = tgt_chunks+i;
+  }
+
+  if (jobs > 1) {
+    // In zip mode every normal chunk, and every deflate chunk with no
+    // source of the same name, is patched against the whole source
+    // file; sort it once here rather than racing to do it in each job.
+    // Deflate chunks always go to bsdiff, whatever their length.
+    for (i = 0; i < num_tgt_chunks; ++i) {
+      if (patch_jobs[i].src == src_chunks &&
+          (patch_jobs[i].tgt->type == CHUNK_DEFLATE || patch_jobs[i].tgt->len > 160)) {
+        bsdiff_sort(src_chunks->data, src_chunks->len, &(src_chunks->I));
+        break;
+      }
+    }
+    qsort(patch_jobs, num_tgt_chunks, sizeof(PatchJob), patchjob_compare);
+  }
+  RunParallel(jobs, num_tgt_chunks, RunPatchJob, patch_jobs);
+
+  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    patch_data[patch_jobs[i].index] = patch_jobs[i].data;
+    patch_size[patch_jobs[i].index] = patch_jobs[i].size;
+  }
+  free(patch_jobs);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
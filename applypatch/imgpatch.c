@@ -18,8 +18,10 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -29,15 +31,30 @@
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx) {
+// A chunk record from the patch header.
+typedef struct {
+    int type;
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE
+    size_t expanded_len;
+    size_t target_len;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+
+    // CHUNK_RAW
+    const unsigned char* raw_data;
+    ssize_t raw_len;
+} ImageChunk;
+
+// Decodes every chunk record up front.  Returns the number of chunks, or
+// -1 if the patch is corrupt; *chunks must be freed by the caller.
+static int ReadImageChunks(const Value* patch, ImageChunk** chunks) {
     ssize_t pos = 12;
     char* header = patch->data;
     if (patch->size < 12) {
@@ -54,166 +71,450 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0 || num_chunks > patch->size / 4) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
+    *chunks = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(ImageChunk));
+    if (*chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
+        return -1;
+    }
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        ImageChunk* chunk = *chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        chunk->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (chunk->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            chunk->src_start = Read8(normal_header);
+            chunk->src_len = Read8(normal_header+8);
+            chunk->patch_offset = Read8(normal_header+16);
+        } else if (chunk->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            chunk->raw_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (chunk->raw_len < 0 || pos + chunk->raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            chunk->raw_data = (unsigned char*)patch->data + pos;
+            pos += chunk->raw_len;
+        } else if (chunk->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+            chunk->src_start = Read8(deflate_header);
+            chunk->src_len = Read8(deflate_header+8);
+            chunk->patch_offset = Read8(deflate_header+16);
+            chunk->expanded_len = Read8(deflate_header+24);
+            chunk->target_len = Read8(deflate_header+32);
+            chunk->level = Read4(deflate_header+40);
+            chunk->method = Read4(deflate_header+44);
+            chunk->windowBits = Read4(deflate_header+48);
+            chunk->memLevel = Read4(deflate_header+52);
+            chunk->strategy = Read4(deflate_header+56);
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, chunk->type);
+            goto fail;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    return num_chunks;
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly.
-            if (strm.avail_out != 0) {
-                printf("source inflation short by %d bytes\n", strm.avail_out);
-                return -1;
-            }
+fail:
+    free(*chunks);
+    *chunks = NULL;
+    return -1;
+}
+
+// Produces the output of one chunk, writing it to sink and adding it to
+// ctx (if not NULL).  Returns 0 on success.
+static int ApplyImageChunk(const ImageChunk* chunk, int i,
+                           const unsigned char* old_data, ssize_t old_size,
+                           const Value* patch,
+                           SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (chunk->type == CHUNK_NORMAL) {
+        if (ApplyBSDiffPatch(old_data + chunk->src_start, chunk->src_len,
+                             patch, chunk->patch_offset, sink, token, ctx) != 0) {
+            printf("failed to apply chunk %d bsdiff patch\n", i);
+            return -1;
+        }
+    } else if (chunk->type == CHUNK_RAW) {
+        if (ctx) {
+            SHA_update(ctx, chunk->raw_data, chunk->raw_len);
+        }
+        if (sink((unsigned char*)chunk->raw_data,
+                 chunk->raw_len, token) != chunk->raw_len) {
+            printf("failed to write chunk %d raw data\n", i);
+            return -1;
+        }
+    } else if (chunk->type == CHUNK_DEFLATE) {
+        size_t expanded_len = chunk->expanded_len;
+
+        // Decompress the source data; the chunk header tells us exactly
+        // how big we expect it to be when decompressed.
+
+        unsigned char* expanded_source = malloc(expanded_len);
+        if (expanded_source == NULL) {
+            printf("failed to allocate %d bytes for expanded_source\n",
+                   expanded_len);
+            return -1;
+        }
+
+        z_stream strm;
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = chunk->src_len;
+        strm.next_in = (unsigned char*)(old_data + chunk->src_start);
+        strm.avail_out = expanded_len;
+        strm.next_out = expanded_source;
+
+        int ret;
+        ret = inflateInit2(&strm, -15);
+        if (ret != Z_OK) {
+            printf("failed to init source inflation: %d\n", ret);
+            free(expanded_source);
+            return -1;
+        }
+
+        // Because we've provided enough room to accommodate the output
+        // data, we expect one call to inflate() to suffice.
+        ret = inflate(&strm, Z_SYNC_FLUSH);
+        if (ret != Z_STREAM_END) {
+            printf("source inflation returned %d\n", ret);
+            inflateEnd(&strm);
+            free(expanded_source);
+            return -1;
+        }
+        // We should have filled the output buffer exactly.
+        if (strm.avail_out != 0) {
+            printf("source inflation short by %d bytes\n", strm.avail_out);
             inflateEnd(&strm);
+            free(expanded_source);
+            return -1;
+        }
+        inflateEnd(&strm);
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+        // Next, apply the bsdiff patch (in memory) to the uncompressed
+        // data.
+        unsigned char* uncompressed_target_data;
+        ssize_t uncompressed_target_size;
+        if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                                patch, chunk->patch_offset,
+                                &uncompressed_target_data,
+                                &uncompressed_target_size) != 0) {
+            free(expanded_source);
+            return -1;
+        }
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+        // Now compress the target data and append it to the output.
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
+        // we're done with the expanded_source data buffer, so we'll
+        // reuse that memory to receive the output of deflate.
+        unsigned char* temp_data = expanded_source;
+        ssize_t temp_size = expanded_len;
+        if (temp_size < 32768) {
+            // ... unless the buffer is too small, in which case we'll
+            // allocate a fresh one.
+            free(temp_data);
+            temp_data = malloc(32768);
+            temp_size = 32768;
+        }
+
+        // now the deflate stream
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = uncompressed_target_size;
+        strm.next_in = uncompressed_target_data;
+        ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
+                           chunk->memLevel, chunk->strategy);
+        int result = 0;
+        do {
+            strm.avail_out = temp_size;
+            strm.next_out = temp_data;
+            ret = deflate(&strm, Z_FINISH);
+            ssize_t have = temp_size - strm.avail_out;
+
+            if (sink(temp_data, have, token) != have) {
+                printf("failed to write %ld compressed bytes to output\n",
+                       (long)have);
+                result = -1;
+                break;
+            }
+            if (ctx) {
                 SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
+            }
+        } while (ret != Z_STREAM_END);
+        deflateEnd(&strm);
 
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
+        free(temp_data);
+        free(uncompressed_target_data);
+        return result;
+    }
+    return 0;
+}
+
+// Parallel mode.  Workers take chunks in order and build each one's
+// output in memory; the calling thread passes the outputs to the sink
+// and the SHA context in chunk order as they complete.  A chunk is only
+// started while the memory held by started-but-unwritten chunks stays
+// within IMGPATCH_MEMORY_BUDGET, except that the chunk next in line may
+// always start, so a single oversized chunk still goes through (as it
+// would sequentially).
+
+#define IMGPATCH_MAX_THREADS    4
+#define IMGPATCH_MEMORY_BUDGET  (32 * 1024 * 1024)
+
+typedef struct {
+    unsigned char* data;
+    ssize_t size;
+    ssize_t alloc;
+} ChunkOutput;
+
+static ssize_t ChunkOutputSink(unsigned char* data, ssize_t len, void* token) {
+    ChunkOutput* out = (ChunkOutput*)token;
+    if (out->size + len > out->alloc) {
+        ssize_t alloc = out->alloc > 0 ? out->alloc : 65536;
+        while (alloc < out->size + len) alloc *= 2;
+        unsigned char* p = realloc(out->data, alloc);
+        if (p == NULL) {
             return -1;
         }
+        out->data = p;
+        out->alloc = alloc;
     }
+    memcpy(out->data + out->size, data, len);
+    out->size += len;
+    return len;
+}
+
+typedef struct {
+    const ImageChunk* chunks;
+    int num_chunks;
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next_start;         // next chunk a worker may take
+    size_t reserved;        // estimated memory of started, unwritten chunks
+    int failed;
+    size_t* cost;
+    int* done;
+    ChunkOutput* outputs;
+} ParallelPatch;
 
+// Rough peak memory for building a chunk's output: the expanded source,
+// the patched data and its compressed copy.
+static size_t ChunkCost(const ImageChunk* chunk, const Value* patch) {
+    size_t new_size = 0;
+    if (chunk->type != CHUNK_RAW &&
+        chunk->patch_offset + 32 <= (size_t)patch->size) {
+        new_size = Read8(patch->data + chunk->patch_offset + 24) & 0x7fffffff;
+    }
+    if (chunk->type == CHUNK_NORMAL) {
+        return new_size;
+    } else if (chunk->type == CHUNK_DEFLATE) {
+        return chunk->expanded_len + new_size + chunk->target_len;
+    }
     return 0;
 }
+
+static void* ImagePatchWorker(void* cookie) {
+    ParallelPatch* pp = (ParallelPatch*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&pp->lock);
+        while (!pp->failed && pp->next_start < pp->num_chunks &&
+               pp->reserved > 0 &&
+               pp->reserved + pp->cost[pp->next_start] > IMGPATCH_MEMORY_BUDGET) {
+            pthread_cond_wait(&pp->cond, &pp->lock);
+        }
+        if (pp->failed || pp->next_start >= pp->num_chunks) {
+            pthread_mutex_unlock(&pp->lock);
+            break;
+        }
+        int i = pp->next_start++;
+        pp->reserved += pp->cost[i];
+        pthread_mutex_unlock(&pp->lock);
+
+        // raw chunks are written straight from the patch by the caller.
+        int result = 0;
+        if (pp->chunks[i].type != CHUNK_RAW) {
+            result = ApplyImageChunk(pp->chunks + i, i, pp->old_data, pp->old_size,
+                                     pp->patch, ChunkOutputSink, pp->outputs + i, NULL);
+        }
+
+        pthread_mutex_lock(&pp->lock);
+        if (result != 0) pp->failed = 1;
+        pp->done[i] = 1;
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+    return NULL;
+}
+
+static int ApplyImageChunksParallel(const ImageChunk* chunks, int num_chunks,
+                                    int num_threads,
+                                    const unsigned char* old_data, ssize_t old_size,
+                                    const Value* patch,
+                                    SinkFn sink, void* token, SHA_CTX* ctx) {
+    ParallelPatch pp;
+    memset(&pp, 0, sizeof(pp));
+    pp.chunks = chunks;
+    pp.num_chunks = num_chunks;
+    pp.old_data = old_data;
+    pp.old_size = old_size;
+    pp.patch = patch;
+    pp.cost = calloc(num_chunks, sizeof(size_t));
+    pp.done = calloc(num_chunks, sizeof(int));
+    pp.outputs = calloc(num_chunks, sizeof(ChunkOutput));
+    if (pp.cost == NULL || pp.done == NULL || pp.outputs == NULL) {
+        free(pp.cost);
+        free(pp.done);
+        free(pp.outputs);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        pp.cost[i] = ChunkCost(chunks + i, patch);
+    }
+    pthread_mutex_init(&pp.lock, NULL);
+    pthread_cond_init(&pp.cond, NULL);
+
+    pthread_t threads[IMGPATCH_MAX_THREADS];
+    int started = 0;
+    while (started < num_threads &&
+           pthread_create(threads + started, NULL, ImagePatchWorker, &pp) == 0) {
+        ++started;
+    }
+
+    int result = -1;
+    if (started > 0) {
+        result = 0;
+        for (i = 0; i < num_chunks; ++i) {
+            pthread_mutex_lock(&pp.lock);
+            while (!pp.done[i] && !pp.failed) {
+                pthread_cond_wait(&pp.cond, &pp.lock);
+            }
+            int failed = pp.failed;
+            pthread_mutex_unlock(&pp.lock);
+            if (failed) {
+                result = -1;
+                break;
+            }
+
+            if (chunks[i].type == CHUNK_RAW) {
+                result = ApplyImageChunk(chunks + i, i, old_data, old_size, patch,
+                                         sink, token, ctx);
+            } else {
+                ChunkOutput* out = pp.outputs + i;
+                if (sink(out->data, out->size, token) != out->size) {
+                    printf("failed to write %ld bytes of chunk %d to output\n",
+                           (long)out->size, i);
+                    result = -1;
+                } else if (ctx) {
+                    SHA_update(ctx, out->data, out->size);
+                }
+                free(out->data);
+                out->data = NULL;
+            }
+
+            pthread_mutex_lock(&pp.lock);
+            pp.reserved -= pp.cost[i];
+            if (result != 0) pp.failed = 1;
+            pthread_cond_broadcast(&pp.cond);
+            pthread_mutex_unlock(&pp.lock);
+            if (result != 0) break;
+        }
+    }
+
+    pthread_mutex_lock(&pp.lock);
+    if (result != 0) pp.failed = 1;
+    pthread_cond_broadcast(&pp.cond);
+    pthread_mutex_unlock(&pp.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < num_chunks; ++i) {
+        free(pp.outputs[i].data);
+    }
+    free(pp.cost);
+    free(pp.done);
+    free(pp.outputs);
+    pthread_cond_destroy(&pp.cond);
+    pthread_mutex_destroy(&pp.lock);
+    return result;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ *
+ * When there is more than one CPU and more than one chunk to patch, the
+ * chunks are patched in parallel (see ApplyImageChunksParallel).
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx) {
+    ImageChunk* chunks;
+    int num_chunks = ReadImageChunks(patch, &chunks);
+    if (num_chunks < 0) {
+        return -1;
+    }
+
+    int patched_chunks = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type != CHUNK_RAW) ++patched_chunks;
+    }
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > IMGPATCH_MAX_THREADS) num_threads = IMGPATCH_MAX_THREADS;
+    if (num_threads > patched_chunks) num_threads = patched_chunks;
+
+    int result = 0;
+    if (num_threads > 1) {
+        result = ApplyImageChunksParallel(chunks, num_chunks, num_threads,
+                                          old_data, old_size, patch,
+                                          sink, token, ctx);
+    } else {
+        for (i = 0; i < num_chunks && result == 0; ++i) {
+            result = ApplyImageChunk(chunks + i, i, old_data, old_size, patch,
+                                     sink, token, ctx);
+        }
+    }
+
+    free(chunks);
+    return result;
+}
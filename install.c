@@ -25,6 +25,7 @@
 #include "common.h"
 #include "install.h"
 #include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
 #include "minui/minui.h"
 #include "minzip/SysUtil.h"
 #include "minzip/Zip.h"
@@ -41,6 +42,7 @@
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define PUBLIC_KEYS_FILE "/res/keys"
+#define STAGED_UPDATE_BINARY "/tmp/update_binary"
 
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
@@ -105,9 +107,15 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
 
 static const char *LAST_INSTALL_FILE = "/cache/recovery/last_install";
 
-// If the package contains an update binary, extract it and run it.
+// Packages that verified before can skip the whole-file hash when they
+// are installed again, if this file exists (see verify_file_start).
+static const char *VERIFY_CACHE_ENABLE_FILE = "/sdcard/clockworkmod/.verifycache";
+static const char *VERIFY_CACHE_FILE = "/cache/recovery/verify_cache";
+
+// If the package contains an update binary, extract it so it is ready
+// to run.  The archive is closed on failure.
 static int
-try_update_binary(const char *path, ZipArchive *zip) {
+stage_update_binary(ZipArchive *zip) {
     const ZipEntry* binary_entry =
             mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
     if (binary_entry == NULL) {
@@ -125,12 +133,11 @@ try_update_binary(const char *path, ZipArchive *zip) {
         return INSTALL_UPDATE_BINARY_MISSING;
     }
 
-    char* binary = "/tmp/update_binary";
-    unlink(binary);
-    int fd = creat(binary, 0755);
+    unlink(STAGED_UPDATE_BINARY);
+    int fd = creat(STAGED_UPDATE_BINARY, 0755);
     if (fd < 0) {
         mzCloseZipArchive(zip);
-        LOGE("Can't make %s\n", binary);
+        LOGE("Can't make %s\n", STAGED_UPDATE_BINARY);
         return 1;
     }
     bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
@@ -141,7 +148,13 @@ try_update_binary(const char *path, ZipArchive *zip) {
         mzCloseZipArchive(zip);
         return 1;
     }
+    return INSTALL_SUCCESS;
+}
 
+// Run the update binary staged by stage_update_binary.
+static int
+run_update_binary(const char *path, ZipArchive *zip) {
+    char* binary = STAGED_UPDATE_BINARY;
     int pipefd[2];
     pipe(pipefd);
 
@@ -273,10 +286,15 @@ try_update_binary(const char *path, ZipArchive *zip) {
 // The file may contain multiple keys in this format, separated by
 // commas.  The last key must not be followed by a comma.
 //
+// A key may be preceded by "v3", meaning the packages it signs are
+// hashed with SHA-256 instead of SHA-1 (still with exponent 3):
+//
+//  "v3 {64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
+//
 // Returns NULL if the file failed to parse, or if it contain zero keys.
-static RSAPublicKey*
+static Certificate*
 load_keys(const char* filename, int* numKeys) {
-    RSAPublicKey* out = NULL;
+    Certificate* out = NULL;
     *numKeys = 0;
 
     FILE* f = fopen(filename, "r");
@@ -289,9 +307,27 @@ load_keys(const char* filename, int* numKeys) {
     bool done = false;
     while (!done) {
         ++*numKeys;
-        out = realloc(out, *numKeys * sizeof(RSAPublicKey));
-        RSAPublicKey* key = out + (*numKeys - 1);
-        if (fscanf(f, " { %i , 0x%x , { %u",
+        out = realloc(out, *numKeys * sizeof(Certificate));
+        Certificate* cert = out + (*numKeys - 1);
+        RSAPublicKey* key = &cert->public_key;
+
+        char start_char;
+        if (fscanf(f, " %c", &start_char) != 1) goto exit;
+        if (start_char == 'v') {
+            int version;
+            if (fscanf(f, "%d {", &version) != 1) goto exit;
+            if (version != 3) {
+                LOGE("unsupported key version %d\n", version);
+                goto exit;
+            }
+            cert->hash_len = SHA256_DIGEST_SIZE;
+        } else if (start_char == '{') {
+            cert->hash_len = SHA_DIGEST_SIZE;
+        } else {
+            goto exit;
+        }
+
+        if (fscanf(f, " %i , 0x%x , { %u",
                    &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
             goto exit;
         }
@@ -350,10 +386,12 @@ really_install_package(const char *path)
     ui_print("正在打开升级包...\n");
 
     int err;
+    Certificate* loadedKeys = NULL;
+    VerifyJob* verify_job = NULL;
 
     if (signature_check_enabled) {
         int numKeys;
-        RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
             return INSTALL_CORRUPT;
@@ -366,28 +404,62 @@ really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
-        free(loadedKeys);
-        LOGI("verify_file returned %d\n", err);
-        if (err != VERIFY_SUCCESS) {
-            LOGE("signature verification failed\n");
-            return INSTALL_CORRUPT;
+        const char* cache_file = NULL;
+        struct stat st;
+        if (stat(VERIFY_CACHE_ENABLE_FILE, &st) == 0 &&
+            ensure_path_mounted(VERIFY_CACHE_FILE) == 0) {
+            cache_file = VERIFY_CACHE_FILE;
+        }
+
+        // The whole-file hash runs on another thread while the package
+        // is opened and its update binary extracted below, so the file
+        // is only read from storage once.  Nothing from the package runs
+        // until the signature checks out.
+        verify_job = verify_file_start(path, loadedKeys, numKeys, cache_file);
+        if (verify_job == NULL) {
+            err = verify_file(path, loadedKeys, numKeys);
+            free(loadedKeys);
+            LOGI("verify_file returned %d\n", err);
+            if (err != VERIFY_SUCCESS) {
+                LOGE("signature verification failed\n");
+                return INSTALL_CORRUPT;
+            }
         }
     }
 
-    /* Try to open the package.
+    /* Try to open the package and stage its update binary.
      */
     ZipArchive zip;
+    int status;
     err = mzOpenZipArchive(path, &zip);
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
-        return INSTALL_CORRUPT;
+        status = INSTALL_CORRUPT;
+    } else {
+        status = stage_update_binary(&zip);
+    }
+
+    if (verify_job != NULL) {
+        err = verify_file_finish(verify_job);
+        free(loadedKeys);
+        LOGI("verify_file returned %d\n", err);
+        if (err != VERIFY_SUCCESS) {
+            LOGE("signature verification failed\n");
+            if (status == INSTALL_SUCCESS) {
+                unlink(STAGED_UPDATE_BINARY);
+                mzCloseZipArchive(&zip);
+            }
+            return INSTALL_CORRUPT;
+        }
+    }
+    if (status != INSTALL_SUCCESS) {
+        return status;
     }
 
-    /* Verify and install the contents of the package.
+    /* Install the contents of the package.
      */
     ui_print("正在安装升级包...\n");
-    return try_update_binary(path, &zip);
+    return run_update_binary(path, &zip);
 }
 
 int
@@ -1,4 +1,20 @@
 LOCAL_PATH := $(call my-dir)
+
+ifneq ($(BOARD_USE_CUSTOM_RECOVERY_FONT),)
+  MINUI_FONT := $(BOARD_USE_CUSTOM_RECOVERY_FONT)
+else
+  MINUI_FONT := font_10x18.h
+endif
+
+# fontpack rewrites the font with the runs of each glyph kept together and
+# indexed, so graphics.c can decode a glyph when it is first drawn.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := fontpack.c
+LOCAL_CFLAGS += -DFONT_HEADER=\"$(MINUI_FONT)\"
+LOCAL_MODULE := minui_fontpack
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := events.c resources.c chinese.c
@@ -13,6 +29,17 @@ LOCAL_C_INCLUDES +=\
     external/zlib
 
 LOCAL_MODULE := libminui
+LOCAL_MODULE_CLASS := STATIC_LIBRARIES
+
+intermediates := $(call local-intermediates-dir)
+MINUI_PACKED_FONT := $(intermediates)/font_packed.h
+$(MINUI_PACKED_FONT): PRIVATE_FONTPACK := $(HOST_OUT_EXECUTABLES)/minui_fontpack$(HOST_EXECUTABLE_SUFFIX)
+$(MINUI_PACKED_FONT): $(HOST_OUT_EXECUTABLES)/minui_fontpack$(HOST_EXECUTABLE_SUFFIX)
+	@mkdir -p $(dir $@)
+	$(hide) $(PRIVATE_FONTPACK) > $@
+LOCAL_GENERATED_SOURCES += $(MINUI_PACKED_FONT)
+LOCAL_C_INCLUDES += $(intermediates)
+LOCAL_CFLAGS += -DRECOVERY_PACKED_FONT=\"font_packed.h\"
 
 ifeq ($(TARGET_RECOVERY_PIXEL_FORMAT),"RGBX_8888")
   LOCAL_CFLAGS += -DRECOVERY_RGBX
@@ -50,3 +77,11 @@ ifneq ($(MIN_TOUCH_Y),)
 endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gr_text_bench.c
+LOCAL_MODULE := gr_text_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES := libminui libpixelflinger_static libpng libz libcutils libc
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+include $(BUILD_EXECUTABLE)
@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "chinese.h"
 
 /* Our own notion of wide character, as UCS-4, according to ISO-10646-1. */
@@ -102,12 +103,35 @@ int ch_utf8_length(const char* s)
     int res;
     ucs4_t ch;
 
-    res = utf8_mbtowc(&ch, (const unsigned char*)s, strlen(s));
+    res = utf8_mbtowc(&ch, (const unsigned char*)s, strnlen(s, UTF8_MAX_BYTES));
     if(res <= 0)
         return 0;
     return res;
 }
 
+int ch_utf8_next(const char* s, int len, unsigned* ch, int* width)
+{
+    unsigned char c = *(const unsigned char*)s;
+    ucs4_t wc;
+    int res;
+
+    if(len <= 0 || c == 0)
+        return 0;
+    if(c < 0x80) {
+        *ch = c;
+        *width = (c < 0x20) ? 0 : 1;
+        return 1;
+    }
+    // utf8_mbtowc stops at the first byte that isn't a continuation
+    // byte, so it never reads past a terminating null
+    res = utf8_mbtowc(&wc, (const unsigned char*)s, len);
+    if(res <= 0)
+        return 0;
+    *ch = wc;
+    *width = 2;
+    return res;
+}
+
 #include "chinese_custom.h"
 
 int ch_utf8_to_custom(const char* s)
@@ -131,25 +155,51 @@ int ch_utf8_to_custom(const char* s)
         return 0;
 }
 
-int str_utf8_length(const char* s)
+#define ASCII_HIGH  0x8080808080808080ULL
+#define ASCII_SPACE 0x2020202020202020ULL
+
+// true if all 8 bytes of w are printable ascii (0x20..0x7f)
+static inline int all_printable(uint64_t w)
+{
+    return ((w & ASCII_HIGH) | ((w - ASCII_SPACE) & ~w & ASCII_HIGH)) == 0;
+}
+
+int str_utf8_width(const char* s, int len)
 {
-    int n, l, off;
+    const unsigned char* p = (const unsigned char*)s;
+    const unsigned char* end = p + len;
+    unsigned ch;
+    int width = 0, n, w;
 
-    n = 0;
-    off = 0;
-    while(*(s + off))
+    while(p < end)
     {
-        l = ch_utf8_length(s + off);
-        if (l > 0) {
-            off += l;
-            if (l == 1)
-                n += 1;
-            else
-                n += 2;
+        // runs of plain ascii go 16 bytes at a time
+        if(*p >= 0x20 && *p < 0x80) {
+            while(end - p >= 16) {
+                uint64_t a, b;
+                memcpy(&a, p, 8);
+                memcpy(&b, p + 8, 8);
+                if(!all_printable(a) || !all_printable(b))
+                    break;
+                width += 16;
+                p += 16;
+            }
+            if(p == end)
+                break;
         }
+        n = ch_utf8_next((const char*)p, end - p, &ch, &w);
+        if(n <= 0)
+            break;
+        width += w;
+        p += n;
     }
 
-    return n;
+    return width;
+}
+
+int str_utf8_length(const char* s)
+{
+    return str_utf8_width(s, strlen(s));
 }
 
 #if 0
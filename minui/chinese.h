@@ -6,9 +6,19 @@
 int ch_test_cjk(const char* s);
 // size of the next utf-8 charater
 int ch_utf8_length(const char* s);
+// no utf-8 sequence is longer than this
+#define UTF8_MAX_BYTES 6
+// decode the utf-8 character at s, reading at most len bytes: sets *ch to
+// its code point and *width to its columns (0 for control characters, 1
+// for ascii, 2 for anything else); returns its size, or 0 at the end of
+// the string or an invalid sequence
+int ch_utf8_next(const char* s, int len, unsigned* ch, int* width);
 // convert utf-8 to our custom encoding
 int ch_utf8_to_custom(const char* s);
-// 2 * wide chars + ascii chars
+// columns taken by the first len bytes of s, as ch_utf8_next counts them,
+// up to a terminating null or an invalid sequence
+int str_utf8_width(const char* s, int len);
+// the same for all of s
 int str_utf8_length(const char* s);
 
 #endif
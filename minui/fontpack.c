@@ -0,0 +1,111 @@
+/* Repacks a recovery font header for graphics.c.
+ *
+ * The font headers (font_10x18.h, fontcn_13x24.h, ...) hold one strip
+ * of glyphs, run-length encoded a whole scanline at a time, so finding
+ * one glyph means walking the runs of every glyph before it.  This
+ * reads the header named by FONT_HEADER and writes it back out with the
+ * runs of each cwidth-wide cell of the strip kept together, plus the
+ * offset of every cell's runs, so that graphics.c can decode a glyph the
+ * first time it is drawn without expanding the font.
+ *
+ *   cc -DFONT_HEADER='"fontcn_13x24.h"' -o fontpack fontpack.c
+ *   ./fontpack > font_packed.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include FONT_HEADER
+
+static void emit_run(unsigned count, unsigned char value, unsigned *emitted)
+{
+    while (count > 0) {
+        unsigned n = count < 127 ? count : 127;
+        printf("0x%02x,", n | (value ? 0x80 : 0x00));
+        if (++*emitted % 16 == 0)
+            printf("\n");
+        count -= n;
+    }
+}
+
+int main(void)
+{
+    unsigned cells = font.width / font.cwidth;
+    unsigned char *bits = calloc(font.width, font.height);
+    unsigned *offset = malloc((cells + 1) * sizeof(unsigned));
+    unsigned d, i, cell, emitted;
+
+    if (bits == NULL || offset == NULL) {
+        fprintf(stderr, "fontpack: out of memory\n");
+        return 1;
+    }
+
+#ifdef FONT_PACKED
+    /* already packed; expand it cell by cell */
+    for (cell = 0; cell < cells; cell++) {
+        d = 0;
+        for (i = font_cell_offset[cell]; i < font_cell_offset[cell + 1]; i++) {
+            unsigned n = font.rundata[i] & 0x7f;
+            for (; n > 0; n--, d++) {
+                bits[d / font.cwidth * font.width + cell * font.cwidth + d % font.cwidth] =
+                    (font.rundata[i] & 0x80) ? 0xff : 0;
+            }
+        }
+    }
+#else
+    unsigned char *in = font.rundata, data;
+    d = 0;
+    while ((data = *in++) && d < font.width * font.height) {
+        unsigned n = data & 0x7f;
+        for (i = 0; i < n && d < font.width * font.height; i++, d++)
+            bits[d] = (data & 0x80) ? 0xff : 0;
+    }
+#endif
+
+    printf("/* Generated by fontpack from %s; do not edit. */\n\n", FONT_HEADER);
+    printf("#define FONT_PACKED 1\n\n");
+    printf("struct {\n");
+    printf("  unsigned width;\n");
+    printf("  unsigned height;\n");
+    printf("  unsigned cwidth;\n");
+    printf("  unsigned cheight;\n");
+    printf("  unsigned char rundata[];\n");
+    printf("} font = {\n");
+    printf("  .width = %u,\n  .height = %u,\n  .cwidth = %u,\n  .cheight = %u,\n",
+           font.width, font.height, font.cwidth, font.cheight);
+    printf("  .rundata = {\n");
+
+    emitted = 0;
+    for (cell = 0; cell < cells; cell++) {
+        unsigned char value = bits[cell * font.cwidth];
+        unsigned count = 0, x, y;
+
+        offset[cell] = emitted;
+        for (y = 0; y < font.height; y++) {
+            for (x = 0; x < font.cwidth; x++) {
+                unsigned char v = bits[y * font.width + cell * font.cwidth + x];
+                if (v != value) {
+                    emit_run(count, value, &emitted);
+                    value = v;
+                    count = 0;
+                }
+                count++;
+            }
+        }
+        emit_run(count, value, &emitted);
+    }
+    offset[cells] = emitted;
+    printf("0x00,\n  }\n};\n\n");
+
+    /* where the runs of each cell start in rundata; one more entry marks
+     * the end of the last cell */
+    printf("static const unsigned font_cell_offset[%u] = {\n", cells + 1);
+    for (cell = 0; cell <= cells; cell++)
+        printf("%u,%s", offset[cell], cell % 12 == 11 ? "\n" : " ");
+    printf("\n};\n");
+
+    free(bits);
+    free(offset);
+    return 0;
+}
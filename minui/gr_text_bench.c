@@ -0,0 +1,79 @@
+/* Times gr_text drawing a screenful of mixed Chinese and ASCII text.
+ *
+ *   gr_text_bench [frames]
+ *
+ * It draws on the framebuffer, so run it with recovery stopped.  The
+ * first frame includes decoding the glyphs it uses; the others (100 by
+ * default) draw them from the cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "minui.h"
+
+static const char *lines[] = {
+    "正在安装更新...",
+    "Installing update from /sdcard/update.zip",
+    "正在备份 /data 分区 (system.ext4.tar)",
+    "/data/app/com.example.app-1.apk",
+    "校验 MD5 和... 完成",
+    "E: Can't mount /cache/recovery/log",
+    "清除缓存分区 - 格式化 /cache",
+    "- 从 SD 卡选择刷机包 (zip)",
+};
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void draw_frame(int rows, int cheight)
+{
+    int row;
+
+    gr_color(0, 0, 0, 255);
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    gr_color(200, 200, 200, 255);
+    for (row = 0; row < rows; row++) {
+        const char *line = lines[row % (sizeof(lines) / sizeof(lines[0]))];
+        int x = 1;
+        /* fill the row */
+        while (x < gr_fb_width())
+            x = gr_text(x, (row + 1) * cheight, line);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 100;
+    int cwidth, cheight, rows, i;
+    double start, first, rest;
+
+    if (gr_init() != 0) {
+        fprintf(stderr, "gr_init failed\n");
+        return 1;
+    }
+    gr_font_size(&cwidth, &cheight);
+    rows = gr_fb_height() / cheight;
+
+    start = now();
+    draw_frame(rows, cheight);
+    first = now() - start;
+
+    start = now();
+    for (i = 0; i < frames; i++)
+        draw_frame(rows, cheight);
+    rest = frames > 0 ? (now() - start) / frames : 0;
+    gr_flip();
+
+    printf("%d x %d, %d rows of text\n", gr_fb_width(), gr_fb_height(), rows);
+    printf("first frame %.2f ms, then %.2f ms per frame\n",
+           first * 1000, rest * 1000);
+
+    gr_exit();
+    return 0;
+}
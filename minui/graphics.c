@@ -16,6 +16,7 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -30,7 +31,9 @@
 
 #include <pixelflinger/pixelflinger.h>
 
-#ifdef BOARD_USE_CUSTOM_RECOVERY_FONT
+#if defined(RECOVERY_PACKED_FONT)
+#include RECOVERY_PACKED_FONT
+#elif defined(BOARD_USE_CUSTOM_RECOVERY_FONT)
 #include BOARD_USE_CUSTOM_RECOVERY_FONT
 #else
 #include "font_10x18.h"
@@ -51,15 +54,49 @@
 #endif
 
 typedef struct {
-    GGLSurface texture;
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
 } GRFont;
 
+/* Glyphs are decoded from the font's run-length data the first time they
+ * are drawn, into a cache of alpha masks keyed by code point, and blended
+ * straight into the memory surface.  A font packed by fontpack (see
+ * Android.mk) comes with the offset of each cell's runs.  Otherwise marks
+ * into the run data every GR_FONT_MARK_STEP pixels of each scanline let
+ * a glyph be decoded without expanding the rest of the font.
+ */
+#define GR_FONT_MARK_STEP 512
+#define GR_GLYPH_CACHE    512   /* glyphs kept, least recently drawn go first */
+#define GR_GLYPH_BUCKETS  1024  /* a power of two */
+
+typedef struct {
+    unsigned ch;                /* code point */
+    unsigned width;
+    unsigned char *mask;        /* width x cheight */
+    short bucket_next;          /* next glyph in the same hash bucket */
+    short lru_prev, lru_next;   /* more and less recently drawn glyphs */
+} GRGlyph;
+
 static GRFont *gr_font = 0;
 static GGLContext *gr_context = 0;
 static GGLSurface gr_font_texture;
+
+#ifndef FONT_PACKED
+static unsigned *font_mark_run;         /* index into font.rundata */
+static unsigned char *font_mark_skip;   /* pixels of that run before the mark */
+static unsigned font_marks_per_row;
+#endif
+
+static GRGlyph gr_glyphs[GR_GLYPH_CACHE];
+static short gr_glyph_bucket[GR_GLYPH_BUCKETS];
+static int gr_glyph_count;
+static short gr_glyph_lru_head, gr_glyph_lru_tail;  /* most, least recent */
+static unsigned char *gr_glyph_masks;
+
+/* The current color, for gr_text. */
+static unsigned char gr_text_r, gr_text_g, gr_text_b;
+
 static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
@@ -67,6 +104,30 @@ static unsigned gr_active_fb = 0;
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
+/* Drawing is clipped to this rectangle (x1, y1 inclusive; x2, y2
+ * exclusive), which is the whole screen unless gr_clip() narrowed it.
+ */
+static int gr_clip_x1, gr_clip_y1, gr_clip_x2, gr_clip_y2;
+
+/* Damage tracking.  Every primitive records the band of scanlines it
+ * touched in the memory surface as stale in both framebuffers, and
+ * gr_flip() copies only the stale bands of the buffer it is about to
+ * show.  A buffer's bands are kept disjoint; when there are too many,
+ * a new band is merged into the nearest one.
+ */
+#define GR_MAX_BANDS 8
+
+typedef struct {
+    int y1, y2;
+} GRBand;
+
+static GRBand gr_stale[2][GR_MAX_BANDS];
+static int gr_stale_count[2];
+
+/* Rows kept by gr_save_rows(). */
+static unsigned char *gr_saved_rows = NULL;
+static int gr_saved_y = 0, gr_saved_h = 0, gr_saved_max = 0;
+
 static struct fb_var_screeninfo vi;
 static struct fb_fix_screeninfo fi;
 
@@ -176,22 +237,170 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+static void add_stale_band(int fb, int y1, int y2)
+{
+    GRBand *bands = gr_stale[fb];
+    int *count = &gr_stale_count[fb];
+    int i;
+
+    /* absorb every band this one overlaps or touches */
+    for (i = 0; i < *count; ) {
+        if (bands[i].y1 <= y2 && y1 <= bands[i].y2) {
+            if (bands[i].y1 < y1) y1 = bands[i].y1;
+            if (bands[i].y2 > y2) y2 = bands[i].y2;
+            bands[i] = bands[--*count];
+        } else {
+            i++;
+        }
+    }
+
+    if (*count == GR_MAX_BANDS) {
+        /* full: fold the new band into its nearest neighbour */
+        int best = 0, best_gap = vi.yres;
+        for (i = 0; i < *count; i++) {
+            int gap = bands[i].y1 > y2 ? bands[i].y1 - y2 : y1 - bands[i].y2;
+            if (gap < best_gap) {
+                best = i;
+                best_gap = gap;
+            }
+        }
+        if (bands[best].y1 < y1) y1 = bands[best].y1;
+        if (bands[best].y2 > y2) y2 = bands[best].y2;
+        bands[best] = bands[--*count];
+    }
+
+    bands[*count].y1 = y1;
+    bands[*count].y2 = y2;
+    ++*count;
+}
+
+static void gr_damage(int y1, int y2)
+{
+    if (y1 < 0) y1 = 0;
+    if (y2 > (int) vi.yres) y2 = vi.yres;
+    if (y1 >= y2) return;
+    add_stale_band(0, y1, y2);
+    add_stale_band(1, y1, y2);
+}
+
+/* Draws the rectangle (x1, y1)-(x2, y2) with the current color or
+ * texture, clipped, and records the damage.
+ */
+static void gr_rect(GGLContext *gl, int x1, int y1, int x2, int y2)
+{
+    if (x1 < gr_clip_x1) x1 = gr_clip_x1;
+    if (y1 < gr_clip_y1) y1 = gr_clip_y1;
+    if (x2 > gr_clip_x2) x2 = gr_clip_x2;
+    if (y2 > gr_clip_y2) y2 = gr_clip_y2;
+    if (x1 >= x2 || y1 >= y2) return;
+
+    gl->recti(gl, x1, y1, x2, y2);
+    gr_damage(y1, y2);
+}
+
 void gr_flip(void)
 {
     GGLContext *gl = gr_context;
+    int i;
 
     /* swap front and back buffers */
     gr_active_fb = (gr_active_fb + 1) & 1;
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           fi.line_length * vi.yres);
+    /* copy the parts of the in-memory surface that changed since this
+     * buffer was last shown to the buffer we're about to make active. */
+    for (i = 0; i < gr_stale_count[gr_active_fb]; i++) {
+        GRBand *band = &gr_stale[gr_active_fb][i];
+        size_t offset = band->y1 * fi.line_length;
+        memcpy((char *) gr_framebuffer[gr_active_fb].data + offset,
+               (char *) gr_mem_surface.data + offset,
+               (band->y2 - band->y1) * fi.line_length);
+    }
+    gr_stale_count[gr_active_fb] = 0;
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
 }
 
+void gr_clip(int x, int y, int w, int h)
+{
+    gr_clip_x1 = x > 0 ? x : 0;
+    gr_clip_y1 = y > 0 ? y : 0;
+    gr_clip_x2 = x + w < (int) vi.xres ? x + w : (int) vi.xres;
+    gr_clip_y2 = y + h < (int) vi.yres ? y + h : (int) vi.yres;
+}
+
+void gr_noclip(void)
+{
+    gr_clip(0, 0, vi.xres, vi.yres);
+}
+
+void gr_scroll(int y, int h, int dy)
+{
+    int to = y + dy;
+
+    /* keep both the source and the destination on the screen */
+    if (y < 0) { h += y; to -= y; y = 0; }
+    if (to < 0) { h += to; y -= to; to = 0; }
+    if (y + h > (int) vi.yres) h = vi.yres - y;
+    if (to + h > (int) vi.yres) h = vi.yres - to;
+    if (h <= 0 || dy == 0) return;
+
+    memmove((char *) gr_mem_surface.data + to * fi.line_length,
+            (char *) gr_mem_surface.data + y * fi.line_length,
+            h * fi.line_length);
+    gr_damage(to, to + h);
+}
+
+bool gr_save_rows(int y, int h)
+{
+    int i;
+
+    if (y < 0) { h += y; y = 0; }
+    if (y + h > (int) vi.yres) h = vi.yres - y;
+    if (h <= 0) {
+        gr_saved_h = 0;
+        return false;
+    }
+
+    if (h > gr_saved_max) {
+        free(gr_saved_rows);
+        gr_saved_rows = malloc(h * fi.line_length);
+        gr_saved_max = gr_saved_rows != NULL ? h : 0;
+        if (gr_saved_rows == NULL) {
+            gr_saved_h = 0;
+            return false;
+        }
+    }
+    gr_saved_y = y;
+    gr_saved_h = h;
+    memcpy(gr_saved_rows, (char *) gr_mem_surface.data + y * fi.line_length,
+           h * fi.line_length);
+
+    for (i = 1; i < h; i++) {
+        if (memcmp(gr_saved_rows + i * fi.line_length, gr_saved_rows,
+                   vi.xres * PIXEL_SIZE) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void gr_restore_rows(int y, int h)
+{
+    int y2 = y + h;
+
+    if (y < gr_saved_y) y = gr_saved_y;
+    if (y < gr_clip_y1) y = gr_clip_y1;
+    if (y2 > gr_saved_y + gr_saved_h) y2 = gr_saved_y + gr_saved_h;
+    if (y2 > gr_clip_y2) y2 = gr_clip_y2;
+    if (y >= y2) return;
+
+    memcpy((char *) gr_mem_surface.data + y * fi.line_length,
+           gr_saved_rows + (y - gr_saved_y) * fi.line_length,
+           (y2 - y) * fi.line_length);
+    gr_damage(y, y2);
+}
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
     GGLContext *gl = gr_context;
@@ -201,20 +410,19 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+    gr_text_r = r;
+    gr_text_g = g;
+    gr_text_b = b;
 }
 
 int gr_measure(const char *s)
 {
     if (gr_font)
-    	return gr_font->cwidth * str_utf8_length(s);
+    	return gr_font->cwidth * str_utf8_width(s, strlen(s));
     return -1;
 }
 
-static GGLSurface font_ftex;
-static int font_bitmap_count;
-static int font_char_per_bitmap = 128;
-static void** font_data;
-
 #include <sys/time.h>
 
 void gr_font_size(int *x, int *y)
@@ -223,47 +431,269 @@ void gr_font_size(int *x, int *y)
     *y = gr_font->cheight;
 }
 
+#ifdef FONT_PACKED
+
+/* Decodes columns [x0, x0 + w) of the font into mask, a whole number of
+ * cells.
+ */
+static void gr_decode_glyph(unsigned x0, unsigned w, unsigned char *mask)
+{
+    unsigned cell, i, x, y;
+
+    memset(mask, 0, w * font.cheight);
+    if (x0 + w > font.width)
+        return;     /* not in this font */
+
+    for (cell = 0; cell < w / font.cwidth; cell++) {
+        unsigned char *out = mask + cell * font.cwidth;
+        x = y = 0;
+        for (i = font_cell_offset[x0 / font.cwidth + cell];
+             i < font_cell_offset[x0 / font.cwidth + cell + 1]; i++) {
+            unsigned n = font.rundata[i] & 0x7f;
+            if (!(font.rundata[i] & 0x80)) {
+                x += n;
+                y += x / font.cwidth;
+                x %= font.cwidth;
+                continue;
+            }
+            for (; n > 0; n--) {
+                if (y >= font.cheight)
+                    break;  /* rows below the mask, if height > cheight */
+                out[y * w + x] = 0xff;
+                if (++x == font.cwidth) {
+                    x = 0;
+                    y++;
+                }
+            }
+        }
+    }
+}
+
+#else
+
+/* Records where every GR_FONT_MARK_STEP'th pixel of each scanline of the
+ * font is in the run-length data: which run, and how far into it.
+ */
+static int gr_init_font_marks(void)
+{
+    unsigned marks, m, i, pos, mark;
+
+    font_marks_per_row = (font.width + GR_FONT_MARK_STEP - 1) / GR_FONT_MARK_STEP;
+    marks = font.height * font_marks_per_row;
+    font_mark_run = malloc(marks * sizeof(*font_mark_run));
+    font_mark_skip = malloc(marks);
+    if (font_mark_run == NULL || font_mark_skip == NULL)
+        return -1;
+
+    m = 0;
+    pos = 0;
+    for (i = 0; font.rundata[i] && m < marks; i++) {
+        unsigned n = font.rundata[i] & 0x7f;
+        for (;;) {
+            mark = m / font_marks_per_row * font.width +
+                   m % font_marks_per_row * GR_FONT_MARK_STEP;
+            if (m == marks || mark >= pos + n)
+                break;
+            font_mark_run[m] = i;
+            font_mark_skip[m] = mark - pos;
+            m++;
+        }
+        pos += n;
+    }
+    /* marks past the end of the data land on its terminator */
+    for (; m < marks; m++) {
+        font_mark_run[m] = i;
+        font_mark_skip[m] = 0;
+    }
+    return 0;
+}
+
+/* Decodes columns [x0, x0 + w) of the font into mask. */
+static void gr_decode_glyph(unsigned x0, unsigned w, unsigned char *mask)
+{
+    unsigned row;
+
+    memset(mask, 0, w * font.cheight);
+    if (x0 + w > font.width)
+        return;     /* not in this font */
+
+    for (row = 0; row < font.cheight && row < font.height; row++) {
+        unsigned m = row * font_marks_per_row + x0 / GR_FONT_MARK_STEP;
+        unsigned i = font_mark_run[m];
+        unsigned x = x0 / GR_FONT_MARK_STEP * GR_FONT_MARK_STEP;
+        unsigned left = (font.rundata[i] & 0x7f) - font_mark_skip[m];
+        unsigned char *out = mask + row * w;
+
+        while (x < x0 + w && font.rundata[i]) {
+            unsigned from = x > x0 ? x : x0;
+            unsigned to = x + left < x0 + w ? x + left : x0 + w;
+            if (from < to && (font.rundata[i] & 0x80))
+                memset(out + from - x0, 0xff, to - from);
+            x += left;
+            left = font.rundata[++i] & 0x7f;
+        }
+    }
+}
+
+#endif
+
+static void gr_glyph_lru_unlink(int n)
+{
+    GRGlyph *glyph = &gr_glyphs[n];
+
+    if (glyph->lru_prev >= 0)
+        gr_glyphs[glyph->lru_prev].lru_next = glyph->lru_next;
+    else
+        gr_glyph_lru_head = glyph->lru_next;
+    if (glyph->lru_next >= 0)
+        gr_glyphs[glyph->lru_next].lru_prev = glyph->lru_prev;
+    else
+        gr_glyph_lru_tail = glyph->lru_prev;
+}
+
+static void gr_glyph_lru_push(int n)
+{
+    GRGlyph *glyph = &gr_glyphs[n];
+
+    glyph->lru_prev = -1;
+    glyph->lru_next = gr_glyph_lru_head;
+    if (gr_glyph_lru_head >= 0)
+        gr_glyphs[gr_glyph_lru_head].lru_prev = n;
+    else
+        gr_glyph_lru_tail = n;
+    gr_glyph_lru_head = n;
+}
+
+/* Returns the cached glyph for code point ch, which starts s, decoding
+ * it first if it isn't cached yet.
+ */
+static GRGlyph *gr_glyph(unsigned ch, const char *s)
+{
+    unsigned bucket = (ch * 2654435761u) >> 16 & (GR_GLYPH_BUCKETS - 1);
+    unsigned off, x0, cells;
+    short *link;
+    int n;
+
+    for (n = gr_glyph_bucket[bucket]; n >= 0; n = gr_glyphs[n].bucket_next) {
+        if (gr_glyphs[n].ch == ch) {
+            if (n != gr_glyph_lru_head) {
+                gr_glyph_lru_unlink(n);
+                gr_glyph_lru_push(n);
+            }
+            return &gr_glyphs[n];
+        }
+    }
+
+    if (gr_glyph_count < GR_GLYPH_CACHE) {
+        n = gr_glyph_count++;
+    } else {
+        /* full: reuse the glyph that was drawn least recently */
+        n = gr_glyph_lru_tail;
+        gr_glyph_lru_unlink(n);
+        link = &gr_glyph_bucket[(gr_glyphs[n].ch * 2654435761u) >> 16 &
+                                (GR_GLYPH_BUCKETS - 1)];
+        while (*link != n)
+            link = &gr_glyphs[*link].bucket_next;
+        *link = gr_glyphs[n].bucket_next;
+    }
+
+    off = ch_utf8_to_custom(s);
+    if (off >= 96) {
+        x0 = (96 + (off - 96) * 2) * font.cwidth;
+        cells = 2;
+    } else {
+        x0 = off * font.cwidth;
+        cells = 1;
+    }
+
+    GRGlyph *glyph = &gr_glyphs[n];
+    glyph->ch = ch;
+    glyph->width = cells * font.cwidth;
+    glyph->mask = gr_glyph_masks + n * 2 * font.cwidth * font.cheight;
+    gr_decode_glyph(x0, glyph->width, glyph->mask);
+
+    glyph->bucket_next = gr_glyph_bucket[bucket];
+    gr_glyph_bucket[bucket] = n;
+    gr_glyph_lru_push(n);
+    return glyph;
+}
+
+/* Blends a glyph's mask in the current color into the memory surface at
+ * (x, y), clipped.
+ */
+static void gr_blend_glyph(const GRGlyph *glyph, int x, int y)
+{
+    int x1 = x, y1 = y;
+    int x2 = x + glyph->width, y2 = y + gr_font->cheight;
+    int w, row, i;
+
+    if (x1 < gr_clip_x1) x1 = gr_clip_x1;
+    if (y1 < gr_clip_y1) y1 = gr_clip_y1;
+    if (x2 > gr_clip_x2) x2 = gr_clip_x2;
+    if (y2 > gr_clip_y2) y2 = gr_clip_y2;
+    if (x1 >= x2 || y1 >= y2) return;
+    w = x2 - x1;
+
+    for (row = y1; row < y2; row++) {
+        const unsigned char *src = glyph->mask + (row - y) * glyph->width + (x1 - x);
+        unsigned char *dst = (unsigned char *) gr_mem_surface.data +
+                (row * gr_mem_surface.stride + x1) * PIXEL_SIZE;
+        for (i = 0; i < w; i++, dst += PIXEL_SIZE) {
+            unsigned a = src[i], na = 255 - a;
+            if (a == 0)
+                continue;
+#if PIXEL_SIZE == 2
+            unsigned short d = *(unsigned short *) dst;
+            unsigned r = gr_text_r, g = gr_text_g, b = gr_text_b;
+            if (a != 255) {
+                r = (r * a + (((d >> 11) & 0x1f) << 3) * na + 127) / 255;
+                g = (g * a + (((d >> 5) & 0x3f) << 2) * na + 127) / 255;
+                b = (b * a + ((d & 0x1f) << 3) * na + 127) / 255;
+            }
+            *(unsigned short *) dst = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+#else
+#if defined(RECOVERY_BGRA)
+            unsigned char *pr = dst + 2, *pg = dst + 1, *pb = dst;
+#else
+            unsigned char *pr = dst, *pg = dst + 1, *pb = dst + 2;
+#endif
+            if (a == 255) {
+                *pr = gr_text_r;
+                *pg = gr_text_g;
+                *pb = gr_text_b;
+                dst[3] = 0xff;
+            } else {
+                *pr = (gr_text_r * a + *pr * na + 127) / 255;
+                *pg = (gr_text_g * a + *pg * na + 127) / 255;
+                *pb = (gr_text_b * a + *pb * na + 127) / 255;
+                dst[3] = (255 * a + dst[3] * na + 127) / 255;
+            }
+#endif
+        }
+    }
+    gr_damage(y1, y2);
+}
+
 int gr_text(int x, int y, const char *s)
 {
-    GGLContext *gl = gr_context;
     GRFont *gfont = gr_font;
-    unsigned off, width, height, font_bitmap_width, n;
+    unsigned ch;
+    int n, width;
 
     y -= gfont->ascent;
 
-    //gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
+    /* a line outside the clip only needs measuring */
+    bool visible = y < gr_clip_y2 && y + (int) gfont->cheight > gr_clip_y1;
 
-    while((off = *s)) {
-        if(*((unsigned char*)(s)) < 0x20) {
-            s++;
+    while ((n = ch_utf8_next(s, UTF8_MAX_BYTES, &ch, &width)) > 0) {
+        if (width == 0) {
+            s += n;
             continue;
         }
-        width = gfont->cwidth;
-        height = gfont->cheight;
-        off = ch_utf8_to_custom(s);
-        if(off >= 96)
-            width *= 2;
-        memcpy(&font_ftex, &gfont->texture, sizeof(font_ftex));
-        font_bitmap_width = (font.width % (font.cwidth * font_char_per_bitmap));
-        if(!font_bitmap_width)
-            font_bitmap_width = font.cwidth * font_char_per_bitmap;
-        font_ftex.width = font_bitmap_width;
-        font_ftex.stride = font_bitmap_width;
-        font_ftex.data = font_data[(off < 96) ? (off / font_char_per_bitmap) : ((96 + (off - 96) * 2) / font_char_per_bitmap)];
-        gl->bindTexture(gl, &font_ftex);
-        if(off >= 96)
-            gl->texCoord2i(gl, ((96 + (off - 96) * 2) * font.cwidth) % (font_char_per_bitmap * font.cwidth) - x, 0 - y);
-        else
-            gl->texCoord2i(gl, (off % font_char_per_bitmap) * width - x, 0 - y);
-        gl->recti(gl, x, y, x + width, y + height);
-        x += width;
-        n = ch_utf8_length(s);
-        if(n <= 0)
-            break;
+        GRGlyph *glyph = gr_glyph(ch, s);
+        if (visible)
+            gr_blend_glyph(glyph, x, y);
+        x += glyph->width;
         s += n;
     }
 
@@ -274,7 +704,7 @@ void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
-    gl->recti(gl, x, y, w, h);
+    gr_rect(gl, x, y, w, h);
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -289,7 +719,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
     gl->texCoord2i(gl, sx - dx, sy - dy);
-    gl->recti(gl, dx, dy, dx + w, dy + h);
+    gr_rect(gl, dx, dy, dx + w, dy + h);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -306,47 +736,29 @@ unsigned int gr_get_height(gr_surface surface) {
     return ((GGLSurface*) surface)->height;
 }
 
-static void gr_init_font(void)
+static int gr_init_font(void)
 {
-    GGLSurface *ftex;
-    unsigned char *bits, *rle;
-    unsigned char *in, data;
-    int i, d, n, bmp, pos;
-
     gr_font = calloc(sizeof(*gr_font), 1);
-    ftex = &gr_font->texture;
-
-    font_bitmap_count = font.width / font.cwidth / font_char_per_bitmap + 1;
-    font_data = (void**)malloc(font_bitmap_count * sizeof(void*));
-    for(n = 0; n < font_bitmap_count; n++)
-    {
-        font_data[n] = malloc(font_char_per_bitmap * font.cwidth * font.cheight);
-        memset(font_data[n], 0, font_char_per_bitmap * font.cwidth * font.cheight);
-    }
-    d = 0;
-    in = font.rundata;
-    while((data = *in++))
-    {
-        n = data & 0x7f;
-        for(i = 0; i < n; i++, d++)
-        {
-            bmp = d % font.width / (font.cwidth * font_char_per_bitmap);
-            pos = d / font.width * (font.cwidth * font_char_per_bitmap) + (d % (font.cwidth * font_char_per_bitmap));
-            ((unsigned char*)(font_data[bmp]))[pos] = (data & 0x80) ? 0xff : 0;
-        }
-    }
-    bits = font_data[0];
-
-    ftex->version = sizeof(*ftex);
-    ftex->width = font.width;
-    ftex->height = font.height;
-    ftex->stride = font.width;
-    ftex->data = (void*) bits;
-    ftex->format = GGL_PIXEL_FORMAT_A_8;
-
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    /* room for GR_GLYPH_CACHE double-width glyphs */
+    gr_glyph_masks = malloc(GR_GLYPH_CACHE * 2 * font.cwidth * font.cheight);
+    memset(gr_glyph_bucket, 0xff, sizeof(gr_glyph_bucket));
+    gr_glyph_count = 0;
+    gr_glyph_lru_head = gr_glyph_lru_tail = -1;
+    if (gr_glyph_masks == NULL) {
+        fprintf(stderr, "can't allocate the font cache\n");
+        return -1;
+    }
+#ifndef FONT_PACKED
+    if (gr_init_font_marks() != 0) {
+        fprintf(stderr, "can't allocate the font cache\n");
+        return -1;
+    }
+#endif
+    return 0;
 }
 
 int gr_init(void)
@@ -354,7 +766,8 @@ int gr_init(void)
     gglInit(&gr_context);
     GGLContext *gl = gr_context;
 
-    gr_init_font();
+    if (gr_init_font() != 0)
+        return -1;
     gr_vt_fd = open("/dev/tty0", O_RDWR | O_SYNC);
     if (gr_vt_fd < 0) {
         // This is non-fatal; post-Cupcake kernels don't have tty0.
@@ -373,6 +786,8 @@ int gr_init(void)
     }
 
     get_memory_surface(&gr_mem_surface);
+    gr_noclip();
+    gr_damage(0, vi.yres);
 
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
@@ -398,6 +813,9 @@ void gr_exit(void)
     gr_fb_fd = -1;
 
     free(gr_mem_surface.data);
+    free(gr_saved_rows);
+    gr_saved_rows = NULL;
+    gr_saved_h = gr_saved_max = 0;
 
     ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
     close(gr_vt_fd);
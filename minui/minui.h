@@ -38,6 +38,22 @@ int gr_measure(const char *s);
 void gr_font_size(int *x, int *y);
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
+
+// Drawing only touches the parts of the screen it changes: each primitive
+// is clipped to the rectangle set by gr_clip (the whole screen after
+// gr_noclip), and gr_flip copies only the scanlines drawn since the
+// buffer being shown was last current.
+void gr_clip(int x, int y, int w, int h);
+void gr_noclip(void);
+// Moves the full-width band of rows [y, y+h) by dy rows (negative is up).
+// The rows it uncovers keep their old contents.
+void gr_scroll(int y, int h, int dy);
+// Keeps a copy of rows [y, y+h) as they are now, such as the background
+// under a block of text, for gr_restore_rows to put back (clipped) when
+// the text changes.  Returns true if all the saved rows are identical,
+// so that what is drawn over them can also be moved with gr_scroll.
+bool gr_save_rows(int y, int h);
+void gr_restore_rows(int y, int h);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
 
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -192,6 +193,48 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     return 0;
 }
 
+/*
+ * Map "length" bytes of a file starting at a 64-bit offset, for files too
+ * big to map whole.  The caller makes sure the range is inside the file.
+ *
+ * On success, returns 0 and fills out "pMap".
+ */
+int sysMapFileRangeInShmem(int fd, off64_t start, size_t length,
+    MemMapping* pMap)
+{
+    size_t adjust, actualLength;
+    off64_t actualStart;
+    void* memPtr;
+
+    assert(pMap != NULL);
+
+    adjust = start % DEFAULT_PAGE_SIZE;
+    actualStart = start - adjust;
+    actualLength = length + adjust;
+
+#if defined(__BIONIC__) && !defined(__LP64__)
+    /* 32-bit bionic's mmap() takes a 32-bit offset; mmap2 counts pages. */
+    memPtr = (void*) syscall(__NR_mmap2, NULL, actualLength, PROT_READ,
+                MAP_FILE | MAP_SHARED, fd,
+                (unsigned long) (actualStart / DEFAULT_PAGE_SIZE));
+#else
+    memPtr = mmap64(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
+                fd, actualStart);
+#endif
+    if (memPtr == MAP_FAILED) {
+        LOGW("mmap(%zu, R, FILE|SHARED, %d, %lld) failed: %s\n",
+            actualLength, fd, (long long) actualStart, strerror(errno));
+        return -1;
+    }
+
+    pMap->baseAddr = memPtr;
+    pMap->baseLength = actualLength;
+    pMap->addr = (char*)memPtr + adjust;
+    pMap->length = length;
+
+    return 0;
+}
+
 /*
  * Release a memory mapping.
  */
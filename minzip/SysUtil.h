@@ -51,6 +51,13 @@ int sysMapFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap);
 
+/*
+ * Map part of a file at a 64-bit offset, for files that are too big to
+ * map whole.  The range must lie inside the file.
+ */
+int sysMapFileRangeInShmem(int fd, off64_t start, size_t length,
+    MemMapping* pMap);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
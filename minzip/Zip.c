@@ -9,8 +9,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>   // for madvise()
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -23,7 +25,17 @@
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+/* Largest piece of a STORED entry passed to a process function at once. */
+#define STORED_CHUNK_SIZE (1024 * 1024)
+
+/* Largest piece of entry data mapped at once, when the archive is too big
+ * to map whole.
+ */
+#define ZIP_WINDOW_SIZE (64 * 1024 * 1024)
 
 /*
  * Offset and length constants (java.util.zip naming convention).
@@ -77,6 +89,20 @@ enum {
     LOCNAM = 26,
     LOCEXT = 28,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTRA_ID = 0x0001,
+
     STORED = 0,
     DEFLATED = 8,
 
@@ -91,70 +117,79 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
-        pEntry->compLen, pEntry->uncompLen, pEntry->compression);
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n",
+        (long long) pEntry->offset, (long long) pEntry->compLen,
+        (long long) pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
+ * Compare an entry's name with a name of the given length, in the byte
+ * order the entries are sorted in.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static int compareEntryName(const ZipEntry* pEntry, const char* name,
+    unsigned int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    unsigned int len = pEntry->fileNameLen < nameLen ?
+            pEntry->fileNameLen : nameLen;
+    int diff = memcmp(pEntry->fileName, name, len);
+    if (diff != 0)
+        return diff;
+    if (pEntry->fileNameLen != nameLen)
+        return pEntry->fileNameLen < nameLen ? -1 : 1;
+    return 0;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * Like compareEntryName, but an entry that starts with prefix compares
+ * equal to it.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static int compareEntryPrefix(const ZipEntry* pEntry, const char* prefix,
+    unsigned int prefixLen)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    if (pEntry->fileNameLen <= prefixLen)
+        return compareEntryName(pEntry, prefix, prefixLen);
+    return memcmp(pEntry->fileName, prefix, prefixLen);
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
+ * (This is a qsort callback.)
  *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Order entries by name.  Entries with the same name stay in central
+ * directory order, so lookups find the first of them.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static int sortcmpZipEntry(const void* ventry1, const void* ventry2)
 {
-    unsigned int hash = 2;
-
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    int diff = compareEntryName(entry1, entry2->fileName,
+            entry2->fileNameLen);
 
-    return hash;
+    if (diff != 0)
+        return diff;
+    return entry1->fileName < entry2->fileName ? -1 :
+            entry1->fileName > entry2->fileName;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Return the index of the first entry for which compare() is >= 0
+ * (or > 0 if "after" is set), or numEntries if there is none.
+ */
+static unsigned int searchEntries(const ZipArchive* pArchive,
+    int (*compare)(const ZipEntry*, const char*, unsigned int),
+    const char* name, unsigned int nameLen, bool after)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    unsigned int low = 0, high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        int diff = compare(&pArchive->pEntries[mid], name, nameLen);
+        if (diff < 0 || (after && diff == 0))
+            low = mid + 1;
+        else
+            high = mid;
     }
+    return low;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -178,17 +213,49 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 }
 
 /*
- * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * Read "len" bytes at "offset" in the archive.  Bytes covered by the
+ * archive mapping are returned in place; others are read into "buf".
+ *
+ * Returns NULL on a short read.
+ */
+static const unsigned char* readArchive(const ZipArchive* pArchive,
+    int64_t offset, size_t len, unsigned char* buf)
+{
+    if (offset >= pArchive->mapOffset &&
+        offset - pArchive->mapOffset + (int64_t)len <=
+            (int64_t)pArchive->map.length)
+    {
+        return (const unsigned char*)pArchive->map.addr
+            + (offset - pArchive->mapOffset);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread64(pArchive->fd, buf + done, len - done,
+                offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return NULL;
+        done += n;
+    }
+    return buf;
+}
+
+/*
+ * Find the central directory from the EOCD record at the end of the
+ * file, and from the ZIP64 EOCD record if the archive has one.
  *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool findCentralDirectory(const ZipArchive* pArchive,
+    int64_t* pCdOffset, int64_t* pCdSize, uint64_t* pNumEntries)
 {
     bool result = false;
+    unsigned char sig[4];
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    unsigned char* tail = NULL;
+    size_t tailLen;
     unsigned int val;
 
     /*
@@ -196,7 +263,12 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    ptr = readArchive(pArchive, 0, sizeof(sig), sig);
+    if (ptr == NULL) {
+        LOGV("Can't read Zip signature\n");
+        goto bail;
+    }
+    val = get4LE(ptr);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -207,52 +279,153 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment, which can't be longer than 64K.  The ZIP64 locator, if
+     * any, sits just in front of it.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pMap->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
+    tailLen = ZIP64_LOCHDR + ENDHDR + 0xffff;
+    if ((int64_t)tailLen > pArchive->length)
+        tailLen = pArchive->length;
+    tail = (unsigned char*) malloc(tailLen);
+    if (tail == NULL)
+        goto bail;
+    ptr = readArchive(pArchive, pArchive->length - tailLen, tailLen, tail);
+    if (ptr == NULL) {
+        LOGW("Can't read the end of the Zip archive\n");
+        goto bail;
+    }
+    const unsigned char* eocd = ptr + tailLen - ENDHDR;
+    while (eocd >= ptr) {
+        if (*eocd == (ENDSIG & 0xff) && get4LE(eocd) == ENDSIG)
             break;
-        ptr--;
+        eocd--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (eocd < ptr) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
 
     /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
+     * There are three interesting items in the EOCD block: the number of
+     * entries in the file, and the size and file offset of the central
+     * directory.  A ZIP64 archive has 64-bit copies of them in the ZIP64
+     * EOCD record.
      */
-    numEntries = get2LE(ptr + ENDSUB);
-    cdOffset = get4LE(ptr + ENDOFF);
+    *pNumEntries = get2LE(eocd + ENDSUB);
+    *pCdSize = get4LE(eocd + ENDSIZ);
+    *pCdOffset = get4LE(eocd + ENDOFF);
+
+    if (eocd - ptr >= ZIP64_LOCHDR &&
+        get4LE(eocd - ZIP64_LOCHDR) == ZIP64_LOCSIG)
+    {
+        unsigned char rec[ZIP64_ENDHDR];
+        uint64_t recOffset = get8LE(eocd - ZIP64_LOCHDR + ZIP64_LOCOFF);
+        const unsigned char* z64 = NULL;
+
+        if (pArchive->length >= ZIP64_ENDHDR &&
+            recOffset <= (uint64_t)pArchive->length - ZIP64_ENDHDR)
+            z64 = readArchive(pArchive, recOffset, ZIP64_ENDHDR, rec);
+        if (z64 == NULL || get4LE(z64) != ZIP64_ENDSIG) {
+            LOGW("Missed the ZIP64 end-of-central-directory record\n");
+            goto bail;
+        }
+        *pNumEntries = get8LE(z64 + ZIP64_ENDSUB);
+        *pCdSize = get8LE(z64 + ZIP64_ENDSIZ);
+        *pCdOffset = get8LE(z64 + ZIP64_ENDOFF);
+    }
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    LOGVV("numEntries=%llu cdOffset=%lld cdSize=%lld\n",
+        (unsigned long long) *pNumEntries, (long long) *pCdOffset,
+        (long long) *pCdSize);
+    if (*pNumEntries == 0 || *pCdOffset < 0 || *pCdSize < 0 ||
+        *pCdOffset > pArchive->length ||
+        *pCdSize > pArchive->length - *pCdOffset ||
+        *pNumEntries > (uint64_t)*pCdSize / CENHDR)
+    {
+        LOGW("Invalid entries=%llu offset=%lld size=%lld (len=%lld)\n",
+            (unsigned long long) *pNumEntries, (long long) *pCdOffset,
+            (long long) *pCdSize, (long long) pArchive->length);
         goto bail;
     }
 
+    result = true;
+
+bail:
+    free(tail);
+    return result;
+}
+
+/*
+ * Fill in the 64-bit sizes and local header offset of an entry whose
+ * central directory fields are saturated, from its ZIP64 extra field.
+ * The extra field holds only the saturated values, in this order.
+ *
+ * Returns "true" on success.
+ */
+static bool readZip64Extra(const unsigned char* extra, unsigned int extraLen,
+    uint64_t* pUncompLen, uint64_t* pCompLen, uint64_t* pLocalHdrOffset)
+{
+    uint64_t* fields[3] = { pUncompLen, pCompLen, pLocalHdrOffset };
+
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+        if (size > extraLen - 4)
+            return false;
+        if (id == ZIP64_EXTRA_ID) {
+            const unsigned char* p = extra + 4;
+            int i;
+            for (i = 0; i < 3; i++) {
+                if (*fields[i] != 0xffffffff)
+                    continue;
+                if (p + 8 > extra + 4 + size)
+                    return false;
+                *fields[i] = get8LE(p);
+                p += 8;
+            }
+            return true;
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return false;
+}
+
+/*
+ * Parse the contents of a Zip archive.  We scan out the contents of the
+ * central directory in one pass and then sort the entries by name, which
+ * makes them their own index: lookups and prefix matches are binary
+ * searches.
+ *
+ * Returns "true" on success.
+ */
+static bool parseZipArchive(ZipArchive* pArchive, int64_t cdOffset,
+    int64_t cdSize, unsigned int numEntries)
+{
+    bool result = false;
+    const unsigned char* ptr;
+    const unsigned char* cdEnd;
+    unsigned int i;
+
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = (const unsigned char*)pArchive->map.addr
+        + (cdOffset - pArchive->mapOffset);
+    cdEnd = ptr + cdSize;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
+        unsigned int fileNameLen, extraLen, commentLen;
+        uint64_t compLen, uncompLen, localHdrOffset;
+        unsigned char localHdrBuf[LOCHDR];
         const unsigned char* localHdr;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > cdEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -266,7 +439,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if ((const unsigned char*)fileName + fileNameLen + extraLen > cdEnd) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,58 +448,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -334,8 +456,8 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -352,64 +474,60 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
+        if (compLen == 0xffffffff || uncompLen == 0xffffffff ||
+            localHdrOffset == 0xffffffff)
+        {
+            if (!readZip64Extra(ptr + CENHDR + fileNameLen, extraLen,
+                    &uncompLen, &compLen, &localHdrOffset)) {
+                LOGW("Bad ZIP64 extra field (at %d)\n", i);
+                goto bail;
+            }
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+
+        // All three values are untrusted; keep them inside the file.
+        if (pArchive->length < LOCHDR ||
+            localHdrOffset > (uint64_t)pArchive->length - LOCHDR ||
+            compLen > (uint64_t)pArchive->length ||
+            uncompLen > (uint64_t)INT64_MAX)
+        {
+            LOGW("Bad offset to local header: %lld (at %d)\n",
+                (long long) localHdrOffset, i);
             goto bail;
         }
-        if (get4LE(localHdr) != LOCSIG) {
+        localHdr = readArchive(pArchive, localHdrOffset, LOCHDR, localHdrBuf);
+        if (localHdr == NULL || get4LE(localHdr) != LOCSIG) {
             LOGW("Missed a local header sig (at %d)\n", i);
             goto bail;
         }
         pEntry->offset = localHdrOffset + LOCHDR
             + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
+        if (pEntry->offset > pArchive->length ||
+            pEntry->compLen > pArchive->length - pEntry->offset)
+        {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
-     */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), sortcmpZipEntry);
+    for (i = 1; i < numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        if (compareEntryName(pEntry - 1, pEntry->fileName,
+                pEntry->fileNameLen) == 0) {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+        }
     }
-#endif
 
     result = true;
 
 bail:
-    if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
-    }
     return result;
 }
 
@@ -419,7 +537,9 @@ bail:
  * The easiest way to do this is to mmap() the whole thing and do the
  * traditional backward scan for central directory.  Since the EOCD is
  * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * small set of pages.  Archives too big for the address space get only
+ * their central directory mapped, and entry data is mapped a window at
+ * a time as it is read.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -429,48 +549,65 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
+    int64_t cdOffset, cdSize;
+    uint64_t numEntries;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
+    pArchive->fd = open(fileName, O_RDONLY | O_LARGEFILE, 0);
     if (pArchive->fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    pArchive->length = lseek64(pArchive->fd, 0, SEEK_END);
+    if (pArchive->length < ENDHDR || lseek64(pArchive->fd, 0, SEEK_SET) != 0) {
         err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            (long long) pArchive->length);
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
+    if (!findCentralDirectory(pArchive, &cdOffset, &cdSize, &numEntries)) {
+        err = -1;
+        LOGV("Parsing '%s' failed\n", fileName);
+        goto bail;
+    }
+    if (numEntries > UINT_MAX / sizeof(ZipEntry)) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGW("Too many entries in '%s' (%llu)\n", fileName,
+            (unsigned long long) numEntries);
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if ((uint64_t)pArchive->length > SIZE_MAX / 2 ||
+        sysMapFileInShmem(pArchive->fd, &pArchive->map) != 0)
+    {
+        LOGI("Mapping only the central directory of '%s'\n", fileName);
+        if (sysMapFileRangeInShmem(pArchive->fd, cdOffset, cdSize,
+                &pArchive->map) != 0) {
+            err = -1;
+            LOGW("Map of '%s' failed\n", fileName);
+            goto bail;
+        }
+        pArchive->mapOffset = cdOffset;
+    }
+
+    if (!parseZipArchive(pArchive, cdOffset, cdSize, numEntries)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
@@ -490,10 +627,7 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
-
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
 }
 
@@ -505,10 +639,28 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int i = searchEntries(pArchive, compareEntryName,
+            entryName, nameLen, false);
+
+    if (i < pArchive->numEntries &&
+            compareEntryName(&pArchive->pEntries[i], entryName, nameLen) == 0)
+        return &pArchive->pEntries[i];
+    return NULL;
+}
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+/*
+ * Find the range of entries whose names start with prefix.
+ */
+void mzFindZipEntryRange(const ZipArchive* pArchive, const char* prefix,
+        unsigned int* pFirst, unsigned int* pEnd)
+{
+    unsigned int prefixLen = strlen(prefix);
+
+    *pFirst = searchEntries(pArchive, compareEntryPrefix,
+            prefix, prefixLen, false);
+    *pEnd = searchEntries(pArchive, compareEntryPrefix,
+            prefix, prefixLen, true);
 }
 
 /*
@@ -522,33 +674,72 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/* Returns a pointer to "len" bytes of the file at "offset", and tells the
+ * kernel the pages will be read once, front to back.  The bytes come from
+ * the archive mapping if it covers them, or else from a new mapping in
+ * "pWindow", which the caller releases with sysReleaseShmem().
+ */
+static const unsigned char *mapArchiveRange(const ZipArchive *pArchive,
+    int64_t offset, size_t len, MemMapping *pWindow)
+{
+    const unsigned char *data;
+
+    memset(pWindow, 0, sizeof(*pWindow));
+    if (offset >= pArchive->mapOffset &&
+        offset - pArchive->mapOffset + (int64_t)len <=
+            (int64_t)pArchive->map.length)
+    {
+        data = (const unsigned char *)pArchive->map.addr
+            + (offset - pArchive->mapOffset);
+    } else if (sysMapFileRangeInShmem(pArchive->fd, offset, len,
+            pWindow) == 0) {
+        data = pWindow->addr;
+    } else {
+        return NULL;
+    }
+    if (len > 0) {
+        uintptr_t page = (uintptr_t)data & ~((uintptr_t)getpagesize() - 1);
+        madvise((void *)page, (uintptr_t)data + len - page, MADV_SEQUENTIAL);
+    }
+    return data;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ * The data is handed over straight from the archive mapping, in pieces
+ * small enough that consumers can report progress.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
+    int64_t offset = pEntry->offset;
+    int64_t bytesLeft = pEntry->compLen;
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
+        MemMapping window;
+        size_t windowLen = bytesLeft > ZIP_WINDOW_SIZE ?
+                ZIP_WINDOW_SIZE : bytesLeft;
+        const unsigned char *data = mapArchiveRange(pArchive, offset,
+                windowLen, &window);
+        if (data == NULL) {
+            LOGE("Can't map %zu bytes of zip file\n", windowLen);
             return false;
         }
-        ret = processFunction(buf, n, cookie);
+
+        size_t done, count;
+        bool ret = true;
+        for (done = 0; ret && done < windowLen; done += count) {
+            count = windowLen - done;
+            if (count > STORED_CHUNK_SIZE) {
+                count = STORED_CHUNK_SIZE;
+            }
+            ret = processFunction(data + done, count, cookie);
+        }
+        sysReleaseShmem(&window);
         if (!ret) {
             return false;
         }
-        bytesLeft -= count;
+        offset += windowLen;
+        bytesLeft -= windowLen;
     }
     return true;
 }
@@ -557,14 +748,16 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
+    int64_t result = -1;
+    int64_t written = 0;
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
+    MemMapping window;
     int zerr;
-    long compRemaining;
+    int64_t compRemaining = pEntry->compLen;
+    int64_t offset = pEntry->offset;
 
-    compRemaining = pEntry->compLen;
+    memset(&window, 0, sizeof(window));
 
     /*
      * Initialize the zlib stream.
@@ -598,22 +791,23 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
+        /* map the next window of input; usually the whole entry at once */
+        if (zstream.avail_in == 0 && compRemaining > 0) {
+            size_t getSize = compRemaining > ZIP_WINDOW_SIZE ?
+                    ZIP_WINDOW_SIZE : compRemaining;
+            LOGVV("+++ mapping %zu bytes (%lld left)\n",
+                getSize, (long long) compRemaining);
+
+            sysReleaseShmem(&window);
+            zstream.next_in = (Bytef*) mapArchiveRange(pArchive, offset,
+                    getSize, &window);
+            if (zstream.next_in == NULL) {
+                LOGW("inflate can't map %zu bytes\n", getSize);
                 goto z_bail;
             }
 
+            offset += getSize;
             compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
             zstream.avail_in = getSize;
         }
 
@@ -635,6 +829,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
                 LOGW("Process function elected to fail (in inflate)\n");
                 goto z_bail;
             }
+            written += procSize;
 
             zstream.next_out = procBuf;
             zstream.avail_out = sizeof(procBuf);
@@ -643,17 +838,18 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
     assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
-    // success!
-    result = zstream.total_out;
+    // success!  (total_out is only 32 bits on 32-bit targets)
+    result = written;
 
 z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
+    sysReleaseShmem(&window);
 
 bail:
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+                (long long) result, (long long) pEntry->uncompLen);
         return false;
     }
     return true;
@@ -668,19 +864,17 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The entry's data is read straight out of the archive mapping: STORED
+ * data is passed to processFunction without being copied, and DEFLATED
+ * data is inflated from the mapping.  Nothing about the archive changes,
+ * so several entries may be processed at once from different threads.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +889,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -812,7 +1004,7 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 
 typedef struct {
     unsigned char* buffer;
-    long len;
+    int64_t len;
 } BufferExtractCookie;
 
 static bool bufferProcessFunction(const unsigned char *data, int dataLen,
@@ -907,6 +1099,291 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Parallel extraction.  Directories and symlinks are made first, on the
+ * calling thread and in archive order, along with the containing
+ * directories of every file, so the workers only ever create files in
+ * directories that already exist.  The files are then handed out
+ * largest first, which keeps the workers busy about equally long.
+ */
+#define MZ_EXTRACT_MAX_THREADS 4
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int err;                    /* errno of the failure, or 0 */
+    const char *failedStep;     /* NULL on success */
+} MzFileJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzFileJob *jobs;
+    MzFileJob **order;          /* jobs, largest first */
+    unsigned int numJobs;
+    unsigned int nextJob;
+    pthread_mutex_t lock;
+} MzExtractPool;
+
+typedef struct {
+    int fd;
+    int err;
+} MzWriteCookie;
+
+/* Like writeProcessFunction, but quiet: the caller reports errors once
+ * all the workers are done.
+ */
+static bool jobWriteFunction(const unsigned char *data, int dataLen,
+                             void *cookie)
+{
+    MzWriteCookie *wc = (MzWriteCookie *)cookie;
+    while (dataLen > 0) {
+        ssize_t n = write(wc->fd, data, dataLen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            wc->err = n < 0 ? errno : ENOSPC;
+            return false;
+        }
+        data += n;
+        dataLen -= n;
+    }
+    return true;
+}
+
+static void extractFileJob(const MzExtractPool *pool, MzFileJob *job)
+{
+    MzWriteCookie wc;
+    wc.fd = open(job->targetFile, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+            UNZIP_FILEMODE);
+    wc.err = 0;
+    if (wc.fd < 0) {
+        job->err = errno;
+        job->failedStep = "create";
+        return;
+    }
+    bool ok = mzProcessZipEntryContents(pool->pArchive, job->pEntry,
+            jobWriteFunction, &wc);
+    if (close(wc.fd) != 0 && ok) {
+        ok = false;
+        wc.err = errno;
+    }
+    if (!ok) {
+        job->err = wc.err;
+        job->failedStep = "extract";
+        return;
+    }
+    if (pool->timestamp != NULL && utime(job->targetFile, pool->timestamp)) {
+        job->err = errno;
+        job->failedStep = "touch";
+    }
+}
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        unsigned int i = pool->nextJob;
+        if (i < pool->numJobs) {
+            pool->nextJob++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->numJobs) {
+            break;
+        }
+        extractFileJob(pool, pool->order[i]);
+    }
+    return NULL;
+}
+
+static int compareJobSize(const void *a, const void *b)
+{
+    const MzFileJob *ja = *(const MzFileJob * const *)a;
+    const MzFileJob *jb = *(const MzFileJob * const *)b;
+    if (ja->pEntry->uncompLen != jb->pEntry->uncompLen) {
+        return ja->pEntry->uncompLen > jb->pEntry->uncompLen ? -1 : 1;
+    }
+    return ja < jb ? -1 : (ja > jb);
+}
+
+/* Extracts the files in jobs on up to MZ_EXTRACT_MAX_THREADS threads.
+ * Every job is attempted even after one fails, so the failures reported
+ * don't depend on how the threads were scheduled.
+ */
+static void runFileJobs(MzExtractPool *pool)
+{
+    unsigned int i;
+    pool->order = (MzFileJob **)malloc(pool->numJobs * sizeof(MzFileJob *));
+    if (pool->order == NULL) {
+        for (i = 0; i < pool->numJobs; i++) {
+            extractFileJob(pool, &pool->jobs[i]);
+        }
+        return;
+    }
+    for (i = 0; i < pool->numJobs; i++) {
+        pool->order[i] = &pool->jobs[i];
+    }
+    qsort(pool->order, pool->numJobs, sizeof(MzFileJob *), compareJobSize);
+
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads > MZ_EXTRACT_MAX_THREADS) {
+        numThreads = MZ_EXTRACT_MAX_THREADS;
+    }
+    if (numThreads > (long)pool->numJobs) {
+        numThreads = pool->numJobs;
+    }
+
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int started = 0;
+    pool->nextJob = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    while (started < numThreads - 1 &&
+            pthread_create(&threads[started], NULL, extractWorker, pool) == 0) {
+        started++;
+    }
+    extractWorker(pool);
+    for (i = 0; i < (unsigned int)started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->order);
+}
+
+static bool extractRecursiveParallel(const ZipArchive *pArchive,
+        MzPathHelper *helper, int flags, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void *), void *cookie)
+{
+    unsigned int i, first, end;
+    mzFindZipEntryRange(pArchive, helper->zipDir, &first, &end);
+
+    MzExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.jobs = (MzFileJob *)calloc(end - first + 1, sizeof(MzFileJob));
+    if (pool.jobs == NULL) {
+        LOGE("Can't allocate %u extraction jobs\n", end - first);
+        return false;
+    }
+
+    /* The containing directory of the last file, which the next file
+     * most likely shares since the entries are sorted.
+     */
+    char *lastDir = NULL;
+    size_t lastDirLen = 0;
+
+    bool ok = true;
+    for (i = first; i < end; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
+
+        const char *targetFile = targetEntryPath(helper, pEntry);
+        if (targetFile == NULL) {
+            LOGE("Can't assemble target path for \"%.*s\"\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            ok = false;
+            break;
+        }
+
+        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+            if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
+                if (dirCreateHierarchy(targetFile, UNZIP_DIRMODE, timestamp,
+                        false) != 0) {
+                    LOGE("Can't create containing directory for \"%s\": %s\n",
+                            targetFile, strerror(errno));
+                    ok = false;
+                    break;
+                }
+                LOGD("Extracted dir \"%s\"\n", targetFile);
+            }
+            if (callback != NULL) callback(targetFile, cookie);
+            continue;
+        }
+
+        const char *slash = strrchr(targetFile, '/');
+        size_t dirLen = slash - targetFile;
+        if (lastDir == NULL || dirLen != lastDirLen ||
+                memcmp(lastDir, targetFile, dirLen) != 0) {
+            if (dirCreateHierarchy(targetFile, UNZIP_DIRMODE, timestamp,
+                    true) != 0) {
+                LOGE("Can't create containing directory for \"%s\": %s\n",
+                        targetFile, strerror(errno));
+                ok = false;
+                break;
+            }
+            free(lastDir);
+            lastDir = strndup(targetFile, dirLen);
+            lastDirLen = dirLen;
+        }
+
+        if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
+            if (pEntry->uncompLen == 0 || pEntry->uncompLen >= PATH_MAX) {
+                LOGE("Symlink entry \"%s\" has no target\n", targetFile);
+                ok = false;
+                break;
+            }
+            char *linkTarget = malloc(pEntry->uncompLen + 1);
+            if (linkTarget == NULL) {
+                ok = false;
+                break;
+            }
+            if (!mzReadZipEntry(pArchive, pEntry, linkTarget,
+                    pEntry->uncompLen)) {
+                LOGE("Can't read symlink target for \"%s\"\n", targetFile);
+                free(linkTarget);
+                ok = false;
+                break;
+            }
+            linkTarget[pEntry->uncompLen] = '\0';
+            if (symlink(linkTarget, targetFile) != 0) {
+                LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                        targetFile, linkTarget, strerror(errno));
+                free(linkTarget);
+                ok = false;
+                break;
+            }
+            LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+                    targetFile, linkTarget);
+            free(linkTarget);
+            if (callback != NULL) callback(targetFile, cookie);
+            continue;
+        }
+
+        MzFileJob *job = &pool.jobs[pool.numJobs];
+        job->pEntry = pEntry;
+        job->targetFile = strdup(targetFile);
+        if (job->targetFile == NULL) {
+            ok = false;
+            break;
+        }
+        pool.numJobs++;
+    }
+    free(lastDir);
+
+    if (ok && pool.numJobs > 0) {
+        runFileJobs(&pool);
+    }
+
+    /* Report in archive order, whatever order the files were written in.
+     */
+    for (i = 0; i < pool.numJobs; i++) {
+        MzFileJob *job = &pool.jobs[i];
+        if (ok && job->failedStep == NULL) {
+            LOGD("Extracted file \"%s\"\n", job->targetFile);
+            if (callback != NULL) callback(job->targetFile, cookie);
+        } else if (job->failedStep != NULL) {
+            LOGE("Error extracting \"%s\" (%s): %s\n", job->targetFile,
+                    job->failedStep, strerror(job->err));
+            ok = false;
+        }
+        free(job->targetFile);
+    }
+    free(pool.jobs);
+    return ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -976,50 +1453,26 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    if ((flags & MZ_EXTRACT_PARALLEL) && !(flags & MZ_EXTRACT_DRY_RUN)) {
+        bool ok = extractRecursiveParallel(pArchive, &helper, flags,
+                timestamp, callback, cookie);
+        free(helper.buf);
+        free(zpath);
+        return ok;
+    }
+
+    /* Walk through the entries whose path begins with zpath.  If zpath
+     * is empty, that is all of them.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+     */
+    unsigned int i, first, end;
+    int ok = true;
+    mzFindZipEntryRange(pArchive, zpath, &first, &end);
+    for (i = first; i < end; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
 
         /* Find the target location of the entry.
          */
@@ -1040,8 +1493,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1075,7 +1526,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                  * The relative target of the symlink is in the
                  * data section of this entry.
                  */
-                if (pEntry->uncompLen == 0) {
+                if (pEntry->uncompLen == 0 || pEntry->uncompLen >= PATH_MAX) {
                     LOGE("Symlink entry \"%s\" has no target\n",
                             targetFile);
                     ok = false;
@@ -1113,7 +1564,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 /* The entry is a regular file.
                  * Open the target for writing.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
+                int fd = open(targetFile,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                        UNZIP_FILEMODE);
                 if (fd < 0) {
                     LOGE("Can't create target file \"%s\": %s\n",
                             targetFile, strerror(errno));
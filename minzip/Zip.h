@@ -8,10 +8,11 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 /*
@@ -25,9 +26,9 @@
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    int64_t      offset;
+    int64_t      compLen;
+    int64_t      uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -41,9 +42,10 @@ typedef struct ZipEntry {
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
-    ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    ZipEntry*   pEntries;       // sorted by file name
+    MemMapping  map;            // whole file, or central directory only
+    int64_t     mapOffset;      // file offset of map.addr
+    int64_t     length;         // file length
 } ZipArchive;
 
 /*
@@ -78,6 +80,14 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names start with prefix.  Entries are sorted by
+ * name, so these are the indices [*pFirst, *pEnd); the range is empty if
+ * nothing matches.
+ */
+void mzFindZipEntryRange(const ZipArchive* pArchive, const char* prefix,
+        unsigned int* pFirst, unsigned int* pEnd);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -114,10 +124,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE int64_t mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE int64_t mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -197,6 +207,10 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - write files on several threads; directories
+ *         and symlinks come first, and the callback sees files only once
+ *         they have all been written.  Every file is attempted even if
+ *         some fail, and failures are logged in archive order.
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -204,7 +218,7 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2, MZ_EXTRACT_PARALLEL = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -33,6 +33,7 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
@@ -40,6 +41,8 @@
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 
 #include "mmcutils.h"
+#include "../mtdutils/block_io.h"
+#include "../mtdutils/sparse_image.h"
 
 unsigned ext3_count = 0;
 char *ext3_partitions[] = {"system", "userdata", "cache", "NONE"};
@@ -418,106 +421,61 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
+/* Writes an image to a device, expanding it on the way if it is a
+ * sparse image.  Don't care regions are seeked over rather than written.
+ * out_file may also be a regular file, which is created or truncated as
+ * fopen(out_file, "w") would, and is left as holes where seeked over.
+ */
+static int
+mmc_raw_restore_internal (const char *in_file, const char *out_file) {
     int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
+    struct stat st;
+    int is_device = stat(out_file, &st) == 0 && S_ISBLK(st.st_mode);
+    int in = block_io_open(in_file, O_RDONLY, BLOCK_IO_DIRECT);
+    if (in < 0)
+        return -1;
+    int out;
+    if (is_device)
+        out = block_io_open(out_file, O_WRONLY, BLOCK_IO_DIRECT);
+    else
+        out = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if (out < 0)
         goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
+    BlockReader *reader = block_reader_open(in);
+    if (reader == NULL)
         goto ERROR2;
+    BlockWriter *writer = block_writer_open(out);
+    if (writer == NULL)
+        goto ERROR1;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+    SparseOutput output = { block_writer_write, block_writer_skip, writer };
+    ret = sparse_copy(block_reader_read, reader, &output);
+    if (block_writer_close(writer) != 0)
+        ret = -1;
+    /* A trailing don't care region only moved the file offset. */
+    if (ret == 0 && !is_device) {
+        off64_t end = lseek64(out, 0, SEEK_CUR);
+        if (end < 0 || ftruncate64(out, end) != 0)
+            ret = -1;
     }
-
-    fsync(out);
-    ret = 0;
 ERROR1:
-    fclose ( out );
+    block_reader_close(reader);
 ERROR2:
-    fclose ( in );
+    close(out);
 ERROR3:
+    close(in);
     return ret;
+}
 
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_raw_restore_internal(in_file, partition->device_index);
 }
 
 
 int
 mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return block_io_copy_path(in_file, out_file);
 }
 
 // TODO: refactor this to not be a giant copy paste mess
@@ -529,58 +487,27 @@ mmc_raw_dump (const MmcPartition *partition, char *out_file) {
 
 int
 mmc_raw_read (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *in;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
     int ret = -1;
-    char *in_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    fread(data, data_size, 1, in);
-
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( in );
-ERROR3:
+    int in = block_io_open(partition->device_index, O_RDONLY, 0);
+    if (in < 0)
+        return -1;
+    if (block_io_read_full(in, data, data_size) == data_size)
+        ret = 0;
+    close(in);
     return ret;
-
 }
 
 int
 mmc_raw_write (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
     int ret = -1;
-    char *out_file = partition->device_index;
-
-    out  = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR3;
-
-    fwrite(data, data_size, 1, out);
-
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( out );
-ERROR3:
+    int out = block_io_open(partition->device_index, O_WRONLY, 0);
+    if (out < 0)
+        return -1;
+    if (block_io_write_full(out, data, data_size) == 0 && fsync(out) == 0)
+        ret = 0;
+    if (close(out) != 0)
+        ret = -1;
     return ret;
-
 }
 
 int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
@@ -594,7 +521,7 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
         return mmc_raw_copy(p, filename);
     }
     else {
-        return mmc_raw_dump_internal(filename, partition);
+        return mmc_raw_restore_internal(filename, partition);
     }
 }
 
@@ -1,10 +1,18 @@
 LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := mtdutils.c
+LOCAL_SRC_FILES := mtdutils.c sparse_image.c block_io.c
 LOCAL_MODULE := libmtdutils
 include $(BUILD_STATIC_LIBRARY)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := block_io_bench.c
+LOCAL_MODULE := block_io_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES := libmtdutils libc
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+include $(BUILD_EXECUTABLE)
+
 ifeq ($(BOARD_USES_BML_OVER_MTD),true)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := bml_over_mtd.c
@@ -0,0 +1,422 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_io.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+/* Page cache hints are only hints; C libraries without them get none. */
+#ifndef POSIX_FADV_SEQUENTIAL
+#define POSIX_FADV_SEQUENTIAL   2
+#define POSIX_FADV_DONTNEED     4
+#define posix_fadvise(fd, offset, len, advice) 0
+#endif
+
+static void advise(int fd, int advice)
+{
+    posix_fadvise(fd, 0, 0, advice);
+}
+
+/* O_DIRECT wants aligned offsets and lengths, which the last block of an
+ * image or a write after a skip may not have.  Such a transfer fails with
+ * EINVAL, and is retried with the page cache.
+ */
+static int drop_direct(int fd)
+{
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT))
+        return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+#endif
+    return 0;
+}
+
+int block_io_open(const char *path, int flags, int io_flags)
+{
+    int fd = -1;
+#ifdef O_DIRECT
+    if (io_flags & BLOCK_IO_DIRECT)
+        fd = open(path, flags | O_LARGEFILE | O_DIRECT, 0666);
+#endif
+    if (fd < 0)
+        fd = open(path, flags | O_LARGEFILE, 0666);
+    if (fd >= 0)
+        advise(fd, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+void *block_io_alloc(size_t size)
+{
+    return memalign(BLOCK_IO_ALIGN, size);
+}
+
+ssize_t block_io_read_full(int fd, void *data, size_t len)
+{
+    char *p = (char *) data;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, p + done, len - done);
+        if (r < 0) {
+            if (errno == EINTR || (errno == EINVAL && drop_direct(fd)))
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+int block_io_write_full(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR || (errno == EINVAL && drop_direct(fd)))
+                continue;
+            return -1;
+        }
+        if (w == 0)
+            return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* One of the two buffers handed between the caller and the I/O thread. */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    uint64_t skip;      /* writer: bytes to seek over after the data */
+    int full;           /* owned by the consumer side */
+} Slot;
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Slot slots[2];
+    int current;        /* slot the caller is working on */
+    size_t pos;         /* reader: bytes of the current slot consumed */
+    int finish;         /* tells the thread to stop */
+    int eof;            /* reader: the thread has read all there is */
+    int error;
+} Pipe;
+
+static int pipe_init(Pipe *p, int fd, void *(*worker)(void *))
+{
+    memset(p, 0, sizeof(*p));
+    p->fd = fd;
+    p->slots[0].data = block_io_alloc(BLOCK_IO_BUFFER_SIZE);
+    p->slots[1].data = block_io_alloc(BLOCK_IO_BUFFER_SIZE);
+    if (p->slots[0].data == NULL || p->slots[1].data == NULL)
+        goto fail;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, worker, p) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    free(p->slots[0].data);
+    free(p->slots[1].data);
+    return -1;
+}
+
+static void pipe_stop(Pipe *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->finish = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->slots[0].data);
+    free(p->slots[1].data);
+}
+
+struct BlockReader {
+    Pipe pipe;
+};
+
+/* Fills the slots in turn.  The slot holding the end of the input is
+ * short (possibly empty), and the thread stops after it.
+ */
+static void *reader_thread(void *cookie)
+{
+    Pipe *p = (Pipe *) cookie;
+    int i = 0;
+    for (;;) {
+        Slot *slot = &p->slots[i];
+        pthread_mutex_lock(&p->lock);
+        while (slot->full && !p->finish)
+            pthread_cond_wait(&p->cond, &p->lock);
+        int finish = p->finish;
+        pthread_mutex_unlock(&p->lock);
+        if (finish)
+            break;
+
+        ssize_t r = block_io_read_full(p->fd, slot->data, BLOCK_IO_BUFFER_SIZE);
+
+        pthread_mutex_lock(&p->lock);
+        if (r < 0)
+            p->error = 1;
+        slot->len = r < 0 ? 0 : r;
+        slot->full = 1;
+        if (r < BLOCK_IO_BUFFER_SIZE)
+            p->eof = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (r < BLOCK_IO_BUFFER_SIZE)
+            break;
+        i ^= 1;
+    }
+    return NULL;
+}
+
+BlockReader *block_reader_open(int fd)
+{
+    BlockReader *r = malloc(sizeof(BlockReader));
+    if (r == NULL)
+        return NULL;
+    if (pipe_init(&r->pipe, fd, reader_thread) != 0) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Waits for the current slot, whose data from pipe.pos on is unread; an
+ * empty slot means end of input, or an error.
+ */
+static Slot *reader_peek(BlockReader *r)
+{
+    Pipe *p = &r->pipe;
+    Slot *slot = &p->slots[p->current];
+    pthread_mutex_lock(&p->lock);
+    while (!slot->full && !p->eof)
+        pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    return slot;
+}
+
+static void reader_consume(BlockReader *r, size_t len)
+{
+    Pipe *p = &r->pipe;
+    Slot *slot = &p->slots[p->current];
+    p->pos += len;
+    if (p->pos < slot->len)
+        return;
+    pthread_mutex_lock(&p->lock);
+    slot->len = 0;
+    slot->full = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    p->pos = 0;
+    p->current ^= 1;
+}
+
+ssize_t block_reader_read(void *cookie, void *data, size_t len)
+{
+    BlockReader *r = (BlockReader *) cookie;
+    Slot *slot = reader_peek(r);
+    if (slot->len == 0)
+        return r->pipe.error ? -1 : 0;
+    size_t n = slot->len - r->pipe.pos;
+    if (n > len)
+        n = len;
+    memcpy(data, slot->data + r->pipe.pos, n);
+    reader_consume(r, n);
+    return n;
+}
+
+void block_reader_close(BlockReader *r)
+{
+    pipe_stop(&r->pipe);
+    free(r);
+}
+
+struct BlockWriter {
+    Pipe pipe;
+};
+
+/* Writes the slots out in turn until told to finish with nothing left.
+ * After a failure, later slots are dropped so the caller never waits.
+ */
+static void *writer_thread(void *cookie)
+{
+    Pipe *p = (Pipe *) cookie;
+    int i = 0;
+    for (;;) {
+        Slot *slot = &p->slots[i];
+        pthread_mutex_lock(&p->lock);
+        while (!slot->full && !p->finish)
+            pthread_cond_wait(&p->cond, &p->lock);
+        int full = slot->full;
+        int error = p->error;
+        pthread_mutex_unlock(&p->lock);
+        if (!full)
+            break;
+
+        if (!error) {
+            if (block_io_write_full(p->fd, slot->data, slot->len) != 0)
+                error = 1;
+            else if (slot->skip > 0 && lseek64(p->fd, slot->skip, SEEK_CUR) < 0)
+                error = 1;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (error)
+            p->error = 1;
+        slot->len = 0;
+        slot->skip = 0;
+        slot->full = 0;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        i ^= 1;
+    }
+    return NULL;
+}
+
+BlockWriter *block_writer_open(int fd)
+{
+    BlockWriter *w = malloc(sizeof(BlockWriter));
+    if (w == NULL)
+        return NULL;
+    if (pipe_init(&w->pipe, fd, writer_thread) != 0) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Hands the current slot to the thread and waits until the other one is
+ * free to fill.
+ */
+static int writer_submit(BlockWriter *w)
+{
+    Pipe *p = &w->pipe;
+    pthread_mutex_lock(&p->lock);
+    p->slots[p->current].full = 1;
+    pthread_cond_broadcast(&p->cond);
+    p->current ^= 1;
+    while (p->slots[p->current].full)
+        pthread_cond_wait(&p->cond, &p->lock);
+    int error = p->error;
+    pthread_mutex_unlock(&p->lock);
+    return error ? -1 : 0;
+}
+
+int block_writer_write(void *cookie, const void *data, size_t len)
+{
+    BlockWriter *w = (BlockWriter *) cookie;
+    Pipe *p = &w->pipe;
+    const uint8_t *src = (const uint8_t *) data;
+    while (len > 0) {
+        Slot *slot = &p->slots[p->current];
+        if (slot->skip > 0 || slot->len == BLOCK_IO_BUFFER_SIZE) {
+            if (writer_submit(w) != 0)
+                return -1;
+            continue;
+        }
+        size_t n = BLOCK_IO_BUFFER_SIZE - slot->len;
+        if (n > len)
+            n = len;
+        memcpy(slot->data + slot->len, src, n);
+        slot->len += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int block_writer_skip(void *cookie, uint64_t len)
+{
+    BlockWriter *w = (BlockWriter *) cookie;
+    w->pipe.slots[w->pipe.current].skip += len;
+    return 0;
+}
+
+int block_writer_close(BlockWriter *w)
+{
+    Pipe *p = &w->pipe;
+    Slot *slot = &p->slots[p->current];
+    int ret = 0;
+    if ((slot->len > 0 || slot->skip > 0) && writer_submit(w) != 0)
+        ret = -1;
+    int fd = p->fd;
+    pipe_stop(p);
+    if (p->error)
+        ret = -1;
+    free(w);
+    if (ret == 0 && fsync(fd) != 0)
+        ret = -1;
+    advise(fd, POSIX_FADV_DONTNEED);
+    return ret;
+}
+
+int64_t block_io_copy(int in, int out)
+{
+    BlockReader *r = block_reader_open(in);
+    if (r == NULL)
+        return -1;
+    int64_t total = 0;
+    for (;;) {
+        Slot *slot = reader_peek(r);
+        if (slot->len == 0) {
+            if (r->pipe.error)
+                total = -1;
+            break;
+        }
+        if (block_io_write_full(out, slot->data, slot->len) != 0) {
+            total = -1;
+            break;
+        }
+        size_t len = slot->len;
+        total += len;
+        reader_consume(r, len);
+    }
+    block_reader_close(r);
+    advise(in, POSIX_FADV_DONTNEED);
+    if (total >= 0 && fsync(out) != 0)
+        total = -1;
+    advise(out, POSIX_FADV_DONTNEED);
+    return total;
+}
+
+int block_io_copy_path(const char *in_path, const char *out_path)
+{
+    int in = block_io_open(in_path, O_RDONLY, BLOCK_IO_DIRECT);
+    if (in < 0) {
+        fprintf(stderr, "can't open %s: %s\n", in_path, strerror(errno));
+        return -1;
+    }
+    int out = block_io_open(out_path, O_WRONLY | O_CREAT | O_TRUNC, BLOCK_IO_DIRECT);
+    if (out < 0) {
+        fprintf(stderr, "can't open %s: %s\n", out_path, strerror(errno));
+        close(in);
+        return -1;
+    }
+    int ret = block_io_copy(in, out) < 0 ? -1 : 0;
+    if (close(out) != 0)
+        ret = -1;
+    close(in);
+    return ret;
+}
@@ -0,0 +1,63 @@
+#ifndef BLOCK_IO_H_
+#define BLOCK_IO_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bulk I/O for raw partition images.  Data moves in large aligned
+ * buffers, and a second thread keeps one buffer in flight while the
+ * caller works on the other, so device reads and writes overlap with
+ * whatever is producing or consuming the data.
+ */
+
+#define BLOCK_IO_BUFFER_SIZE    (1024 * 1024)
+#define BLOCK_IO_ALIGN          4096
+
+/* Flags for block_io_open. */
+#define BLOCK_IO_DIRECT         1   /* bypass the page cache if the fd allows it */
+
+/* Opens path with O_LARGEFILE added to flags, and with O_DIRECT if asked
+ * for and supported.  Reads and writes that O_DIRECT refuses (short or
+ * unaligned tails) fall back to buffered I/O on their own.
+ */
+int block_io_open(const char *path, int flags, int io_flags);
+
+/* Returns a BLOCK_IO_ALIGN aligned buffer, to be released with free(). */
+void *block_io_alloc(size_t size);
+
+/* Plain blocking helpers; read_full returns the byte count, which is
+ * short only at end of file, or -1.
+ */
+ssize_t block_io_read_full(int fd, void *data, size_t len);
+int block_io_write_full(int fd, const void *data, size_t len);
+
+/* Reads ahead on a second thread.  The fd is not closed. */
+typedef struct BlockReader BlockReader;
+
+BlockReader *block_reader_open(int fd);
+/* Has the shape of sparse_read_fn and stream_read_fn. */
+ssize_t block_reader_read(void *cookie, void *data, size_t len);
+void block_reader_close(BlockReader *reader);
+
+/* Writes behind on a second thread.  The fd is not closed. */
+typedef struct BlockWriter BlockWriter;
+
+BlockWriter *block_writer_open(int fd);
+/* Has the shape of sparse_write_fn and stream_write_fn. */
+int block_writer_write(void *cookie, const void *data, size_t len);
+/* Moves the output position forward without writing, for sparse_copy. */
+int block_writer_skip(void *cookie, uint64_t len);
+/* Writes out what is buffered, syncs the fd once and frees the writer.
+ * Returns nonzero if any write along the way failed.
+ */
+int block_writer_close(BlockWriter *writer);
+
+/* Copies in to out until end of input, then syncs out.  Returns the
+ * number of bytes copied or -1.
+ */
+int64_t block_io_copy(int in, int out);
+
+/* Copies a device or file to a new or existing file or device. */
+int block_io_copy_path(const char *in_path, const char *out_path);
+
+#endif  // BLOCK_IO_H_
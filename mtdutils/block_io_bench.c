@@ -0,0 +1,119 @@
+/* Compares block_io_copy with the 512 byte stdio loop it replaced.
+ *
+ *   block_io_bench <path> [size in MB]
+ *
+ * path is filled with size MB of data (default 64) and copied to
+ * path.out both ways.  Point it at a file on the partition to measure, or
+ * at a loop device (losetup /dev/block/loop0 <file>) to go through the
+ * block layer the way a raw partition does.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "block_io.h"
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int fill(const char *path, long long size)
+{
+    int fd = block_io_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    if (fd < 0)
+        return -1;
+    char *buffer = block_io_alloc(BLOCK_IO_BUFFER_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        return -1;
+    }
+    unsigned int seed = 1;
+    long long done;
+    int ret = 0;
+    for (done = 0; done < size && ret == 0; done += BLOCK_IO_BUFFER_SIZE) {
+        int i;
+        for (i = 0; i < BLOCK_IO_BUFFER_SIZE; i++)
+            buffer[i] = (seed = seed * 1103515245 + 12345) >> 16;
+        ret = block_io_write_full(fd, buffer, BLOCK_IO_BUFFER_SIZE);
+    }
+    free(buffer);
+    if (fsync(fd) != 0)
+        ret = -1;
+    close(fd);
+    return ret;
+}
+
+static int stdio_copy(const char *in_path, const char *out_path)
+{
+    char buf[512];
+    FILE *in = fopen(in_path, "r");
+    FILE *out = fopen(out_path, "w");
+    int ret = in != NULL && out != NULL ? 0 : -1;
+    while (ret == 0 && fread(buf, 512, 1, in) == 1) {
+        if (fwrite(buf, 512, 1, out) != 1)
+            ret = -1;
+    }
+    if (out != NULL) {
+        fflush(out);
+        fsync(fileno(out));
+        fclose(out);
+    }
+    if (in != NULL)
+        fclose(in);
+    return ret;
+}
+
+static void drop_caches(void)
+{
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    sync();
+    if (fd >= 0) {
+        write(fd, "3\n", 2);
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path> [size in MB]\n", argv[0]);
+        return 2;
+    }
+    long long mb = argc > 2 ? atoll(argv[2]) : 64;
+    char out_path[4096];
+    snprintf(out_path, sizeof(out_path), "%s.out", argv[1]);
+
+    if (fill(argv[1], mb << 20) != 0) {
+        fprintf(stderr, "can't write %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    drop_caches();
+    double start = now();
+    if (stdio_copy(argv[1], out_path) != 0) {
+        fprintf(stderr, "stdio copy failed: %s\n", strerror(errno));
+        return 1;
+    }
+    double stdio_time = now() - start;
+
+    drop_caches();
+    start = now();
+    if (block_io_copy_path(argv[1], out_path) != 0) {
+        fprintf(stderr, "block_io copy failed\n");
+        return 1;
+    }
+    double block_time = now() - start;
+
+    printf("stdio:    %lld MB in %.2fs, %.1f MB/s\n", mb, stdio_time, mb / stdio_time);
+    printf("block_io: %lld MB in %.2fs, %.1f MB/s\n", mb, block_time, mb / block_time);
+    unlink(out_path);
+    return 0;
+}
@@ -27,6 +27,7 @@
 #include <assert.h>
 
 #include "mtdutils.h"
+#include "sparse_image.h"
 
 struct MtdReadContext {
     const MtdPartition *partition;
@@ -397,6 +398,21 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+/* An erased block reads back as all 0xff, so a block of 0xff only
+ * needs erasing, not programming.  It is still read back, which checks
+ * that the erase took.
+ */
+static int is_erased_block(const char *data, size_t size)
+{
+    const unsigned long *w = (const unsigned long *) data;
+    size_t n = size / sizeof(unsigned long);
+    unsigned long all = ~0UL;
+    size_t i;
+    for (i = 0; i < n; i++)
+        all &= w[i];
+    return all == ~0UL;
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
@@ -406,6 +422,8 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    int erased = ((uintptr_t) data % sizeof(unsigned long)) == 0 &&
+                 is_erased_block(data, size);
     while (pos + size <= (int) partition->size) {
         loff_t bpos = pos;
         int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
@@ -428,8 +446,9 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            if (!erased &&
+                (lseek(fd, pos, SEEK_SET) != pos ||
+                 write(fd, data, size) != size)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
@@ -567,18 +586,32 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
 #define SPARE_SIZE    (BLOCK_SIZE >> 5)
 #define HEADER_SIZE 2048
 
+static int mtd_sparse_write(void *cookie, const void *data, size_t len)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+    return mtd_write_data(ctx, data, len) == (ssize_t) len ? 0 : -1;
+}
+
+// Don't care regions are left erased.
+static int mtd_sparse_skip(void *cookie, uint64_t len)
+{
+    char buffer[4096];
+    memset(buffer, 0xff, sizeof(buffer));
+    while (len > 0) {
+        size_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (mtd_sparse_write(cookie, buffer, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
 int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
 {
     const MtdPartition *ptn;
     MtdWriteContext *write;
     void *data;
 
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "error opening %s", filename);
-        return -1;
-    }
-
     if (mtd_scan_partitions() <= 0)
     {
         fprintf(stderr, "error scanning partitions");
@@ -604,15 +637,11 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         return -1;
     }
 
-    int success = 1;
-    char* buffer = malloc(BUFSIZ);
-    int read;
-    while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-        int wrote = mtd_write_data(ctx, buffer, read);
-        success = success && (wrote == read);
-    }
-    free(buffer);
-    fclose(f);
+    // Sparse images are expanded on the way; their erased runs cost no
+    // reads from the image and only an erase on the flash.
+    SparseOutput out = { mtd_sparse_write, mtd_sparse_skip, ctx };
+    int success = sparse_copy(sparse_read_fd, &fd, &out) == 0;
+    close(fd);
 
     if (!success) {
         fprintf(stderr, "error writing %s", partition_name);
@@ -0,0 +1,480 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse_image.h"
+
+#define SPARSE_MAJOR_VERSION    1
+
+/* Runs of erased blocks shorter than this are stored as data, which
+ * bounds the number of chunks an image can need.
+ */
+#define SPARSE_MIN_FILL         (64 * 1024)
+/* Longest raw chunk, which is buffered before its header is written. */
+#define SPARSE_MAX_RAW          (1024 * 1024)
+
+#define SPARSE_COPY_BUFFER_SIZE (256 * 1024)
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+struct SparseWriter {
+    sparse_write_fn write;
+    void *cookie;
+
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t blocks;            /* blocks seen so far */
+    uint32_t max_chunks;        /* chunk count promised in the header */
+    uint32_t chunks;            /* chunks written so far */
+    uint32_t min_fill_blocks;
+    uint32_t max_raw_blocks;
+
+    uint8_t *block;             /* block being assembled from short writes */
+    size_t block_len;
+    uint8_t *raw;               /* pending raw chunk */
+    uint32_t raw_blocks;
+    uint32_t fill_value;        /* pending run of erased blocks */
+    uint32_t fill_blocks;
+    int error;
+};
+
+/* Returns 1 if the block is all zero or all 0xff bytes, and its fill
+ * value.  Compares a word at a time, four words per iteration, which
+ * the compiler can turn into vector compares.
+ */
+static int erased_block(const uint8_t *p, size_t len, uint32_t *value)
+{
+    const unsigned long *w = (const unsigned long *) p;
+    unsigned long first = w[0];
+    if (first != 0 && first != ~0UL)
+        return 0;
+    size_t n = len / sizeof(unsigned long);
+    size_t i;
+    for (i = 0; i < n; i += 4) {
+        unsigned long diff = (w[i] ^ first) | (w[i + 1] ^ first) |
+                             (w[i + 2] ^ first) | (w[i + 3] ^ first);
+        if (diff != 0)
+            return 0;
+    }
+    *value = first ? 0xffffffff : 0;
+    return 1;
+}
+
+static int write_chunk_header(SparseWriter *w, uint16_t type, uint32_t blocks, uint32_t total_sz)
+{
+    uint8_t header[SPARSE_CHUNK_HEADER_LEN];
+    put_le16(header, type);
+    put_le16(header + 2, 0);
+    put_le32(header + 4, blocks);
+    put_le32(header + 8, total_sz);
+    w->chunks++;
+    return w->write(w->cookie, header, sizeof(header));
+}
+
+static int flush_raw(SparseWriter *w)
+{
+    if (w->raw_blocks == 0)
+        return 0;
+    size_t len = (size_t) w->raw_blocks * w->blk_sz;
+    if (write_chunk_header(w, SPARSE_CHUNK_RAW, w->raw_blocks, SPARSE_CHUNK_HEADER_LEN + len) != 0 ||
+            w->write(w->cookie, w->raw, len) != 0)
+        return -1;
+    w->raw_blocks = 0;
+    return 0;
+}
+
+/* Appends a block to the pending raw chunk; data NULL appends a block
+ * of the pending fill value.
+ */
+static int add_raw_block(SparseWriter *w, const uint8_t *data)
+{
+    uint8_t *dst = w->raw + (size_t) w->raw_blocks * w->blk_sz;
+    if (data != NULL)
+        memcpy(dst, data, w->blk_sz);
+    else
+        memset(dst, w->fill_value & 0xff, w->blk_sz);
+    w->raw_blocks++;
+    if (w->raw_blocks == w->max_raw_blocks)
+        return flush_raw(w);
+    return 0;
+}
+
+static int end_fill(SparseWriter *w)
+{
+    if (w->fill_blocks == 0)
+        return 0;
+    uint32_t blocks = w->fill_blocks;
+    w->fill_blocks = 0;
+    if (blocks < w->min_fill_blocks) {
+        while (blocks-- > 0) {
+            if (add_raw_block(w, NULL) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    uint8_t value[4];
+    put_le32(value, w->fill_value);
+    if (flush_raw(w) != 0 ||
+            write_chunk_header(w, SPARSE_CHUNK_FILL, blocks, SPARSE_CHUNK_HEADER_LEN + 4) != 0 ||
+            w->write(w->cookie, value, 4) != 0)
+        return -1;
+    return 0;
+}
+
+static int add_block(SparseWriter *w, const uint8_t *data)
+{
+    uint32_t value;
+    if (w->blocks == w->total_blks) {
+        fprintf(stderr, "sparse: more data than the image size\n");
+        return -1;
+    }
+    w->blocks++;
+    if (erased_block(data, w->blk_sz, &value)) {
+        if (w->fill_blocks > 0 && value == w->fill_value) {
+            w->fill_blocks++;
+            return 0;
+        }
+        if (end_fill(w) != 0)
+            return -1;
+        w->fill_value = value;
+        w->fill_blocks = 1;
+        return 0;
+    }
+    if (end_fill(w) != 0)
+        return -1;
+    return add_raw_block(w, data);
+}
+
+SparseWriter *sparse_writer_open(uint64_t size, sparse_write_fn write, void *cookie)
+{
+    uint32_t blk_sz = size % 4096 == 0 ? 4096 : 512;
+    if (size % blk_sz != 0 || size / blk_sz > UINT32_MAX)
+        return NULL;
+
+    SparseWriter *w = calloc(1, sizeof(SparseWriter));
+    if (w == NULL)
+        return NULL;
+    w->write = write;
+    w->cookie = cookie;
+    w->blk_sz = blk_sz;
+    w->total_blks = size / blk_sz;
+    w->min_fill_blocks = SPARSE_MIN_FILL / blk_sz;
+    w->max_raw_blocks = SPARSE_MAX_RAW / blk_sz;
+    /* Every fill chunk covers at least min_fill_blocks, and raw chunks
+     * are either full or end where a fill chunk starts.
+     */
+    w->max_chunks = 2 * (w->total_blks / w->min_fill_blocks) +
+                    w->total_blks / w->max_raw_blocks + 2;
+    w->block = malloc(blk_sz);
+    w->raw = malloc(SPARSE_MAX_RAW);
+    if (w->block == NULL || w->raw == NULL)
+        goto fail;
+
+    uint8_t header[SPARSE_HEADER_LEN];
+    put_le32(header, SPARSE_HEADER_MAGIC);
+    put_le16(header + 4, SPARSE_MAJOR_VERSION);
+    put_le16(header + 6, 0);
+    put_le16(header + 8, SPARSE_HEADER_LEN);
+    put_le16(header + 10, SPARSE_CHUNK_HEADER_LEN);
+    put_le32(header + 12, w->blk_sz);
+    put_le32(header + 16, w->total_blks);
+    put_le32(header + 20, w->max_chunks);
+    put_le32(header + 24, 0);
+    if (write(cookie, header, sizeof(header)) != 0)
+        goto fail;
+    return w;
+
+fail:
+    free(w->block);
+    free(w->raw);
+    free(w);
+    return NULL;
+}
+
+int sparse_writer_write(void *cookie, const void *data, size_t len)
+{
+    SparseWriter *w = (SparseWriter *) cookie;
+    const uint8_t *p = (const uint8_t *) data;
+    while (len > 0 && !w->error) {
+        /* Whole, aligned blocks are scanned where they are. */
+        if (w->block_len == 0 && len >= w->blk_sz &&
+                ((uintptr_t) p % sizeof(unsigned long)) == 0) {
+            if (add_block(w, p) != 0)
+                w->error = -1;
+            p += w->blk_sz;
+            len -= w->blk_sz;
+            continue;
+        }
+        size_t n = w->blk_sz - w->block_len;
+        if (n > len)
+            n = len;
+        memcpy(w->block + w->block_len, p, n);
+        w->block_len += n;
+        p += n;
+        len -= n;
+        if (w->block_len == w->blk_sz) {
+            if (add_block(w, w->block) != 0)
+                w->error = -1;
+            w->block_len = 0;
+        }
+    }
+    return w->error;
+}
+
+int sparse_writer_close(SparseWriter *w)
+{
+    int ret = w->error;
+    if (ret == 0 && (w->block_len != 0 || w->blocks != w->total_blks)) {
+        fprintf(stderr, "sparse: image is shorter than its size\n");
+        ret = -1;
+    }
+    if (ret == 0 && (end_fill(w) != 0 || flush_raw(w) != 0))
+        ret = -1;
+
+    /* Pad the chunk count up to what the header promised. */
+    uint8_t padding[SPARSE_CHUNK_HEADER_LEN * 64];
+    uint32_t i;
+    for (i = 0; i < 64; i++) {
+        uint8_t *header = padding + i * SPARSE_CHUNK_HEADER_LEN;
+        put_le16(header, SPARSE_CHUNK_DONT_CARE);
+        put_le16(header + 2, 0);
+        put_le32(header + 4, 0);
+        put_le32(header + 8, SPARSE_CHUNK_HEADER_LEN);
+    }
+    while (ret == 0 && w->chunks < w->max_chunks) {
+        uint32_t count = w->max_chunks - w->chunks;
+        if (count > 64)
+            count = 64;
+        if (w->write(w->cookie, padding, count * SPARSE_CHUNK_HEADER_LEN) != 0)
+            ret = -1;
+        w->chunks += count;
+    }
+
+    free(w->block);
+    free(w->raw);
+    free(w);
+    return ret;
+}
+
+/* Reads len bytes, or fewer only at the end of the stream.  Returns the
+ * number read or -1.
+ */
+static ssize_t read_full(sparse_read_fn read, void *cookie, void *data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(cookie, (uint8_t *) data + done, len - done);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static int read_exact(sparse_read_fn read, void *cookie, void *data, size_t len)
+{
+    if (read_full(read, cookie, data, len) != (ssize_t) len) {
+        fprintf(stderr, "sparse: truncated image\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads and discards len bytes. */
+static int skip_input(sparse_read_fn read, void *cookie, uint8_t *buffer, uint64_t len)
+{
+    while (len > 0) {
+        size_t n = len < SPARSE_COPY_BUFFER_SIZE ? len : SPARSE_COPY_BUFFER_SIZE;
+        if (read_exact(read, cookie, buffer, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int copy_data(sparse_read_fn read, void *cookie, const SparseOutput *out,
+                     uint8_t *buffer, uint64_t len)
+{
+    while (len > 0) {
+        size_t n = len < SPARSE_COPY_BUFFER_SIZE ? len : SPARSE_COPY_BUFFER_SIZE;
+        if (read_exact(read, cookie, buffer, n) != 0 || out->write(out->cookie, buffer, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fill_output(const SparseOutput *out, uint8_t *buffer, uint32_t value, uint64_t len)
+{
+    size_t i;
+    size_t n = len < SPARSE_COPY_BUFFER_SIZE ? len : SPARSE_COPY_BUFFER_SIZE;
+    for (i = 0; i < n; i += 4)
+        put_le32(buffer + i, value);
+    while (len > 0) {
+        n = len < SPARSE_COPY_BUFFER_SIZE ? len : SPARSE_COPY_BUFFER_SIZE;
+        if (out->write(out->cookie, buffer, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int expand_sparse(sparse_read_fn read, void *cookie, const SparseOutput *out,
+                         const uint8_t *header, uint8_t *buffer)
+{
+    uint16_t major = get_le16(header + 4);
+    uint16_t file_hdr_sz = get_le16(header + 8);
+    uint16_t chunk_hdr_sz = get_le16(header + 10);
+    uint32_t blk_sz = get_le32(header + 12);
+    uint32_t total_blks = get_le32(header + 16);
+    uint32_t total_chunks = get_le32(header + 20);
+    if (major != SPARSE_MAJOR_VERSION || file_hdr_sz < SPARSE_HEADER_LEN ||
+            chunk_hdr_sz < SPARSE_CHUNK_HEADER_LEN || blk_sz == 0 || blk_sz % 4 != 0) {
+        fprintf(stderr, "sparse: unsupported image\n");
+        return -1;
+    }
+    if (skip_input(read, cookie, buffer, file_hdr_sz - SPARSE_HEADER_LEN) != 0)
+        return -1;
+
+    uint32_t blocks = 0;
+    uint32_t i;
+    for (i = 0; i < total_chunks; i++) {
+        uint8_t chunk[SPARSE_CHUNK_HEADER_LEN];
+        if (read_exact(read, cookie, chunk, sizeof(chunk)) != 0 ||
+                skip_input(read, cookie, buffer, chunk_hdr_sz - SPARSE_CHUNK_HEADER_LEN) != 0)
+            return -1;
+        uint16_t type = get_le16(chunk);
+        uint32_t chunk_sz = get_le32(chunk + 4);
+        uint32_t total_sz = get_le32(chunk + 8);
+        uint64_t len = (uint64_t) chunk_sz * blk_sz;
+        uint8_t value[4];
+        int ret;
+        switch (type) {
+            case SPARSE_CHUNK_RAW:
+                if (total_sz != chunk_hdr_sz + len)
+                    goto bad_chunk;
+                ret = copy_data(read, cookie, out, buffer, len);
+                break;
+            case SPARSE_CHUNK_FILL:
+                if (total_sz != chunk_hdr_sz + 4u)
+                    goto bad_chunk;
+                ret = read_exact(read, cookie, value, 4);
+                if (ret == 0)
+                    ret = fill_output(out, buffer, get_le32(value), len);
+                break;
+            case SPARSE_CHUNK_DONT_CARE:
+                if (total_sz != chunk_hdr_sz)
+                    goto bad_chunk;
+                if (out->skip != NULL)
+                    ret = len > 0 ? out->skip(out->cookie, len) : 0;
+                else
+                    ret = fill_output(out, buffer, 0, len);
+                break;
+            case SPARSE_CHUNK_CRC32:
+                if (total_sz != chunk_hdr_sz + 4u)
+                    goto bad_chunk;
+                ret = read_exact(read, cookie, value, 4);
+                break;
+            default:
+                goto bad_chunk;
+        }
+        if (ret != 0)
+            return -1;
+        blocks += chunk_sz;
+    }
+    if (blocks != total_blks) {
+        fprintf(stderr, "sparse: image has %u of %u blocks\n", blocks, total_blks);
+        return -1;
+    }
+    return 0;
+
+bad_chunk:
+    fprintf(stderr, "sparse: bad chunk %u\n", i);
+    return -1;
+}
+
+int sparse_copy(sparse_read_fn read, void *cookie, const SparseOutput *out)
+{
+    uint8_t *buffer = malloc(SPARSE_COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+        return -1;
+
+    int ret;
+    uint8_t header[SPARSE_HEADER_LEN];
+    ssize_t len = read_full(read, cookie, header, sizeof(header));
+    if (len == sizeof(header) && get_le32(header) == SPARSE_HEADER_MAGIC) {
+        ret = expand_sparse(read, cookie, out, header, buffer);
+    } else if (len < 0 || (len > 0 && out->write(out->cookie, header, len) != 0)) {
+        ret = -1;
+    } else {
+        ret = 0;
+        while ((len = read(cookie, buffer, SPARSE_COPY_BUFFER_SIZE)) > 0) {
+            if (out->write(out->cookie, buffer, len) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+        if (len < 0)
+            ret = -1;
+    }
+    free(buffer);
+    return ret;
+}
+
+int sparse_write_fd(void *cookie, const void *data, size_t len)
+{
+    int fd = *(int *) cookie;
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+ssize_t sparse_read_fd(void *cookie, void *data, size_t len)
+{
+    ssize_t r;
+    do {
+        r = read(*(int *) cookie, data, len);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+int sparse_skip_fd(void *cookie, uint64_t len)
+{
+    return lseek64(*(int *) cookie, len, SEEK_CUR) < 0 ? -1 : 0;
+}
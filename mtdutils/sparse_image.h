@@ -0,0 +1,62 @@
+#ifndef SPARSE_IMAGE_H_
+#define SPARSE_IMAGE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Sparse raw partition images, in the Android sparse image format (as
+ * written by make_ext4fs -s and flashed by fastboot).  Runs of erased
+ * (all zero or all 0xff) blocks are stored as fill records instead of
+ * data.
+ */
+
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_HEADER_LEN       28
+#define SPARSE_CHUNK_HEADER_LEN 12
+
+#define SPARSE_CHUNK_RAW        0xCAC1
+#define SPARSE_CHUNK_FILL       0xCAC2
+#define SPARSE_CHUNK_DONT_CARE  0xCAC3
+#define SPARSE_CHUNK_CRC32      0xCAC4
+
+/* Same shapes as the nandroid stream stages: writes return 0 on success,
+ * reads return the byte count, 0 at end of stream or -1 on error.
+ */
+typedef int (*sparse_write_fn)(void *cookie, const void *data, size_t len);
+typedef ssize_t (*sparse_read_fn)(void *cookie, void *data, size_t len);
+
+/* Streaming encoder.  The image size must be known up front and be a
+ * multiple of 512 bytes.  The header is written first, so the chunk
+ * count in it is an upper bound that the encoder pads up to with empty
+ * don't care chunks.
+ */
+typedef struct SparseWriter SparseWriter;
+
+SparseWriter *sparse_writer_open(uint64_t size, sparse_write_fn write, void *cookie);
+int sparse_writer_write(void *cookie, const void *data, size_t len);
+/* Finishes the image and frees the writer.  Fails unless exactly size
+ * bytes were written.
+ */
+int sparse_writer_close(SparseWriter *writer);
+
+/* Where sparse_copy puts the expanded image.  skip, which may be NULL,
+ * moves the output forward over a don't care region; without it zeros
+ * are written instead.
+ */
+typedef struct {
+    sparse_write_fn write;
+    int (*skip)(void *cookie, uint64_t len);
+    void *cookie;
+} SparseOutput;
+
+/* Copies an image from read to out, expanding it if it is sparse and
+ * passing it through unchanged otherwise.
+ */
+int sparse_copy(sparse_read_fn read, void *cookie, const SparseOutput *out);
+
+/* File descriptor ends for the callbacks; cookie points to the fd. */
+int sparse_write_fd(void *cookie, const void *data, size_t len);
+ssize_t sparse_read_fd(void *cookie, void *data, size_t len);
+int sparse_skip_fd(void *cookie, uint64_t len);
+
+#endif  // SPARSE_IMAGE_H_
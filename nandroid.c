@@ -16,6 +16,7 @@
 #include <sys/limits.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <signal.h>
 #include <sys/wait.h>
@@ -37,9 +38,16 @@
 
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "nandroid_chunks.h"
+#include "nandroid_jobs.h"
+#include "nandroid_md5.h"
+#include "nandroid_stream.h"
+#include "nandroid_tar.h"
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
+#include "mtdutils/block_io.h"
+#include "mtdutils/sparse_image.h"
 #include <libgen.h>
 
 void nandroid_generate_timestamp_path(const char* backup_path)
@@ -69,6 +77,13 @@ static void yaffs_callback(const char* filename)
 {
     if (filename == NULL)
         return;
+    // Scheduled backups report into their job; with several jobs running
+    // at once the file names would only interleave, so they aren't shown.
+    NandroidJob* job = nandroid_current_job();
+    if (job != NULL) {
+        nandroid_job_set_done(job, job->units_done + 1);
+        return;
+    }
     const char* justfile = basename(filename);
     char tmp[PATH_MAX];
     strcpy(tmp, justfile);
@@ -82,50 +97,297 @@ static void yaffs_callback(const char* filename)
     ui_reset_text_col();
 }
 
-static void compute_directory_stats(const char* directory)
+static int count_directory_entries(const char* directory)
 {
     char tmp[PATH_MAX];
     sprintf(tmp, "find %s | wc -l > /tmp/dircount", directory);
     __system(tmp);
     char count_text[100];
     FILE* f = fopen("/tmp/dircount", "r");
-    fread(count_text, 1, sizeof(count_text), f);
+    if (f == NULL)
+        return 0;
+    size_t len = fread(count_text, 1, sizeof(count_text) - 1, f);
+    count_text[len] = '\0';
     fclose(f);
+    return atoi(count_text);
+}
+
+static void compute_directory_stats(const char* directory)
+{
     yaffs_files_count = 0;
-    yaffs_files_total = atoi(count_text);
+    yaffs_files_total = count_directory_entries(directory);
     ui_reset_progress();
     ui_show_progress(1, 0);
 }
 
+// Digests of everything written by the current nandroid_backup, saved as
+// nandroid.md5 once all partitions are done.
+static Md5Manifest* backup_manifest = NULL;
+
+// nandroid.md5 refers to images by their name in the backup directory.
+static const char* image_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+static int record_digest(const char* image, const uint8_t* digest) {
+    if (backup_manifest == NULL)
+        return 0;
+    if (md5_manifest_add(backup_manifest, image_name(image), digest) != 0) {
+        ui_print("生成md5校验时出错\n");
+        return -1;
+    }
+    return 0;
+}
+
+// For images written outside of our streams (yaffs2, mtd and bml dumps),
+// which have to be read back.
+static int record_file_digest(const char* image) {
+    uint8_t digest[MD5_DIGEST_SIZE];
+    if (backup_manifest == NULL)
+        return 0;
+    if (md5_file(image, digest) != 0) {
+        ui_print("生成md5校验时出错\n");
+        return -1;
+    }
+    return record_digest(image, digest);
+}
+
 typedef void (*file_event_callback)(const char* filename);
 typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
 
 static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char backup_file_image_with_extension[PATH_MAX];
     sprintf(backup_file_image_with_extension, "%s.img", backup_file_image);
-    return mkyaffs2image(backup_path, backup_file_image_with_extension, 0, callback ? yaffs_callback : NULL);
+    int ret = mkyaffs2image(backup_path, backup_file_image_with_extension, 0, callback ? yaffs_callback : NULL);
+    if (ret == 0)
+        ret = record_file_digest(backup_file_image_with_extension);
+    return ret;
+}
+
+// Progress comes from the tar engine's entry counter; file names are
+// only echoed a few times a second so the log doesn't redraw per file.
+#define TAR_PRINT_INTERVAL_MS 200
+static void tar_callback(void* cookie, const char* path, const TarStats* stats)
+{
+    static struct timeval last_print;
+    int callback = *(int*) cookie;
+    NandroidJob* job = nandroid_current_job();
+    if (job != NULL) {
+        nandroid_job_set_done(job, stats->files);
+        return;
+    }
+    yaffs_files_count = stats->files;
+    if (yaffs_files_total != 0)
+        ui_set_progress((float)yaffs_files_count / (float)yaffs_files_total);
+    if (!callback)
+        return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long elapsed = (now.tv_sec - last_print.tv_sec) * 1000 + (now.tv_usec - last_print.tv_usec) / 1000;
+    if (elapsed >= 0 && elapsed < TAR_PRINT_INTERVAL_MS)
+        return;
+    last_print = now;
+    const char* justfile = basename(path);
+    if (strlen(justfile) < 30)
+        ui_print("%s", justfile);
+    ui_reset_text_col();
+}
+
+// Splits path into its parent directory and last component.
+static void split_path(const char* path, char* parent, char* name) {
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(parent, ".");
+        strcpy(name, path);
+    } else {
+        if (slash == path)
+            strcpy(parent, "/");
+        else {
+            memcpy(parent, path, slash - path);
+            parent[slash - path] = '\0';
+        }
+        strcpy(name, slash + 1);
+    }
+}
+
+// ro.cwm.nandroid_compression selects the codec for tar and emmc images:
+// "lz4" (default), "gzip" or "none".
+static int get_backup_compression() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_compression", value, "lz4");
+    int method = compression_from_name(value);
+    return method < 0 ? COMPRESSION_LZ4 : method;
+}
+
+static int get_compression_threads() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > 4 ? 4 : cpus;
+}
+
+// ro.cwm.nandroid_incremental=true keeps tar and emmc images in a chunk
+// store shared by all backups, so data already stored by an earlier
+// backup isn't written again.
+static int get_backup_incremental() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_incremental", value, "false");
+    return strcmp(value, "true") == 0;
+}
+
+// Chunks are kept in <volume>/clockworkmod/blobs on the volume that holds
+// the backup, wherever on it the backup is.  Returns -1 if the image is
+// not on a volume that survives a reboot.
+static int chunk_store_for_image(const char* image, char* store) {
+    Volume* v = volume_for_path(image);
+    if (v == NULL || strcmp(v->fs_type, "ramdisk") == 0) {
+        ui_print("%s 不在存储卷上，无法使用增量备份库\n", image);
+        return -1;
+    }
+    snprintf(store, PATH_MAX, "%s/clockworkmod/blobs", v->mount_point);
+    return 0;
+}
+
+// The end of a backup stream: the image file, behind the compressor or
+// the chunk store, digested as it is written.
+typedef struct {
+    char path[PATH_MAX];
+    int fd;
+    Md5Writer md5;
+    CompressWriter* compress;
+    ChunkWriter* chunks;
+    stream_write_fn write;
+    void* cookie;
+} ImageWriter;
+
+// base is the image name without the compression or chunk index
+// extension, which is picked here.
+static int image_writer_open(ImageWriter* w, const char* base) {
+    int compression = get_backup_compression();
+    int incremental = get_backup_incremental();
+    memset(w, 0, sizeof(*w));
+    snprintf(w->path, sizeof(w->path), "%s%s", base,
+             incremental ? CHUNK_INDEX_EXTENSION : compression_extension(compression));
+    w->fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+        return -1;
+
+    md5_writer_init(&w->md5, stream_write_fd, &w->fd);
+    w->write = md5_writer_write;
+    w->cookie = &w->md5;
+    if (incremental) {
+        char store[PATH_MAX];
+        if (chunk_store_for_image(w->path, store) == 0)
+            w->chunks = chunk_writer_open(store, compression, md5_writer_write, &w->md5);
+        if (w->chunks == NULL) {
+            close(w->fd);
+            return -1;
+        }
+        w->write = chunk_writer_write;
+        w->cookie = w->chunks;
+    } else if (compression != COMPRESSION_NONE) {
+        w->compress = compress_writer_open(compression, get_compression_threads(), md5_writer_write, &w->md5);
+        if (w->compress == NULL) {
+            close(w->fd);
+            return -1;
+        }
+        w->write = compress_writer_write;
+        w->cookie = w->compress;
+    }
+    return 0;
+}
+
+// ret is the result of producing the stream; the digest is recorded if
+// that and flushing all stages succeeded.
+static int image_writer_close(ImageWriter* w, int ret) {
+    if (w->chunks != NULL) {
+        ChunkStats stats;
+        if (chunk_writer_close(w->chunks, &stats) != 0)
+            ret = -1;
+        else if (ret == 0)
+            ui_print("%s：%lluMB，其中 %lluMB 已在备份库中\n", image_name(w->path),
+                     stats.bytes >> 20, stats.reused_bytes >> 20);
+    }
+    if (w->compress != NULL && compress_writer_close(w->compress) != 0)
+        ret = -1;
+    if (close(w->fd) != 0)
+        ret = -1;
+    if (ret == 0)
+        ret = record_digest(w->path, MD5_final(&w->md5.ctx));
+    return ret;
+}
+
+// The start of a restore stream, picked by the image's extension.  Images
+// have already been checked against nandroid.md5 by nandroid_restore.
+typedef struct {
+    int fd;
+    DecompressReader* decompress;
+    ChunkReader* chunks;
+    stream_read_fn read;
+    void* cookie;
+} ImageReader;
+
+static int image_reader_open(ImageReader* r, const char* path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0)
+        return -1;
+
+    r->read = stream_read_fd;
+    r->cookie = &r->fd;
+    int compression = compression_for_file(path);
+    if (is_chunk_index(path)) {
+        char store[PATH_MAX];
+        if (chunk_store_for_image(path, store) == 0)
+            r->chunks = chunk_reader_open(store, stream_read_fd, &r->fd);
+        if (r->chunks == NULL) {
+            close(r->fd);
+            return -1;
+        }
+        r->read = chunk_reader_read;
+        r->cookie = r->chunks;
+    } else if (compression != COMPRESSION_NONE) {
+        r->decompress = decompress_reader_open(compression, stream_read_fd, &r->fd);
+        if (r->decompress == NULL) {
+            close(r->fd);
+            return -1;
+        }
+        r->read = decompress_reader_read;
+        r->cookie = r->decompress;
+    }
+    return 0;
+}
+
+// ret is the result of consuming the stream, and is passed back.
+static int image_reader_close(ImageReader* r, int ret) {
+    if (r->chunks != NULL)
+        chunk_reader_close(r->chunks);
+    if (r->decompress != NULL)
+        decompress_reader_close(r->decompress);
+    close(r->fd);
+    return ret;
 }
 
 static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
+    char parent[PATH_MAX];
+    char name[PATH_MAX];
+    const char* media_excludes[] = { "data/media", NULL };
+    const char** excludes = NULL;
     if (strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL)
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar --exclude 'media' $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
-    else
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
+        excludes = media_excludes;
 
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
+    split_path(backup_path, parent, name);
+    sprintf(tmp, "%s.tar", backup_file_image);
+    ImageWriter image;
+    if (image_writer_open(&image, tmp) != 0) {
         ui_print("无法执行tar压缩\n");
         return -1;
     }
-
-    while (fgets(tmp, PATH_MAX, fp) != NULL) {
-        tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            yaffs_callback(tmp);
-    }
-
-    return __pclose(fp);
+    int ret = tar_create(parent, name, excludes, image.write, image.cookie, tar_callback, &callback);
+    return image_writer_close(&image, ret);
 }
 
 static nandroid_backup_handler get_backup_handler(const char *backup_path) {
@@ -160,6 +422,143 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
 }
 
 
+// emmc partitions are plain block devices, so they can be streamed through
+// the compressor and digested on the way; mtd and bml dumps need their
+// flash utilities and are always written uncompressed.
+static int resolve_emmc_device(const char* device, char* path) {
+    if (device[0] == '/') {
+        strcpy(path, device);
+        return 0;
+    }
+    return cmd_mmc_get_partition_device(device, path);
+}
+
+#define RAW_COPY_BUFFER_SIZE (1024 * 1024)
+
+static int copy_stream(stream_read_fn read, void* read_cookie, stream_write_fn write, void* write_cookie) {
+    char* buffer = malloc(RAW_COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+        return -1;
+    int ret = 0;
+    ssize_t len;
+    while ((len = read(read_cookie, buffer, RAW_COPY_BUFFER_SIZE)) > 0) {
+        if (write(write_cookie, buffer, len) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (len < 0)
+        ret = -1;
+    free(buffer);
+    return ret;
+}
+
+static int nandroid_backup_raw(const char* fs_type, const char* device, const char* image) {
+    if (strcmp(fs_type, "emmc") != 0) {
+        int ret = backup_raw_partition(fs_type, device, image);
+        if (ret == 0)
+            ret = record_file_digest(image);
+        return ret;
+    }
+
+    char path[PATH_MAX];
+    if (resolve_emmc_device(device, path) != 0)
+        return -1;
+    int in = block_io_open(path, O_RDONLY, BLOCK_IO_DIRECT);
+    if (in < 0)
+        return -1;
+    ImageWriter out;
+    if (image_writer_open(&out, image) != 0) {
+        close(in);
+        return -1;
+    }
+    // The device is read ahead on its own thread while the previous
+    // buffer is compressed and written.  Erased space goes into the image
+    // as sparse fill records, so large, mostly empty partitions are
+    // neither read back in full on restore nor fed through the
+    // compressor as data.
+    int ret = -1;
+    off64_t size = lseek64(in, 0, SEEK_END);
+    BlockReader* reader = NULL;
+    if (size >= 0 && lseek64(in, 0, SEEK_SET) == 0)
+        reader = block_reader_open(in);
+    if (reader != NULL) {
+        SparseWriter* sparse = NULL;
+        if (size > 0)
+            sparse = sparse_writer_open(size, out.write, out.cookie);
+        if (sparse != NULL) {
+            ret = copy_stream(block_reader_read, reader, sparse_writer_write, sparse);
+            if (sparse_writer_close(sparse) != 0)
+                ret = -1;
+        } else {
+            ret = copy_stream(block_reader_read, reader, out.write, out.cookie);
+        }
+        block_reader_close(reader);
+    }
+    close(in);
+    return image_writer_close(&out, ret);
+}
+
+// Sparse emmc images get their own extension, so that a recovery which
+// predates them doesn't write one out as a raw image.
+#define SPARSE_IMAGE_EXTENSION ".simg"
+
+static void raw_image_name(char* image, const char* backup_path, const char* name, const char* fs_type) {
+    sprintf(image, "%s/%s%s", backup_path, name,
+            strcmp(fs_type, "emmc") == 0 ? SPARSE_IMAGE_EXTENSION : ".img");
+}
+
+static int nandroid_restore_raw(const char* fs_type, const char* device, const char* image) {
+    if (strcmp(fs_type, "emmc") != 0) {
+        if (compression_for_file(image) == COMPRESSION_NONE && !is_chunk_index(image))
+            return restore_raw_partition(fs_type, device, image);
+        ui_print("不支持压缩的 %s 镜像\n", fs_type);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    if (resolve_emmc_device(device, path) != 0)
+        return -1;
+    int out = block_io_open(path, O_WRONLY, BLOCK_IO_DIRECT);
+    if (out < 0)
+        return -1;
+    ImageReader in;
+    if (image_reader_open(&in, image) != 0) {
+        close(out);
+        return -1;
+    }
+    BlockWriter* writer = block_writer_open(out);
+    if (writer == NULL) {
+        close(out);
+        return image_reader_close(&in, -1);
+    }
+    // Images from before sparse backups are copied through unchanged.
+    SparseOutput output = { block_writer_write, block_writer_skip, writer };
+    int ret = sparse_copy(in.read, in.cookie, &output);
+    if (block_writer_close(writer) != 0)
+        ret = -1;
+    close(out);
+    return image_reader_close(&in, ret);
+}
+
+// Looks for base as written, compressed, or as a chunk index; fills in
+// path with the name found.
+static int find_backup_image(const char* base, char* path) {
+    static const int methods[] = { COMPRESSION_NONE, COMPRESSION_LZ4, COMPRESSION_GZIP };
+    struct stat st;
+    unsigned int i;
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        sprintf(path, "%s%s", base, compression_extension(methods[i]));
+        if (stat(path, &st) == 0)
+            return 0;
+    }
+    sprintf(path, "%s%s", base, CHUNK_INDEX_EXTENSION);
+    if (stat(path, &st) == 0)
+        return 0;
+    strcpy(path, base);
+    return -1;
+}
+
 int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char* name = basename(mount_point);
@@ -212,9 +611,9 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
         const char* name = basename(root);
-        sprintf(tmp, "%s/%s.img", backup_path, name);
+        raw_image_name(tmp, backup_path, name, vol->fs_type);
         ui_print("正在备份 %s 镜像...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->device, tmp))) {
+        if (0 != (ret = nandroid_backup_raw(vol->fs_type, vol->device, tmp))) {
             ui_print("备份 %s 镜像时出错\n", name);
             return ret;
         }
@@ -224,37 +623,11 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
     return nandroid_backup_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_backup(const char* backup_path)
+static int nandroid_backup_sequential(const char* backup_path)
 {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    
-    if (ensure_path_mounted(backup_path) != 0) {
-        return print_and_error("无法挂载备份路径\n");
-    }
-    
-    Volume* volume = volume_for_path(backup_path);
-    if (NULL == volume) {
-      if (strstr(backup_path, "/sdcard") == backup_path && is_data_media())
-          volume = volume_for_path("/data");
-      else
-          return print_and_error("无法找到备份路径的所在卷\n");
-    }
     int ret;
-    struct statfs s;
-    if (NULL != volume) {
-        if (0 != (ret = statfs(volume->mount_point, &s)))
-            return print_and_error("无法分析备份路径\n");
-        uint64_t bavail = s.f_bavail;
-        uint64_t bsize = s.f_bsize;
-        uint64_t sdcard_free = bavail * bsize;
-        uint64_t sdcard_free_mb = sdcard_free / (uint64_t)(1024 * 1024);
-        ui_print("SD卡剩余空间：%lluMB\n", sdcard_free_mb);
-        if (sdcard_free_mb < 150)
-            ui_print("剩余空间可能不足...继续执行...\n");
-    }
+    struct stat s;
     char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", backup_path);
-    __system(tmp);
 
     if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
         return ret;
@@ -271,6 +644,8 @@ int nandroid_backup(const char* backup_path)
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
         ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
+        if (0 == ret)
+            ret = record_file_digest(tmp);
         if (0 != ret)
             return print_and_error("生成WiMAX镜像时出错\n");
     }
@@ -312,12 +687,278 @@ int nandroid_backup(const char* backup_path)
             return ret;
     }
 
-    ui_print("正在生成md5校验...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
-        ui_print("生成md5校验时出错\n");
+    return 0;
+}
+
+typedef struct {
+    char name[64];
+    char mount_point[PATH_MAX];
+    char image[PATH_MAX];
+    const char* fs_type;        // set for raw partition jobs only
+    const char* device;
+    nandroid_backup_handler handler;
+    int umount_when_finished;
+} BackupJob;
+
+#define MAX_BACKUP_JOBS 16
+
+typedef struct {
+    NandroidJob jobs[MAX_BACKUP_JOBS];
+    BackupJob backups[MAX_BACKUP_JOBS];
+    int count;
+} BackupSchedule;
+
+static int run_raw_backup_job(void* arg) {
+    BackupJob* b = (BackupJob*) arg;
+    int ret = nandroid_backup_raw(b->fs_type, b->device, b->image);
+    if (ret != 0)
+        ui_print("备份 %s 镜像时出错\n", b->name);
+    return ret;
+}
+
+static int run_fs_backup_job(void* arg) {
+    BackupJob* b = (BackupJob*) arg;
+    int ret = b->handler(b->mount_point, b->image, 1);
+    if (ret != 0)
+        ui_print("生成 %s 备份镜像时出错\n", b->mount_point);
+    return ret;
+}
+
+static BackupJob* new_backup_job(BackupSchedule* schedule, const char* name) {
+    if (schedule->count == MAX_BACKUP_JOBS)
+        return NULL;
+    NandroidJob* job = &schedule->jobs[schedule->count];
+    BackupJob* b = &schedule->backups[schedule->count];
+    memset(job, 0, sizeof(*job));
+    memset(b, 0, sizeof(*b));
+    snprintf(b->name, sizeof(b->name), "%s", name);
+    job->name = b->name;
+    job->arg = b;
+    schedule->count++;
+    return b;
+}
+
+static int schedule_raw_backup(BackupSchedule* schedule, const char* name, Volume* vol, const char* image) {
+    BackupJob* b = new_backup_job(schedule, name);
+    if (b == NULL)
+        return -1;
+    NandroidJob* job = &schedule->jobs[schedule->count - 1];
+    snprintf(b->image, sizeof(b->image), "%s", image);
+    b->fs_type = vol->fs_type;
+    b->device = vol->device;
+    job->device = vol->device;
+    // The mtd/mmc/bml dumpers share partition tables held in globals.
+    job->engine = "raw";
+    job->weight = 4;
+    job->run = run_raw_backup_job;
+    return 0;
+}
+
+// Mounts the volume and resolves everything the job needs up front, on
+// the calling thread, since the mount and volume tables aren't thread
+// safe.
+static int schedule_fs_backup(BackupSchedule* schedule, const char* backup_path, const char* mount_point, int umount_when_finished) {
+    char name[PATH_MAX];
+    char parent[PATH_MAX];
+    split_path(mount_point, parent, name);
+
+    int ret;
+    if (0 != (ret = ensure_path_mounted(mount_point))) {
+        ui_print("无法挂载：%s\n", mount_point);
         return ret;
     }
+    scan_mounted_volumes();
+    Volume *v = volume_for_path(mount_point);
+    MountedVolume *mv = NULL;
+    if (v != NULL)
+        mv = find_mounted_volume_by_mount_point(v->mount_point);
+    nandroid_backup_handler handler = get_backup_handler(mount_point);
+    if (handler == NULL) {
+        ui_print("获取备份处理程序出错\n");
+        return -2;
+    }
+
+    BackupJob* b = new_backup_job(schedule, name);
+    if (b == NULL)
+        return -1;
+    NandroidJob* job = &schedule->jobs[schedule->count - 1];
+    snprintf(b->mount_point, sizeof(b->mount_point), "%s", mount_point);
+    if (mv == NULL || mv->filesystem == NULL)
+        snprintf(b->image, sizeof(b->image), "%s/%s.auto", backup_path, name);
+    else
+        snprintf(b->image, sizeof(b->image), "%s/%s.%s", backup_path, name, mv->filesystem);
+    b->handler = handler;
+    b->umount_when_finished = umount_when_finished;
+
+    int entries = count_directory_entries(mount_point);
+    job->device = v != NULL ? v->device : NULL;
+    if (handler == mkyaffs2image_wrapper)
+        job->engine = "yaffs2";
+    job->weight = 1 + entries / 256.0f;
+    job->run = run_fs_backup_job;
+    nandroid_job_set_total(job, entries);
+    return 0;
+}
+
+static int schedule_partition_backup(BackupSchedule* schedule, const char* backup_path, const char* root) {
+    Volume *vol = volume_for_path(root);
+    if (vol == NULL || vol->fs_type == NULL)
+        return 0;
+
+    if (strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0) {
+        char name[PATH_MAX];
+        char parent[PATH_MAX];
+        char image[PATH_MAX];
+        split_path(root, parent, name);
+        raw_image_name(image, backup_path, name, vol->fs_type);
+        return schedule_raw_backup(schedule, name, vol, image);
+    }
+
+    return schedule_fs_backup(schedule, backup_path, root, 1);
+}
+
+// Same partitions and rules as nandroid_backup_sequential, but partitions
+// are collected into jobs first and then run on a worker pool.
+static int nandroid_backup_scheduled(const char* backup_path, int concurrency)
+{
+    int ret;
+    struct stat s;
+    char tmp[PATH_MAX];
+    BackupSchedule schedule;
+    memset(&schedule, 0, sizeof(schedule));
+
+    if (0 != (ret = schedule_partition_backup(&schedule, backup_path, "/boot")))
+        goto done;
+
+    if (0 != (ret = schedule_partition_backup(&schedule, backup_path, "/recovery")))
+        goto done;
+
+    Volume *vol = volume_for_path("/wimax");
+    if (vol != NULL && 0 == stat(vol->device, &s))
+    {
+        char serialno[PROPERTY_VALUE_MAX];
+        serialno[0] = 0;
+        property_get("ro.serialno", serialno, "");
+        sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
+        if (0 != (ret = schedule_raw_backup(&schedule, "WiMAX", vol, tmp)))
+            goto done;
+    }
+
+    if (0 != (ret = schedule_partition_backup(&schedule, backup_path, "/system")))
+        goto done;
+
+    if (0 != (ret = schedule_partition_backup(&schedule, backup_path, "/data")))
+        goto done;
+
+    if (has_datadata()) {
+        if (0 != (ret = schedule_partition_backup(&schedule, backup_path, "/datadata")))
+            goto done;
+    }
+
+    if (0 != stat("/sdcard/.android_secure", &s))
+    {
+        ui_print("未发现/sdcard/.android_secure，跳过备份外置SD卡上的应用程序\n");
+    }
+    else
+    {
+        if (0 != (ret = schedule_fs_backup(&schedule, backup_path, "/sdcard/.android_secure", 0)))
+            goto done;
+    }
+
+    if (0 != (ret = schedule_fs_backup(&schedule, backup_path, "/cache", 0)))
+        goto done;
+
+    vol = volume_for_path("/sd-ext");
+    if (vol == NULL || 0 != stat(vol->device, &s))
+    {
+        ui_print("未发现sd-ext分区（App2SD+），跳过备份sd-ext\n");
+    }
+    else
+    {
+        if (0 != ensure_path_mounted("/sd-ext"))
+            ui_print("无法挂载sd-ext，此设备可能不支持备份sd-ext，跳过备份sd-ext\n");
+        else if (0 != (ret = schedule_partition_backup(&schedule, backup_path, "/sd-ext")))
+            goto done;
+    }
+
+    ret = nandroid_run_jobs(schedule.jobs, schedule.count, concurrency);
+
+done:
+    {
+        int i;
+        for (i = 0; i < schedule.count; i++) {
+            if (schedule.backups[i].umount_when_finished)
+                ensure_path_unmounted(schedule.backups[i].mount_point);
+        }
+    }
+    return ret;
+}
+
+// ro.cwm.nandroid_jobs > 1 enables the scheduled backup mode with that
+// many worker threads.
+static int get_backup_concurrency()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_jobs", value, "1");
+    int jobs = atoi(value);
+    return jobs > 0 ? jobs : 1;
+}
+
+int nandroid_backup(const char* backup_path)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    
+    if (ensure_path_mounted(backup_path) != 0) {
+        return print_and_error("无法挂载备份路径\n");
+    }
+    
+    Volume* volume = volume_for_path(backup_path);
+    if (NULL == volume) {
+      if (strstr(backup_path, "/sdcard") == backup_path && is_data_media())
+          volume = volume_for_path("/data");
+      else
+          return print_and_error("无法找到备份路径的所在卷\n");
+    }
+    int ret;
+    struct statfs s;
+    if (NULL != volume) {
+        if (0 != (ret = statfs(volume->mount_point, &s)))
+            return print_and_error("无法分析备份路径\n");
+        uint64_t bavail = s.f_bavail;
+        uint64_t bsize = s.f_bsize;
+        uint64_t sdcard_free = bavail * bsize;
+        uint64_t sdcard_free_mb = sdcard_free / (uint64_t)(1024 * 1024);
+        ui_print("SD卡剩余空间：%lluMB\n", sdcard_free_mb);
+        if (sdcard_free_mb < 150)
+            ui_print("剩余空间可能不足...继续执行...\n");
+    }
+    char tmp[PATH_MAX];
+    sprintf(tmp, "mkdir -p %s", backup_path);
+    __system(tmp);
+
+    backup_manifest = md5_manifest_create();
+    if (backup_manifest == NULL)
+        return print_and_error("生成md5校验时出错\n");
+
+    int concurrency = get_backup_concurrency();
+    if (concurrency > 1)
+        ret = nandroid_backup_scheduled(backup_path, concurrency);
+    else
+        ret = nandroid_backup_sequential(backup_path);
+
+    // The digests were taken while the images were written.
+    if (0 == ret) {
+        ui_print("正在生成md5校验...\n");
+        sprintf(tmp, "%s/nandroid.md5", backup_path);
+        if (0 != (ret = md5_manifest_write(backup_manifest, tmp)))
+            ui_print("生成md5校验时出错\n");
+    }
+    md5_manifest_free(backup_manifest);
+    backup_manifest = NULL;
+    if (0 != ret)
+        return ret;
     
     sync();
     ui_set_background(BACKGROUND_ICON_CLOCKWORK);
@@ -341,22 +982,17 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
 }
 
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; tar xvf %s ; exit $?", backup_path, backup_file_image);
+    char parent[PATH_MAX];
+    char name[PATH_MAX];
+    split_path(backup_path, parent, name);
 
-    char path[PATH_MAX];
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
+    ImageReader image;
+    if (image_reader_open(&image, backup_file_image) != 0) {
         ui_print("无法执行tar压缩\n");
         return -1;
     }
-
-    while (fgets(path, PATH_MAX, fp) != NULL) {
-        if (callback)
-            yaffs_callback(path);
-    }
-
-    return __pclose(fp);
+    int ret = tar_extract(parent, image.read, image.cookie, tar_callback, &callback);
+    return image_reader_close(&image, ret);
 }
 
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
@@ -419,8 +1055,9 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                 restore_handler = unyaffs_wrapper;
                 break;
             }
-            sprintf(tmp, "%s/%s.%s.tar", backup_path, name, filesystem);
-            if (0 == (ret = statfs(tmp, &file_info))) {
+            char tar_base[PATH_MAX];
+            sprintf(tar_base, "%s/%s.%s.tar", backup_path, name, filesystem);
+            if (0 == (ret = find_backup_image(tar_base, tmp))) {
                 backup_filesystem = filesystem;
                 restore_handler = tar_extract_wrapper;
                 break;
@@ -507,14 +1144,20 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "emmc") == 0) {
         int ret;
         const char* name = basename(root);
+        char image[PATH_MAX];
+        raw_image_name(image, backup_path, name, vol->fs_type);
+        // emmc backups from before sparse images are plain .img files.
+        if (find_backup_image(image, tmp) != 0 && strcmp(vol->fs_type, "emmc") == 0) {
+            sprintf(image, "%s/%s.img", backup_path, name);
+            find_backup_image(image, tmp);
+        }
         ui_print("还原前擦除 %s ...\n", name);
         if (0 != (ret = format_volume(root))) {
             ui_print("擦除 %s 时出错", name);
             return ret;
         }
-        sprintf(tmp, "%s%s.img", backup_path, root);
         ui_print("正在还原 %s 镜像...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
+        if (0 != (ret = nandroid_restore_raw(vol->fs_type, vol->device, tmp))) {
             ui_print("写入 %s 镜像时出错", name);
             return ret;
         }
@@ -523,22 +1166,9 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+static int nandroid_restore_partitions(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
 {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_show_indeterminate_progress();
-    yaffs_files_total = 0;
-
-    if (ensure_path_mounted(backup_path) != 0)
-        return print_and_error("无法挂载备份路径\n");
-    
     char tmp[PATH_MAX];
-
-    ui_print("正在检查md5校验...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("md5校验失败\n");
-    
     int ret;
 
     if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
@@ -591,6 +1221,38 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
         return ret;
 
+    return 0;
+}
+
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    yaffs_files_total = 0;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("无法挂载备份路径\n");
+
+    // Every image is checked once, up front, before anything is erased;
+    // the restore streams themselves are not digested again.
+    char tmp[PATH_MAX];
+    const char* failed;
+    ui_print("正在检查md5校验...\n");
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    Md5Manifest* manifest = md5_manifest_read(tmp);
+    if (manifest == NULL)
+        return print_and_error("md5校验失败\n");
+    if (md5_manifest_verify(manifest, backup_path, &failed) != 0) {
+        ui_print("%s md5校验失败\n", failed);
+        md5_manifest_free(manifest);
+        return print_and_error("md5校验失败\n");
+    }
+    md5_manifest_free(manifest);
+
+    int ret = nandroid_restore_partitions(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    if (0 != ret)
+        return ret;
+
     sync();
     ui_set_background(BACKGROUND_ICON_CLOCKWORK);
     ui_reset_progress();
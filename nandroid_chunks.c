@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mincrypt/sha.h"
+
+#include "nandroid_chunks.h"
+
+// Chunks end where the low bits of a gear hash over the last 32 bytes
+// are all zero, but are never shorter than CHUNK_MIN_SIZE or longer than
+// CHUNK_MAX_SIZE; the mask puts the average around 384KB.
+#define CHUNK_MIN_SIZE          (128 * 1024)
+#define CHUNK_MAX_SIZE          (2 * 1024 * 1024)
+#define CHUNK_BOUNDARY_MASK     ((1 << 18) - 1)
+#define GEAR_WINDOW             32
+
+#define CHUNK_INDEX_MAGIC       "nandroid-chunks"
+#define CHUNK_INDEX_VERSION     1
+
+// Chunk boundaries depend on this table, so it must never change; it is
+// generated from a fixed seed rather than spelled out.
+static uint32_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void init_gear() {
+    uint32_t x = 0x6e616e64;
+    int i;
+    for (i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gear[i] = x;
+    }
+}
+
+static const char* compression_name(int method) {
+    switch (method) {
+        case COMPRESSION_GZIP:
+            return "gzip";
+        case COMPRESSION_LZ4:
+            return "lz4";
+        default:
+            return "none";
+    }
+}
+
+int is_chunk_index(const char* path) {
+    size_t len = strlen(path);
+    size_t ext_len = strlen(CHUNK_INDEX_EXTENSION);
+    return len >= ext_len && strcmp(path + len - ext_len, CHUNK_INDEX_EXTENSION) == 0;
+}
+
+static void sha_to_hex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[SHA_DIGEST_SIZE * 2] = '\0';
+}
+
+static int hex_to_sha(const char* hex, uint8_t* digest) {
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE * 2; i++) {
+        char c = hex[i];
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else
+            return -1;
+        if (i & 1)
+            digest[i / 2] |= v;
+        else
+            digest[i / 2] = v << 4;
+    }
+    return 0;
+}
+
+static void chunk_path(const char* store, const char* hex, int compression, char* path) {
+    snprintf(path, PATH_MAX, "%s/%.2s/%s%s", store, hex, hex, compression_extension(compression));
+}
+
+struct ChunkWriter {
+    char store[PATH_MAX];
+    int compression;
+    stream_write_fn index_sink;
+    void* cookie;
+
+    uint8_t* buf;
+    size_t len;
+    size_t scanned;             // bytes of buf already fed to the hash
+    uint32_t hash;
+    int error;
+    ChunkStats stats;
+};
+
+static int make_dir(const char* path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static int write_blob(ChunkWriter* w, const char* path, const uint8_t* data, size_t len) {
+    // Written under a temporary name so a chunk that exists is always
+    // complete, even with several backup jobs storing the same chunk.
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx.tmp", path, getpid(), (unsigned long) pthread_self());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int ret;
+    if (w->compression == COMPRESSION_NONE) {
+        ret = stream_write_fd(&fd, data, len);
+    } else {
+        ret = -1;
+        CompressWriter* writer = compress_writer_open(w->compression, 0, stream_write_fd, &fd);
+        if (writer != NULL) {
+            ret = compress_writer_write(writer, data, len);
+            if (compress_writer_close(writer) != 0)
+                ret = -1;
+        }
+    }
+    if (close(fd) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp, path) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(tmp);
+    return ret;
+}
+
+static int store_chunk(ChunkWriter* w, const uint8_t* data, size_t len) {
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    char path[PATH_MAX];
+    char line[SHA_DIGEST_SIZE * 2 + 32];
+    struct stat st;
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    SHA_update(&ctx, data, len);
+    sha_to_hex(SHA_final(&ctx), hex);
+    chunk_path(w->store, hex, w->compression, path);
+
+    w->stats.chunks++;
+    w->stats.bytes += len;
+    if (stat(path, &st) == 0) {
+        w->stats.reused_chunks++;
+        w->stats.reused_bytes += len;
+    } else {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%.2s", w->store, hex);
+        if (make_dir(dir) != 0 || write_blob(w, path, data, len) != 0) {
+            fprintf(stderr, "chunks: can't store %s\n", path);
+            return -1;
+        }
+    }
+
+    snprintf(line, sizeof(line), "%s %lu\n", hex, (unsigned long) len);
+    return w->index_sink(w->cookie, line, strlen(line));
+}
+
+// Returns the length of the chunk at the start of buf if its end has
+// been seen, 0 if more data is needed.
+static size_t find_boundary(ChunkWriter* w) {
+    size_t i = w->scanned;
+    // The hash only depends on the last GEAR_WINDOW bytes, so the start
+    // of a chunk doesn't need to be hashed at all.
+    if (i < CHUNK_MIN_SIZE - GEAR_WINDOW)
+        i = CHUNK_MIN_SIZE - GEAR_WINDOW;
+    uint32_t hash = w->hash;
+    for (; i < w->len; i++) {
+        hash = (hash << 1) + gear[w->buf[i]];
+        if (i + 1 >= CHUNK_MIN_SIZE && (hash & CHUNK_BOUNDARY_MASK) == 0) {
+            w->scanned = i + 1;
+            return i + 1;
+        }
+    }
+    w->hash = hash;
+    if (w->len > w->scanned)
+        w->scanned = w->len;
+    return w->len == CHUNK_MAX_SIZE ? CHUNK_MAX_SIZE : 0;
+}
+
+ChunkWriter* chunk_writer_open(const char* store, int compression,
+                               stream_write_fn index_sink, void* cookie) {
+    pthread_once(&gear_once, init_gear);
+    if (make_dir(store) != 0) {
+        fprintf(stderr, "chunks: can't create %s\n", store);
+        return NULL;
+    }
+
+    ChunkWriter* w = calloc(1, sizeof(ChunkWriter));
+    if (w == NULL)
+        return NULL;
+    w->buf = malloc(CHUNK_MAX_SIZE);
+    if (w->buf == NULL) {
+        free(w);
+        return NULL;
+    }
+    snprintf(w->store, sizeof(w->store), "%s", store);
+    w->compression = compression;
+    w->index_sink = index_sink;
+    w->cookie = cookie;
+
+    char header[64];
+    snprintf(header, sizeof(header), "%s %d %s\n", CHUNK_INDEX_MAGIC, CHUNK_INDEX_VERSION,
+             compression_name(compression));
+    if (index_sink(cookie, header, strlen(header)) != 0)
+        w->error = -1;
+    return w;
+}
+
+int chunk_writer_write(void* cookie, const void* data, size_t len) {
+    ChunkWriter* w = (ChunkWriter*) cookie;
+    const uint8_t* p = (const uint8_t*) data;
+    if (w->error)
+        return -1;
+    while (len > 0) {
+        size_t n = CHUNK_MAX_SIZE - w->len;
+        if (n > len)
+            n = len;
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+
+        size_t end;
+        while ((end = find_boundary(w)) > 0) {
+            if (store_chunk(w, w->buf, end) != 0) {
+                w->error = -1;
+                return -1;
+            }
+            memmove(w->buf, w->buf + end, w->len - end);
+            w->len -= end;
+            w->scanned = 0;
+            w->hash = 0;
+        }
+    }
+    return 0;
+}
+
+int chunk_writer_close(ChunkWriter* w, ChunkStats* stats) {
+    if (!w->error && w->len > 0 && store_chunk(w, w->buf, w->len) != 0)
+        w->error = -1;
+    int ret = w->error;
+    if (stats != NULL)
+        *stats = w->stats;
+    free(w->buf);
+    free(w);
+    return ret;
+}
+
+#define INDEX_LINE_MAX 128
+
+struct ChunkReader {
+    char store[PATH_MAX];
+    int compression;
+    stream_read_fn index_source;
+    void* cookie;
+    char index_buf[4096];
+    size_t index_len;
+    size_t index_pos;
+    int index_eof;
+
+    int fd;                     // current chunk, -1 between chunks
+    DecompressReader* decompress;
+    SHA_CTX ctx;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    size_t remaining;
+    int error;
+};
+
+// Reads the next line of the index without its newline.  Returns 1 for
+// a line, 0 at the end of the index, -1 on error.
+static int read_index_line(ChunkReader* r, char* line) {
+    size_t len = 0;
+    for (;;) {
+        if (r->index_pos == r->index_len) {
+            if (r->index_eof)
+                break;
+            ssize_t got = r->index_source(r->cookie, r->index_buf, sizeof(r->index_buf));
+            if (got < 0)
+                return -1;
+            if (got == 0) {
+                r->index_eof = 1;
+                break;
+            }
+            r->index_len = got;
+            r->index_pos = 0;
+        }
+        char c = r->index_buf[r->index_pos++];
+        if (c == '\n') {
+            line[len] = '\0';
+            return 1;
+        }
+        if (len == INDEX_LINE_MAX - 1)
+            return -1;
+        line[len++] = c;
+    }
+    if (len == 0)
+        return 0;
+    line[len] = '\0';
+    return 1;
+}
+
+static void close_chunk(ChunkReader* r) {
+    if (r->decompress != NULL) {
+        decompress_reader_close(r->decompress);
+        r->decompress = NULL;
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+}
+
+// Opens the next chunk of the index.  Returns 1 if there is one, 0 at
+// the end of the index, -1 on error.
+static int open_next_chunk(ChunkReader* r) {
+    char line[INDEX_LINE_MAX];
+    char path[PATH_MAX];
+    int ret;
+    do {
+        ret = read_index_line(r, line);
+        if (ret <= 0)
+            return ret;
+    } while (line[0] == '\0');
+
+    unsigned long len;
+    if (strlen(line) < SHA_DIGEST_SIZE * 2 + 2 || line[SHA_DIGEST_SIZE * 2] != ' ' ||
+            hex_to_sha(line, r->digest) != 0 ||
+            sscanf(line + SHA_DIGEST_SIZE * 2 + 1, "%lu", &len) != 1) {
+        fprintf(stderr, "chunks: bad index line \"%s\"\n", line);
+        return -1;
+    }
+    memcpy(r->hex, line, SHA_DIGEST_SIZE * 2);
+    r->hex[SHA_DIGEST_SIZE * 2] = '\0';
+    r->remaining = len;
+
+    chunk_path(r->store, r->hex, r->compression, path);
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        fprintf(stderr, "chunks: missing %s\n", path);
+        return -1;
+    }
+    if (r->compression != COMPRESSION_NONE) {
+        r->decompress = decompress_reader_open(r->compression, stream_read_fd, &r->fd);
+        if (r->decompress == NULL) {
+            close_chunk(r);
+            return -1;
+        }
+    }
+    SHA_init(&r->ctx);
+    return 1;
+}
+
+ChunkReader* chunk_reader_open(const char* store, stream_read_fn index_source, void* cookie) {
+    ChunkReader* r = calloc(1, sizeof(ChunkReader));
+    if (r == NULL)
+        return NULL;
+    snprintf(r->store, sizeof(r->store), "%s", store);
+    r->index_source = index_source;
+    r->cookie = cookie;
+    r->fd = -1;
+
+    char line[INDEX_LINE_MAX];
+    char magic[32];
+    char method[16];
+    int version;
+    if (read_index_line(r, line) != 1 ||
+            sscanf(line, "%31s %d %15s", magic, &version, method) != 3 ||
+            strcmp(magic, CHUNK_INDEX_MAGIC) != 0 || version != CHUNK_INDEX_VERSION ||
+            (r->compression = compression_from_name(method)) < 0) {
+        fprintf(stderr, "chunks: unsupported index\n");
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+ssize_t chunk_reader_read(void* cookie, void* data, size_t len) {
+    ChunkReader* r = (ChunkReader*) cookie;
+    if (r->error)
+        return -1;
+    while (r->fd < 0) {
+        int ret = open_next_chunk(r);
+        if (ret == 0)
+            return 0;
+        if (ret < 0) {
+            r->error = -1;
+            return -1;
+        }
+        // Empty chunks are never written; skip any the index lists.
+        if (r->remaining == 0)
+            close_chunk(r);
+    }
+
+    if (len > r->remaining)
+        len = r->remaining;
+    ssize_t got;
+    if (r->decompress != NULL)
+        got = decompress_reader_read(r->decompress, data, len);
+    else
+        got = stream_read_fd(&r->fd, data, len);
+    if (got <= 0) {
+        fprintf(stderr, "chunks: %s is truncated\n", r->hex);
+        r->error = -1;
+        return -1;
+    }
+    SHA_update(&r->ctx, data, got);
+    r->remaining -= got;
+    if (r->remaining == 0) {
+        close_chunk(r);
+        if (memcmp(SHA_final(&r->ctx), r->digest, SHA_DIGEST_SIZE) != 0) {
+            fprintf(stderr, "chunks: %s is corrupt\n", r->hex);
+            r->error = -1;
+            return -1;
+        }
+    }
+    return got;
+}
+
+void chunk_reader_close(ChunkReader* r) {
+    close_chunk(r);
+    free(r);
+}
@@ -0,0 +1,50 @@
+#ifndef NANDROID_CHUNKS_H
+#define NANDROID_CHUNKS_H
+
+#include "nandroid_stream.h"
+
+// Content-addressed chunk store for incremental nandroid backups.  A
+// backup stream is cut into chunks at content-defined boundaries, so an
+// insertion only changes the chunks around it, and each chunk is stored
+// once as <store>/<first two hex digits>/<sha1><compression extension>.
+// The backup directory only holds the chunk index, a text file with a
+// header line followed by one "<sha1> <length>" line per chunk.
+
+#define CHUNK_INDEX_EXTENSION   ".chunks"
+
+typedef struct {
+    unsigned long chunks;
+    unsigned long reused_chunks;
+    unsigned long long bytes;
+    unsigned long long reused_bytes;
+} ChunkStats;
+
+// Returns nonzero if path names a chunk index.
+int is_chunk_index(const char* path);
+
+typedef struct ChunkWriter ChunkWriter;
+
+// New chunks are stored with the given compression; the index is written
+// to index_sink.
+ChunkWriter* chunk_writer_open(const char* store, int compression,
+                               stream_write_fn index_sink, void* cookie);
+
+// A stream_write_fn; cookie is the ChunkWriter.
+int chunk_writer_write(void* cookie, const void* data, size_t len);
+
+// Stores the last chunk and frees the writer; stats may be NULL.
+// Returns nonzero if anything failed along the way.
+int chunk_writer_close(ChunkWriter* writer, ChunkStats* stats);
+
+typedef struct ChunkReader ChunkReader;
+
+// Reassembles the stream from the index read from index_source.  Every
+// chunk is checked against its sha1 as it is read.
+ChunkReader* chunk_reader_open(const char* store, stream_read_fn index_source, void* cookie);
+
+// A stream_read_fn; cookie is the ChunkReader.
+ssize_t chunk_reader_read(void* cookie, void* data, size_t len);
+
+void chunk_reader_close(ChunkReader* reader);
+
+#endif
@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "nandroid_jobs.h"
+
+#define JOB_PENDING   0
+#define JOB_RUNNING   1
+#define JOB_DONE      2
+#define JOB_SKIPPED   3
+
+#define MAX_JOB_THREADS 8
+
+typedef struct {
+    NandroidJob* jobs;
+    int count;
+    float total_weight;
+    int failed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} JobScheduler;
+
+static JobScheduler* current_scheduler = NULL;
+static pthread_key_t current_job_key;
+static pthread_once_t current_job_once = PTHREAD_ONCE_INIT;
+
+static void create_current_job_key() {
+    pthread_key_create(&current_job_key, NULL);
+}
+
+NandroidJob* nandroid_current_job() {
+    pthread_once(&current_job_once, create_current_job_key);
+    return (NandroidJob*) pthread_getspecific(current_job_key);
+}
+
+static int same_key(const char* a, const char* b) {
+    return a != NULL && b != NULL && strcmp(a, b) == 0;
+}
+
+// A job may start when nothing running shares its device or engine.
+static int job_can_start(JobScheduler* s, NandroidJob* job) {
+    int i;
+    for (i = 0; i < s->count; i++) {
+        NandroidJob* other = &s->jobs[i];
+        if (other->state != JOB_RUNNING)
+            continue;
+        if (same_key(job->device, other->device) || same_key(job->engine, other->engine))
+            return 0;
+    }
+    return 1;
+}
+
+static void update_overall_progress(JobScheduler* s) {
+    float done = 0;
+    int i;
+    for (i = 0; i < s->count; i++) {
+        NandroidJob* job = &s->jobs[i];
+        if (job->state == JOB_DONE) {
+            done += job->weight;
+        } else if (job->state == JOB_RUNNING && job->units_total != 0) {
+            unsigned long units = job->units_done;
+            if (units > job->units_total)
+                units = job->units_total;
+            done += job->weight * (float) units / (float) job->units_total;
+        }
+    }
+    if (s->total_weight > 0)
+        ui_set_progress(done / s->total_weight);
+}
+
+// Progress is read by update_overall_progress for every job, so it is
+// only changed with the scheduler's mutex held.
+void nandroid_job_set_total(NandroidJob* job, unsigned long units_total) {
+    JobScheduler* s = current_scheduler;
+    if (s != NULL)
+        pthread_mutex_lock(&s->mutex);
+    job->units_total = units_total;
+    job->units_done = 0;
+    if (s != NULL)
+        pthread_mutex_unlock(&s->mutex);
+}
+
+void nandroid_job_set_done(NandroidJob* job, unsigned long units_done) {
+    JobScheduler* s = current_scheduler;
+    if (s == NULL) {
+        job->units_done = units_done;
+        return;
+    }
+    pthread_mutex_lock(&s->mutex);
+    job->units_done = units_done;
+    update_overall_progress(s);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+static void* job_thread(void* cookie) {
+    JobScheduler* s = (JobScheduler*) cookie;
+    pthread_once(&current_job_once, create_current_job_key);
+
+    pthread_mutex_lock(&s->mutex);
+    for (;;) {
+        NandroidJob* next = NULL;
+        int pending = 0;
+        int i;
+        for (i = 0; i < s->count; i++) {
+            NandroidJob* job = &s->jobs[i];
+            if (job->state != JOB_PENDING)
+                continue;
+            if (s->failed) {
+                job->state = JOB_SKIPPED;
+                continue;
+            }
+            pending++;
+            if (job_can_start(s, job)) {
+                next = job;
+                break;
+            }
+        }
+        if (next == NULL) {
+            if (pending == 0)
+                break;
+            pthread_cond_wait(&s->cond, &s->mutex);
+            continue;
+        }
+
+        next->state = JOB_RUNNING;
+        pthread_mutex_unlock(&s->mutex);
+
+        if (next->name != NULL)
+            ui_print("正在备份 %s...\n", next->name);
+        pthread_setspecific(current_job_key, next);
+        int result = next->run(next->arg);
+        pthread_setspecific(current_job_key, NULL);
+
+        pthread_mutex_lock(&s->mutex);
+        next->result = result;
+        next->state = JOB_DONE;
+        if (result != 0)
+            s->failed = 1;
+        update_overall_progress(s);
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+int nandroid_run_jobs(NandroidJob* jobs, int count, int concurrency) {
+    JobScheduler s;
+    memset(&s, 0, sizeof(s));
+    s.jobs = jobs;
+    s.count = count;
+    pthread_mutex_init(&s.mutex, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        jobs[i].state = JOB_PENDING;
+        jobs[i].result = 0;
+        jobs[i].units_done = 0;
+        s.total_weight += jobs[i].weight;
+    }
+
+    if (concurrency < 1)
+        concurrency = 1;
+    if (concurrency > MAX_JOB_THREADS)
+        concurrency = MAX_JOB_THREADS;
+    if (concurrency > count)
+        concurrency = count;
+
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+    current_scheduler = &s;
+
+    pthread_t threads[MAX_JOB_THREADS];
+    int started = 0;
+    for (i = 0; i < concurrency; i++) {
+        if (pthread_create(&threads[started], NULL, job_thread, &s) == 0)
+            started++;
+    }
+    // If no thread could be created, run everything here.
+    if (started == 0)
+        job_thread(&s);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    current_scheduler = NULL;
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.mutex);
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state == JOB_DONE && jobs[i].result != 0)
+            return jobs[i].result;
+    }
+    return 0;
+}
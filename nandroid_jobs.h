@@ -0,0 +1,42 @@
+#ifndef NANDROID_JOBS_H
+#define NANDROID_JOBS_H
+
+// Small worker pool used by the scheduled nandroid backup mode.  Jobs
+// run concurrently except that two jobs with the same device (the block
+// device they read from) or the same engine (a backup engine that keeps
+// global state, like mkyaffs2image or the raw partition dumpers) never
+// run at the same time.  Progress of all jobs is folded into the single
+// recovery progress bar, weighted by each job's weight.
+
+typedef int (*nandroid_job_fn)(void* arg);
+
+typedef struct {
+    const char* name;           // shown in the log when the job starts
+    const char* device;         // serialization key, may be NULL
+    const char* engine;         // serialization key, may be NULL
+    float weight;               // share of the overall progress bar
+    nandroid_job_fn run;
+    void* arg;
+
+    // Filled in by the scheduler.
+    int state;
+    int result;
+    unsigned long units_total;
+    unsigned long units_done;
+} NandroidJob;
+
+// Runs all jobs on up to concurrency threads, in list order as far as
+// the serialization keys allow.  After a job fails no new jobs are
+// started.  Returns 0, or the result of the first job (in list order)
+// that failed.
+int nandroid_run_jobs(NandroidJob* jobs, int count, int concurrency);
+
+// Returns the job running on the calling thread, or NULL outside of
+// nandroid_run_jobs.
+NandroidJob* nandroid_current_job();
+
+// Reports progress of a running job in units of its own choosing.
+void nandroid_job_set_total(NandroidJob* job, unsigned long units_total);
+void nandroid_job_set_done(NandroidJob* job, unsigned long units_done);
+
+#endif
@@ -0,0 +1,241 @@
+#include <string.h>
+
+#include "nandroid_lz4.h"
+
+#define MINMATCH        4
+#define MFLIMIT         12
+#define LASTLITERALS    5
+#define MAX_DISTANCE    65535
+#define HASH_LOG        12
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32_le(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint32_t hash4(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static uint8_t* write_length(uint8_t* op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t* write_literals(uint8_t* op, uint8_t* token, const uint8_t* literals, int len) {
+    if (len >= 15) {
+        *token = 15 << 4;
+        op = write_length(op, len - 15);
+    } else {
+        *token = len << 4;
+    }
+    memcpy(op, literals, len);
+    return op + len;
+}
+
+// Greedy single-probe compressor: the same parsing strategy as the
+// reference LZ4 fast mode, without its unaligned-access tricks.
+int lz4_compress_block(const uint8_t* src, int src_len, uint8_t* dst) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* const iend = src + src_len;
+    const uint8_t* const mflimit = iend - MFLIMIT;
+    const uint8_t* const matchlimit = iend - LASTLITERALS;
+    uint8_t* op = dst;
+
+    if (src_len > MFLIMIT) {
+        uint32_t table[1 << HASH_LOG];
+        memset(table, 0, sizeof(table));
+
+        ip++;
+        while (ip < mflimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash4(sequence);
+            const uint8_t* ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != sequence) {
+                // Step faster through data that doesn't compress.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip + MINMATCH;
+            const uint8_t* rp = ref + MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            uint8_t* token = op++;
+            op = write_literals(op, token, anchor, ip - anchor);
+            int offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            int match_len = mp - ip - MINMATCH;
+            if (match_len >= 15) {
+                *token |= 15;
+                op = write_length(op, match_len - 15);
+            } else {
+                *token |= match_len;
+            }
+
+            ip = mp;
+            anchor = ip;
+            if (ip < mflimit)
+                table[hash4(read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+
+    uint8_t* token = op++;
+    op = write_literals(op, token, anchor, iend - anchor);
+    return op - dst;
+}
+
+int lz4_decompress_block(const uint8_t* src, int src_len, uint8_t* dst,
+                         int dst_cap, int dst_prefix) {
+    const uint8_t* ip = src;
+    const uint8_t* const iend = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + dst_cap;
+    const uint8_t* const lowest = dst - dst_prefix;
+
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        unsigned token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if ((size_t) (iend - ip) < literals || (size_t) (oend - op) < literals)
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        // The last sequence has literals only.
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - lowest))
+            return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MINMATCH;
+        if ((size_t) (oend - op) < match_len)
+            return -1;
+
+        const uint8_t* ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            // Overlapping copy repeats the last offset bytes.
+            size_t i;
+            for (i = 0; i < match_len; i++)
+                *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
+
+#define PRIME32_1   2654435761U
+#define PRIME32_2   2246822519U
+#define PRIME32_3   3266489917U
+#define PRIME32_4   668265263U
+#define PRIME32_5   374761393U
+
+static uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input) {
+    acc += input * PRIME32_2;
+    acc = rotl32(acc, 13);
+    return acc * PRIME32_1;
+}
+
+uint32_t lz4_xxh32(const void* data, size_t len, uint32_t seed) {
+    const uint8_t* p = (const uint8_t*) data;
+    const uint8_t* const end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t v1 = seed + PRIME32_1 + PRIME32_2;
+        uint32_t v2 = seed + PRIME32_2;
+        uint32_t v3 = seed;
+        uint32_t v4 = seed - PRIME32_1;
+        const uint8_t* const limit = end - 16;
+        do {
+            v1 = xxh32_round(v1, read32_le(p));
+            v2 = xxh32_round(v2, read32_le(p + 4));
+            v3 = xxh32_round(v3, read32_le(p + 8));
+            v4 = xxh32_round(v4, read32_le(p + 12));
+            p += 16;
+        } while (p <= limit);
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    } else {
+        h = seed + PRIME32_5;
+    }
+
+    h += (uint32_t) len;
+    while (p + 4 <= end) {
+        h += read32_le(p) * PRIME32_3;
+        h = rotl32(h, 17) * PRIME32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h += (*p++) * PRIME32_5;
+        h = rotl32(h, 11) * PRIME32_1;
+    }
+
+    h ^= h >> 15;
+    h *= PRIME32_2;
+    h ^= h >> 13;
+    h *= PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+void lz4_frame_header(uint8_t* header) {
+    header[0] = LZ4_FRAME_MAGIC & 0xff;
+    header[1] = (LZ4_FRAME_MAGIC >> 8) & 0xff;
+    header[2] = (LZ4_FRAME_MAGIC >> 16) & 0xff;
+    header[3] = (LZ4_FRAME_MAGIC >> 24) & 0xff;
+    // Version 01, independent blocks, no checksums, no content size.
+    header[4] = 0x60;
+    header[5] = LZ4_BLOCK_SIZE_ID << 4;
+    header[6] = (lz4_xxh32(header + 4, 2, 0) >> 8) & 0xff;
+}
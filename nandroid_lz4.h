@@ -0,0 +1,39 @@
+#ifndef NANDROID_LZ4_H
+#define NANDROID_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal LZ4 codec for nandroid images.  Blocks are written in the
+// standard LZ4 frame format with independent blocks, so backups can be
+// decompressed on a PC with the stock lz4 tool.
+
+#define LZ4_FRAME_MAGIC         0x184D2204
+#define LZ4_FRAME_HEADER_SIZE   7
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000U
+
+// Block size used for the frames we write (LZ4 block max size id 6).
+#define LZ4_BLOCK_SIZE          (1024 * 1024)
+#define LZ4_BLOCK_SIZE_ID       6
+
+// Worst case size of a compressed block of len bytes.
+#define LZ4_COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Compresses src into dst, which must hold LZ4_COMPRESS_BOUND(src_len)
+// bytes.  Returns the compressed size.
+int lz4_compress_block(const uint8_t* src, int src_len, uint8_t* dst);
+
+// Decompresses a block into dst.  dst_prefix bytes before dst are
+// already decoded output that matches may refer to (for frames with
+// linked blocks).  Returns the decompressed size or -1 if the block is
+// corrupt or doesn't fit in dst_cap.
+int lz4_decompress_block(const uint8_t* src, int src_len, uint8_t* dst,
+                         int dst_cap, int dst_prefix);
+
+// Writes the frame header for the frames we produce into header, which
+// must hold LZ4_FRAME_HEADER_SIZE bytes.
+void lz4_frame_header(uint8_t* header);
+
+uint32_t lz4_xxh32(const void* data, size_t len, uint32_t seed);
+
+#endif
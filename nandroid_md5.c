@@ -0,0 +1,345 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nandroid_md5.h"
+
+// MD5 as described in RFC 1321.
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md5_transform(MD5_CTX* ctx, const uint8_t* block) {
+    uint32_t w[16];
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = block[i * 4] | (block[i * 4 + 1] << 8) |
+               (block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+    }
+
+    uint32_t a = ctx->state[0];
+    uint32_t b = ctx->state[1];
+    uint32_t c = ctx->state[2];
+    uint32_t d = ctx->state[3];
+    for (i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        b = b + ROL(a + f + md5_k[i] + w[g], md5_r[i]);
+        a = tmp;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+void MD5_init(MD5_CTX* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void MD5_update(MD5_CTX* ctx, const void* data, int len) {
+    const uint8_t* p = (const uint8_t*) data;
+    int used = ctx->count & 63;
+    ctx->count += len;
+
+    if (used > 0) {
+        int fill = 64 - used;
+        if (len < fill) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, fill);
+        md5_transform(ctx, ctx->buf);
+        p += fill;
+        len -= fill;
+    }
+    while (len >= 64) {
+        md5_transform(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+    if (len > 0)
+        memcpy(ctx->buf, p, len);
+}
+
+const uint8_t* MD5_final(MD5_CTX* ctx) {
+    uint64_t bits = ctx->count * 8;
+    static const uint8_t pad[64] = { 0x80 };
+    int used = ctx->count & 63;
+    MD5_update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+
+    uint8_t length[8];
+    int i;
+    for (i = 0; i < 8; i++)
+        length[i] = (bits >> (i * 8)) & 0xff;
+    MD5_update(ctx, length, 8);
+
+    for (i = 0; i < 4; i++) {
+        ctx->digest[i * 4] = ctx->state[i] & 0xff;
+        ctx->digest[i * 4 + 1] = (ctx->state[i] >> 8) & 0xff;
+        ctx->digest[i * 4 + 2] = (ctx->state[i] >> 16) & 0xff;
+        ctx->digest[i * 4 + 3] = (ctx->state[i] >> 24) & 0xff;
+    }
+    return ctx->digest;
+}
+
+void md5_to_hex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < MD5_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[MD5_DIGEST_SIZE * 2] = '\0';
+}
+
+#define MD5_FILE_BUFFER_SIZE (256 * 1024)
+
+int md5_file(const char* path, uint8_t* digest) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    char* buffer = malloc(MD5_FILE_BUFFER_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    ssize_t len;
+    while ((len = stream_read_fd(&fd, buffer, MD5_FILE_BUFFER_SIZE)) > 0)
+        MD5_update(&ctx, buffer, len);
+    free(buffer);
+    close(fd);
+    if (len < 0)
+        return -1;
+    memcpy(digest, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    return 0;
+}
+
+void md5_writer_init(Md5Writer* writer, stream_write_fn next, void* cookie) {
+    MD5_init(&writer->ctx);
+    writer->next = next;
+    writer->cookie = cookie;
+}
+
+int md5_writer_write(void* cookie, const void* data, size_t len) {
+    Md5Writer* writer = (Md5Writer*) cookie;
+    MD5_update(&writer->ctx, data, len);
+    return writer->next(writer->cookie, data, len);
+}
+
+typedef struct {
+    char* name;
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+} Md5Entry;
+
+struct Md5Manifest {
+    pthread_mutex_t mutex;
+    Md5Entry* entries;
+    int count;
+    int capacity;
+};
+
+Md5Manifest* md5_manifest_create() {
+    Md5Manifest* manifest = calloc(1, sizeof(Md5Manifest));
+    if (manifest == NULL)
+        return NULL;
+    pthread_mutex_init(&manifest->mutex, NULL);
+    return manifest;
+}
+
+static int manifest_add_hex(Md5Manifest* manifest, const char* name, const char* hex) {
+    int ret = 0;
+    pthread_mutex_lock(&manifest->mutex);
+    if (manifest->count == manifest->capacity) {
+        int capacity = manifest->capacity ? manifest->capacity * 2 : 16;
+        Md5Entry* entries = realloc(manifest->entries, capacity * sizeof(Md5Entry));
+        if (entries == NULL) {
+            ret = -1;
+            goto done;
+        }
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+    }
+    Md5Entry* entry = &manifest->entries[manifest->count];
+    entry->name = strdup(name);
+    if (entry->name == NULL) {
+        ret = -1;
+        goto done;
+    }
+    snprintf(entry->hex, sizeof(entry->hex), "%s", hex);
+    manifest->count++;
+done:
+    pthread_mutex_unlock(&manifest->mutex);
+    return ret;
+}
+
+int md5_manifest_add(Md5Manifest* manifest, const char* name, const uint8_t* digest) {
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+    md5_to_hex(digest, hex);
+    return manifest_add_hex(manifest, name, hex);
+}
+
+// Reads md5sum output: "<hex>  <name>", or "<hex> *<name>" for files
+// digested in binary mode.
+Md5Manifest* md5_manifest_read(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    Md5Manifest* manifest = md5_manifest_create();
+    if (manifest == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len < MD5_DIGEST_SIZE * 2 + 2 || line[MD5_DIGEST_SIZE * 2] != ' ')
+            continue;
+        char* name = line + MD5_DIGEST_SIZE * 2 + 1;
+        if (*name == ' ' || *name == '*')
+            name++;
+        line[MD5_DIGEST_SIZE * 2] = '\0';
+        char* p;
+        for (p = line; *p != '\0'; p++)
+            *p = tolower(*p);
+        if (manifest_add_hex(manifest, name, line) != 0) {
+            md5_manifest_free(manifest);
+            manifest = NULL;
+            break;
+        }
+    }
+    fclose(f);
+    return manifest;
+}
+
+const char* md5_manifest_find(Md5Manifest* manifest, const char* name) {
+    const char* hex = NULL;
+    int i;
+    pthread_mutex_lock(&manifest->mutex);
+    for (i = 0; i < manifest->count; i++) {
+        if (strcmp(manifest->entries[i].name, name) == 0) {
+            hex = manifest->entries[i].hex;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&manifest->mutex);
+    return hex;
+}
+
+// Like md5sum -c: every file listed must exist in dir and match.  Files
+// that aren't listed are not checked.
+int md5_manifest_verify(Md5Manifest* manifest, const char* dir, const char** failed) {
+    char path[PATH_MAX];
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+    uint8_t digest[MD5_DIGEST_SIZE];
+    int ret = 0;
+    int i;
+    pthread_mutex_lock(&manifest->mutex);
+    for (i = 0; i < manifest->count; i++) {
+        Md5Entry* entry = &manifest->entries[i];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->name);
+        if (md5_file(path, digest) == 0) {
+            md5_to_hex(digest, hex);
+            if (strcmp(hex, entry->hex) == 0)
+                continue;
+        }
+        *failed = entry->name;
+        ret = -1;
+        break;
+    }
+    pthread_mutex_unlock(&manifest->mutex);
+    return ret;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const Md5Entry*) a)->name, ((const Md5Entry*) b)->name);
+}
+
+// Entries are sorted by name, as the shell glob used to list them, so
+// the file doesn't depend on the order scheduled jobs finished in.
+int md5_manifest_write(Md5Manifest* manifest, const char* path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+
+    pthread_mutex_lock(&manifest->mutex);
+    qsort(manifest->entries, manifest->count, sizeof(Md5Entry), compare_entries);
+    int i;
+    for (i = 0; i < manifest->count; i++)
+        fprintf(f, "%s  %s\n", manifest->entries[i].hex, manifest->entries[i].name);
+    pthread_mutex_unlock(&manifest->mutex);
+
+    int ret = 0;
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+        ret = -1;
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp, path) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(tmp);
+    return ret;
+}
+
+void md5_manifest_free(Md5Manifest* manifest) {
+    if (manifest == NULL)
+        return;
+    int i;
+    for (i = 0; i < manifest->count; i++)
+        free(manifest->entries[i].name);
+    free(manifest->entries);
+    pthread_mutex_destroy(&manifest->mutex);
+    free(manifest);
+}
@@ -0,0 +1,54 @@
+#ifndef NANDROID_MD5_H
+#define NANDROID_MD5_H
+
+#include <stdint.h>
+
+#include "nandroid_stream.h"
+
+#define MD5_DIGEST_SIZE 16
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t count;
+    uint8_t buf[64];
+    uint8_t digest[MD5_DIGEST_SIZE];
+} MD5_CTX;
+
+void MD5_init(MD5_CTX* ctx);
+void MD5_update(MD5_CTX* ctx, const void* data, int len);
+const uint8_t* MD5_final(MD5_CTX* ctx);
+
+// Lowercase hex, as printed by md5sum; hex must hold 33 bytes.
+void md5_to_hex(const uint8_t* digest, char* hex);
+
+// Digest of a whole file, for images written by code outside of our
+// streams.  Returns 0 on success.
+int md5_file(const char* path, uint8_t* digest);
+
+// A pass-through stage that digests everything written through it.
+typedef struct {
+    MD5_CTX ctx;
+    stream_write_fn next;
+    void* cookie;
+} Md5Writer;
+
+void md5_writer_init(Md5Writer* writer, stream_write_fn next, void* cookie);
+int md5_writer_write(void* cookie, const void* data, size_t len);
+
+// The list of files and digests stored as nandroid.md5, in md5sum
+// format.  Adding entries is thread safe.
+typedef struct Md5Manifest Md5Manifest;
+
+Md5Manifest* md5_manifest_create();
+Md5Manifest* md5_manifest_read(const char* path);
+// Returns 0 on success, or -1 if the entry could not be stored.
+int md5_manifest_add(Md5Manifest* manifest, const char* name, const uint8_t* digest);
+// Returns the hex digest recorded for name, or NULL.
+const char* md5_manifest_find(Md5Manifest* manifest, const char* name);
+// Checks every listed file in dir; on failure returns -1 and points
+// *failed at the name of the first file that is missing or differs.
+int md5_manifest_verify(Md5Manifest* manifest, const char* dir, const char** failed);
+int md5_manifest_write(Md5Manifest* manifest, const char* path);
+void md5_manifest_free(Md5Manifest* manifest);
+
+#endif
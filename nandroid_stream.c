@@ -0,0 +1,635 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "nandroid_lz4.h"
+#include "nandroid_stream.h"
+
+int stream_write_fd(void* cookie, const void* data, size_t len) {
+    int fd = *(int*) cookie;
+    const char* p = (const char*) data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+ssize_t stream_read_fd(void* cookie, void* data, size_t len) {
+    ssize_t r;
+    do {
+        r = read(*(int*) cookie, data, len);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+int compression_from_name(const char* name) {
+    if (name == NULL || strcmp(name, "none") == 0 || name[0] == '\0')
+        return COMPRESSION_NONE;
+    if (strcmp(name, "gzip") == 0 || strcmp(name, "gz") == 0)
+        return COMPRESSION_GZIP;
+    if (strcmp(name, "lz4") == 0)
+        return COMPRESSION_LZ4;
+    return -1;
+}
+
+const char* compression_extension(int method) {
+    switch (method) {
+        case COMPRESSION_GZIP:
+            return ".gz";
+        case COMPRESSION_LZ4:
+            return ".lz4";
+        default:
+            return "";
+    }
+}
+
+static int has_suffix(const char* s, const char* suffix) {
+    size_t len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+int compression_for_file(const char* path) {
+    if (has_suffix(path, ".gz"))
+        return COMPRESSION_GZIP;
+    if (has_suffix(path, ".lz4"))
+        return COMPRESSION_LZ4;
+    return COMPRESSION_NONE;
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// ---------------------------------------------------------------------
+// Compression
+// ---------------------------------------------------------------------
+
+#define COMPRESS_BLOCK_SIZE     LZ4_BLOCK_SIZE
+// Deflate adds a few bytes per stored 64K block plus the gzip header
+// and trailer; lz4 adds its own bound plus the block size word.
+#define COMPRESS_OUT_SIZE       (LZ4_COMPRESS_BOUND(COMPRESS_BLOCK_SIZE) + 4096)
+#define MAX_COMPRESS_THREADS    8
+
+#define SLOT_FREE       0
+#define SLOT_FILLED     1
+#define SLOT_BUSY       2
+#define SLOT_DONE       3
+
+typedef struct {
+    uint8_t* in;
+    size_t in_len;
+    uint8_t* out;
+    size_t out_len;
+    int state;
+    int error;
+} CompressSlot;
+
+struct CompressWriter {
+    int method;
+    stream_write_fn sink;
+    void* cookie;
+
+    CompressSlot* slots;
+    int slot_count;
+    unsigned long next_fill;    // sequence number of the slot being filled
+    unsigned long next_emit;    // sequence number of the next slot to write
+
+    pthread_t workers[MAX_COMPRESS_THREADS];
+    int worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+    int error;
+};
+
+static int compress_gzip_block(CompressSlot* slot) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // windowBits 15 + 16 writes a gzip wrapper; level 1 since the sdcard,
+    // not the ratio, is what we are optimizing for.
+    if (deflateInit2(&z, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    z.next_in = slot->in;
+    z.avail_in = slot->in_len;
+    z.next_out = slot->out;
+    z.avail_out = COMPRESS_OUT_SIZE;
+    int ret = deflate(&z, Z_FINISH);
+    slot->out_len = COMPRESS_OUT_SIZE - z.avail_out;
+    deflateEnd(&z);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+static int compress_lz4_block(CompressSlot* slot) {
+    int len = lz4_compress_block(slot->in, slot->in_len, slot->out + 4);
+    if ((size_t) len >= slot->in_len) {
+        // Incompressible; store the block as is.
+        put_le32(slot->out, slot->in_len | LZ4_BLOCK_UNCOMPRESSED);
+        memcpy(slot->out + 4, slot->in, slot->in_len);
+        slot->out_len = 4 + slot->in_len;
+    } else {
+        put_le32(slot->out, len);
+        slot->out_len = 4 + len;
+    }
+    return 0;
+}
+
+static void compress_slot(CompressWriter* w, CompressSlot* slot) {
+    if (w->method == COMPRESSION_GZIP)
+        slot->error = compress_gzip_block(slot);
+    else
+        slot->error = compress_lz4_block(slot);
+}
+
+static void* compress_thread(void* cookie) {
+    CompressWriter* w = (CompressWriter*) cookie;
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        CompressSlot* slot = NULL;
+        int i;
+        for (i = 0; i < w->slot_count; i++) {
+            if (w->slots[i].state == SLOT_FILLED) {
+                slot = &w->slots[i];
+                break;
+            }
+        }
+        if (slot == NULL) {
+            if (w->stop)
+                break;
+            pthread_cond_wait(&w->cond, &w->mutex);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&w->mutex);
+        compress_slot(w, slot);
+        pthread_mutex_lock(&w->mutex);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+// Writes out the next slot in sequence.  Called with the mutex held
+// when there are workers; the sink write itself runs unlocked.
+static void emit_slot(CompressWriter* w, CompressSlot* slot) {
+    if (w->worker_count > 0)
+        pthread_mutex_unlock(&w->mutex);
+    if (slot->error) {
+        fprintf(stderr, "compress: block compression failed\n");
+        w->error = -1;
+    } else if (!w->error && w->sink(w->cookie, slot->out, slot->out_len) != 0) {
+        w->error = -1;
+    }
+    if (w->worker_count > 0)
+        pthread_mutex_lock(&w->mutex);
+    slot->in_len = 0;
+    slot->state = SLOT_FREE;
+    w->next_emit++;
+}
+
+// Emits finished slots in order until the slot with sequence number
+// seq is free again.
+static void drain_until_free(CompressWriter* w, unsigned long seq) {
+    CompressSlot* target = &w->slots[seq % w->slot_count];
+    while (target->state != SLOT_FREE) {
+        CompressSlot* slot = &w->slots[w->next_emit % w->slot_count];
+        if (slot->state == SLOT_DONE)
+            emit_slot(w, slot);
+        else
+            pthread_cond_wait(&w->cond, &w->mutex);
+    }
+}
+
+static void submit_slot(CompressWriter* w) {
+    CompressSlot* slot = &w->slots[w->next_fill % w->slot_count];
+    if (w->worker_count == 0) {
+        compress_slot(w, slot);
+        emit_slot(w, slot);
+        w->next_fill++;
+        return;
+    }
+    pthread_mutex_lock(&w->mutex);
+    slot->state = SLOT_FILLED;
+    pthread_cond_broadcast(&w->cond);
+    w->next_fill++;
+    drain_until_free(w, w->next_fill);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+CompressWriter* compress_writer_open(int method, int threads,
+                                     stream_write_fn sink, void* cookie) {
+    if (method != COMPRESSION_GZIP && method != COMPRESSION_LZ4)
+        return NULL;
+    if (threads < 0)
+        threads = 0;
+    if (threads > MAX_COMPRESS_THREADS)
+        threads = MAX_COMPRESS_THREADS;
+
+    CompressWriter* w = calloc(1, sizeof(CompressWriter));
+    if (w == NULL)
+        return NULL;
+    w->method = method;
+    w->sink = sink;
+    w->cookie = cookie;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    // Two slots per thread keeps every worker busy while the caller
+    // fills the next block and writes out finished ones.
+    w->slot_count = threads > 0 ? threads * 2 : 1;
+    w->slots = calloc(w->slot_count, sizeof(CompressSlot));
+    if (w->slots == NULL) {
+        w->error = -1;
+        compress_writer_close(w);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < w->slot_count; i++) {
+        w->slots[i].in = malloc(COMPRESS_BLOCK_SIZE);
+        w->slots[i].out = malloc(COMPRESS_OUT_SIZE);
+        if (w->slots[i].in == NULL || w->slots[i].out == NULL) {
+            w->error = -1;
+            compress_writer_close(w);
+            return NULL;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&w->workers[w->worker_count], NULL, compress_thread, w) == 0)
+            w->worker_count++;
+    }
+
+    if (method == COMPRESSION_LZ4) {
+        uint8_t header[LZ4_FRAME_HEADER_SIZE];
+        lz4_frame_header(header);
+        if (sink(cookie, header, sizeof(header)) != 0)
+            w->error = -1;
+    }
+    return w;
+}
+
+int compress_writer_write(void* cookie, const void* data, size_t len) {
+    CompressWriter* w = (CompressWriter*) cookie;
+    const uint8_t* p = (const uint8_t*) data;
+    while (len > 0 && !w->error) {
+        CompressSlot* slot = &w->slots[w->next_fill % w->slot_count];
+        size_t chunk = COMPRESS_BLOCK_SIZE - slot->in_len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(slot->in + slot->in_len, p, chunk);
+        slot->in_len += chunk;
+        p += chunk;
+        len -= chunk;
+        if (slot->in_len == COMPRESS_BLOCK_SIZE)
+            submit_slot(w);
+    }
+    return w->error;
+}
+
+int compress_writer_close(CompressWriter* w) {
+    int i;
+    if (!w->error) {
+        CompressSlot* slot = &w->slots[w->next_fill % w->slot_count];
+        // gzip needs at least one member to be a valid file.
+        if (slot->in_len > 0 || (w->next_fill == 0 && w->method == COMPRESSION_GZIP))
+            submit_slot(w);
+    }
+
+    if (w->worker_count > 0) {
+        pthread_mutex_lock(&w->mutex);
+        if (w->next_emit < w->next_fill)
+            drain_until_free(w, w->next_fill - 1);
+        w->stop = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        for (i = 0; i < w->worker_count; i++)
+            pthread_join(w->workers[i], NULL);
+    }
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+
+    if (w->method == COMPRESSION_LZ4 && !w->error) {
+        uint8_t end_mark[4];
+        put_le32(end_mark, 0);
+        if (w->sink(w->cookie, end_mark, sizeof(end_mark)) != 0)
+            w->error = -1;
+    }
+
+    int ret = w->error;
+    if (w->slots != NULL) {
+        for (i = 0; i < w->slot_count; i++) {
+            free(w->slots[i].in);
+            free(w->slots[i].out);
+        }
+        free(w->slots);
+    }
+    free(w);
+    return ret;
+}
+
+// ---------------------------------------------------------------------
+// Decompression
+// ---------------------------------------------------------------------
+
+#define DECOMPRESS_INPUT_SIZE   (256 * 1024)
+#define LZ4_HISTORY_SIZE        (64 * 1024)
+#define LZ4_MAX_BLOCK_SIZE      (4 * 1024 * 1024)
+
+#define LZ4_FLG_BLOCK_INDEPENDENT   0x20
+#define LZ4_FLG_BLOCK_CHECKSUM      0x10
+#define LZ4_FLG_CONTENT_SIZE        0x08
+#define LZ4_FLG_CONTENT_CHECKSUM    0x04
+#define LZ4_FLG_DICT_ID             0x01
+
+struct DecompressReader {
+    int method;
+    stream_read_fn source;
+    void* cookie;
+
+    uint8_t* in;
+    size_t in_pos;
+    size_t in_len;
+    int in_eof;
+    int error;
+    int done;
+
+    // gzip
+    z_stream z;
+    int z_init;
+
+    // lz4: out holds LZ4_HISTORY_SIZE bytes of history followed by the
+    // current decoded block.
+    int flags;
+    size_t block_max;
+    uint8_t* block;
+    uint8_t* out;
+    size_t out_pos;
+    size_t out_len;
+    size_t history;
+    int in_frame;
+};
+
+static int dr_fill(DecompressReader* r) {
+    if (r->in_pos < r->in_len)
+        return 1;
+    if (r->in_eof)
+        return 0;
+    ssize_t n = r->source(r->cookie, r->in, DECOMPRESS_INPUT_SIZE);
+    if (n < 0) {
+        r->error = -1;
+        return -1;
+    }
+    if (n == 0) {
+        r->in_eof = 1;
+        return 0;
+    }
+    r->in_pos = 0;
+    r->in_len = n;
+    return 1;
+}
+
+// Reads exactly len bytes; returns 0 on success, 1 on a clean end of
+// stream before any byte, -1 on error or truncation.
+static int dr_read_exact(DecompressReader* r, uint8_t* dst, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        int f = dr_fill(r);
+        if (f < 0)
+            return -1;
+        if (f == 0)
+            return got == 0 ? 1 : -1;
+        size_t chunk = r->in_len - r->in_pos;
+        if (chunk > len - got)
+            chunk = len - got;
+        if (dst != NULL)
+            memcpy(dst + got, r->in + r->in_pos, chunk);
+        r->in_pos += chunk;
+        got += chunk;
+    }
+    return 0;
+}
+
+static ssize_t gzip_read(DecompressReader* r, uint8_t* data, size_t len) {
+    r->z.next_out = data;
+    r->z.avail_out = len;
+    while (r->z.avail_out > 0 && !r->done) {
+        if (r->z.avail_in == 0) {
+            int f = dr_fill(r);
+            if (f < 0)
+                return -1;
+            if (f == 0) {
+                fprintf(stderr, "decompress: truncated gzip stream\n");
+                return -1;
+            }
+            r->z.next_in = r->in + r->in_pos;
+            r->z.avail_in = r->in_len - r->in_pos;
+            r->in_pos = r->in_len;
+        }
+        int ret = inflate(&r->z, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // Another member may follow; anything else (like padding)
+            // ends the stream.
+            if (r->z.avail_in == 0) {
+                int f = dr_fill(r);
+                if (f < 0)
+                    return -1;
+                if (f > 0) {
+                    r->z.next_in = r->in + r->in_pos;
+                    r->z.avail_in = r->in_len - r->in_pos;
+                    r->in_pos = r->in_len;
+                }
+            }
+            if (r->z.avail_in == 0 || r->z.next_in[0] != 0x1f)
+                r->done = 1;
+            else
+                inflateReset(&r->z);
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "decompress: gzip error %d\n", ret);
+            return -1;
+        } else if (ret == Z_BUF_ERROR && r->z.avail_in != 0) {
+            return -1;
+        }
+    }
+    return len - r->z.avail_out;
+}
+
+static int lz4_read_frame_header(DecompressReader* r) {
+    uint8_t header[4 + 2 + 8 + 4 + 1];
+    int ret = dr_read_exact(r, header, 6);
+    if (ret != 0)
+        return ret;
+    if (get_le32(header) != LZ4_FRAME_MAGIC) {
+        fprintf(stderr, "decompress: not an lz4 frame\n");
+        return -1;
+    }
+    r->flags = header[4];
+    int block_id = (header[5] >> 4) & 7;
+    if ((r->flags >> 6) != 1 || block_id < 4) {
+        fprintf(stderr, "decompress: unsupported lz4 frame\n");
+        return -1;
+    }
+    size_t extra = 1;
+    if (r->flags & LZ4_FLG_CONTENT_SIZE)
+        extra += 8;
+    if (r->flags & LZ4_FLG_DICT_ID)
+        extra += 4;
+    if (dr_read_exact(r, header + 6, extra) != 0)
+        return -1;
+    if (((lz4_xxh32(header + 4, 2 + extra - 1, 0) >> 8) & 0xff) != header[5 + extra]) {
+        fprintf(stderr, "decompress: bad lz4 header checksum\n");
+        return -1;
+    }
+    r->block_max = 1 << (2 * block_id + 8);
+    r->history = 0;
+    r->in_frame = 1;
+    return 0;
+}
+
+// Decodes the next block into r->out; returns 0 when a block (possibly
+// empty) was decoded, 1 at end of stream, -1 on error.
+static int lz4_next_block(DecompressReader* r) {
+    if (!r->in_frame) {
+        int ret = lz4_read_frame_header(r);
+        if (ret != 0)
+            return ret;
+    }
+
+    // Keep the tail of the previous block for linked-block frames.
+    if (!(r->flags & LZ4_FLG_BLOCK_INDEPENDENT) && r->out_len > 0) {
+        size_t keep = r->history + r->out_len;
+        if (keep > LZ4_HISTORY_SIZE)
+            keep = LZ4_HISTORY_SIZE;
+        memmove(r->out + LZ4_HISTORY_SIZE - keep,
+                r->out + LZ4_HISTORY_SIZE + r->out_len - keep, keep);
+        r->history = keep;
+    }
+    r->out_pos = 0;
+    r->out_len = 0;
+
+    uint8_t word[4];
+    if (dr_read_exact(r, word, 4) != 0)
+        return -1;
+    uint32_t size = get_le32(word);
+    if (size == 0) {
+        if ((r->flags & LZ4_FLG_CONTENT_CHECKSUM) && dr_read_exact(r, NULL, 4) != 0)
+            return -1;
+        r->in_frame = 0;
+        // Concatenated frames are allowed.
+        int f = dr_fill(r);
+        if (f < 0)
+            return -1;
+        return f == 0 ? 1 : 0;
+    }
+
+    uint32_t data_len = size & ~LZ4_BLOCK_UNCOMPRESSED;
+    if (data_len > r->block_max)
+        return -1;
+    uint8_t* dst = r->out + LZ4_HISTORY_SIZE;
+    if (size & LZ4_BLOCK_UNCOMPRESSED) {
+        if (dr_read_exact(r, dst, data_len) != 0)
+            return -1;
+        r->out_len = data_len;
+    } else {
+        if (dr_read_exact(r, r->block, data_len) != 0)
+            return -1;
+        int len = lz4_decompress_block(r->block, data_len, dst, r->block_max, r->history);
+        if (len < 0) {
+            fprintf(stderr, "decompress: corrupt lz4 block\n");
+            return -1;
+        }
+        r->out_len = len;
+    }
+    if ((r->flags & LZ4_FLG_BLOCK_CHECKSUM) && dr_read_exact(r, NULL, 4) != 0)
+        return -1;
+    return 0;
+}
+
+static ssize_t lz4_read(DecompressReader* r, uint8_t* data, size_t len) {
+    while (r->out_pos == r->out_len) {
+        if (r->done)
+            return 0;
+        int ret = lz4_next_block(r);
+        if (ret < 0)
+            return -1;
+        if (ret > 0) {
+            r->done = 1;
+            return 0;
+        }
+    }
+    size_t chunk = r->out_len - r->out_pos;
+    if (chunk > len)
+        chunk = len;
+    memcpy(data, r->out + LZ4_HISTORY_SIZE + r->out_pos, chunk);
+    r->out_pos += chunk;
+    return chunk;
+}
+
+DecompressReader* decompress_reader_open(int method, stream_read_fn source, void* cookie) {
+    if (method != COMPRESSION_GZIP && method != COMPRESSION_LZ4)
+        return NULL;
+    DecompressReader* r = calloc(1, sizeof(DecompressReader));
+    if (r == NULL)
+        return NULL;
+    r->method = method;
+    r->source = source;
+    r->cookie = cookie;
+    r->in = malloc(DECOMPRESS_INPUT_SIZE);
+    if (r->in == NULL)
+        goto fail;
+    if (method == COMPRESSION_GZIP) {
+        if (inflateInit2(&r->z, 15 + 16) != Z_OK)
+            goto fail;
+        r->z_init = 1;
+    } else {
+        r->block = malloc(LZ4_MAX_BLOCK_SIZE);
+        r->out = malloc(LZ4_HISTORY_SIZE + LZ4_MAX_BLOCK_SIZE);
+        if (r->block == NULL || r->out == NULL)
+            goto fail;
+    }
+    return r;
+
+fail:
+    decompress_reader_close(r);
+    return NULL;
+}
+
+ssize_t decompress_reader_read(void* cookie, void* data, size_t len) {
+    DecompressReader* r = (DecompressReader*) cookie;
+    if (r->error)
+        return -1;
+    ssize_t ret;
+    if (r->method == COMPRESSION_GZIP)
+        ret = gzip_read(r, (uint8_t*) data, len);
+    else
+        ret = lz4_read(r, (uint8_t*) data, len);
+    if (ret < 0)
+        r->error = -1;
+    return ret;
+}
+
+void decompress_reader_close(DecompressReader* r) {
+    if (r->z_init)
+        inflateEnd(&r->z);
+    free(r->in);
+    free(r->block);
+    free(r->out);
+    free(r);
+}
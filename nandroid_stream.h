@@ -0,0 +1,61 @@
+#ifndef NANDROID_STREAM_H
+#define NANDROID_STREAM_H
+
+#include <sys/types.h>
+
+// Stages of the nandroid backup and restore pipelines hand data to each
+// other through these; they match the tar engine's tar_write_fn and
+// tar_read_fn.
+
+// Returns 0 on success, nonzero on failure.
+typedef int (*stream_write_fn)(void* cookie, const void* data, size_t len);
+
+// Returns the number of bytes read, 0 at end of stream, -1 on error.
+typedef ssize_t (*stream_read_fn)(void* cookie, void* data, size_t len);
+
+// Plain file descriptor ends of a pipeline; cookie points to the fd.
+int stream_write_fd(void* cookie, const void* data, size_t len);
+ssize_t stream_read_fd(void* cookie, void* data, size_t len);
+
+// Compression stage.  Data is cut into blocks which are compressed on a
+// pool of threads and emitted in order: gzip output is a series of gzip
+// members (which gunzip reads as one stream), lz4 output is a standard
+// LZ4 frame with independent blocks.
+
+#define COMPRESSION_NONE    0
+#define COMPRESSION_GZIP    1
+#define COMPRESSION_LZ4     2
+
+// "none", "gzip"/"gz" or "lz4"; returns -1 for anything else.
+int compression_from_name(const char* name);
+
+// File name suffix for the method, eg ".lz4"; "" for COMPRESSION_NONE.
+const char* compression_extension(int method);
+
+// Picks the method from the file name suffix.
+int compression_for_file(const char* path);
+
+typedef struct CompressWriter CompressWriter;
+
+// threads is the number of compression threads; 0 compresses on the
+// caller's thread.
+CompressWriter* compress_writer_open(int method, int threads,
+                                     stream_write_fn sink, void* cookie);
+
+// A stream_write_fn; cookie is the CompressWriter.
+int compress_writer_write(void* cookie, const void* data, size_t len);
+
+// Flushes all pending blocks, writes the stream trailer and frees the
+// writer.  Returns nonzero if anything failed along the way.
+int compress_writer_close(CompressWriter* writer);
+
+typedef struct DecompressReader DecompressReader;
+
+DecompressReader* decompress_reader_open(int method, stream_read_fn source, void* cookie);
+
+// A stream_read_fn; cookie is the DecompressReader.
+ssize_t decompress_reader_read(void* cookie, void* data, size_t len);
+
+void decompress_reader_close(DecompressReader* reader);
+
+#endif
@@ -0,0 +1,976 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "nandroid_tar.h"
+
+#define TAR_BLOCK_SIZE      512
+// Large enough to amortize the write() to the sdcard, and a multiple of
+// both the tar block size and the page size.
+#define TAR_BUFFER_SIZE     (256 * 1024)
+#define TAR_XATTR_LIST_SIZE 4096
+#define TAR_XATTR_VALUE_SIZE 4096
+
+#define LONGLINK_NAME       "././@LongLink"
+#define PAXHEADER_NAME      "././@PaxHeader"
+#define XATTR_PAX_PREFIX    "SCHILY.xattr."
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+static void* tar_alloc_buffer() {
+    return memalign(4096, TAR_BUFFER_SIZE);
+}
+
+// Numeric fields are octal, falling back to the GNU base-256 encoding
+// for values that do not fit (files over 8GB, large uids).
+static void tar_put_number(char* field, size_t len, unsigned long long value) {
+    unsigned long long limit = 1ULL << (3 * (len - 1));
+    if (value < limit) {
+        field[len - 1] = '\0';
+        size_t i;
+        for (i = len - 1; i > 0; i--) {
+            field[i - 1] = '0' + (value & 7);
+            value >>= 3;
+        }
+        return;
+    }
+    size_t i;
+    for (i = len; i > 1; i--) {
+        field[i - 1] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
+
+static unsigned long long tar_get_number(const char* field, size_t len) {
+    unsigned long long value = 0;
+    size_t i;
+    if ((unsigned char) field[0] & 0x80) {
+        value = (unsigned char) field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+    for (i = 0; i < len && field[i] == ' '; i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static unsigned int tar_checksum(const TarHeader* header) {
+    const unsigned char* p = (const unsigned char*) header;
+    unsigned int sum = 0;
+    size_t i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (i >= offsetof(TarHeader, chksum) && i < offsetof(TarHeader, chksum) + sizeof(header->chksum))
+            sum += ' ';
+        else
+            sum += p[i];
+    }
+    return sum;
+}
+
+// ---------------------------------------------------------------------
+// Writer
+// ---------------------------------------------------------------------
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+} HardLink;
+
+typedef struct {
+    tar_write_fn write;
+    void* cookie;
+    tar_progress_fn progress;
+    void* progress_cookie;
+    const char** excludes;
+
+    char* buffer;
+    size_t used;
+
+    HardLink* links;
+    int links_count;
+    int links_alloc;
+
+    TarStats stats;
+    int error;
+} TarWriter;
+
+static int tw_flush(TarWriter* w) {
+    if (w->used == 0 || w->error)
+        return w->error;
+    if (w->write(w->cookie, w->buffer, w->used) != 0) {
+        fprintf(stderr, "tar: error writing archive\n");
+        w->error = -1;
+    }
+    w->used = 0;
+    return w->error;
+}
+
+// Returns a zeroed, block-aligned region of len bytes in the buffer.
+static char* tw_reserve(TarWriter* w, size_t len) {
+    if (w->used + len > TAR_BUFFER_SIZE && tw_flush(w) != 0)
+        return NULL;
+    char* p = w->buffer + w->used;
+    memset(p, 0, len);
+    w->used += len;
+    return p;
+}
+
+static int tw_append(TarWriter* w, const char* data, size_t len) {
+    while (len > 0) {
+        size_t chunk = TAR_BUFFER_SIZE - w->used;
+        if (chunk == 0) {
+            if (tw_flush(w) != 0)
+                return -1;
+            continue;
+        }
+        if (chunk > len)
+            chunk = len;
+        memcpy(w->buffer + w->used, data, chunk);
+        w->used += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int tw_pad(TarWriter* w) {
+    size_t rem = w->used % TAR_BLOCK_SIZE;
+    if (rem != 0) {
+        // used is always block aligned at the buffer end, so the padding
+        // always fits.
+        memset(w->buffer + w->used, 0, TAR_BLOCK_SIZE - rem);
+        w->used += TAR_BLOCK_SIZE - rem;
+    }
+    return 0;
+}
+
+// Copies a possibly unterminated string field, as tar allows.
+static void tar_put_string(char* field, size_t len, const char* value) {
+    size_t n = strlen(value);
+    memcpy(field, value, n < len ? n : len);
+}
+
+static void tw_fill_header(TarHeader* h, const char* name, const struct stat* st,
+                           char typeflag, const char* linkname, unsigned long long size) {
+    tar_put_string(h->name, sizeof(h->name), name);
+    tar_put_number(h->mode, sizeof(h->mode), st->st_mode & 07777);
+    tar_put_number(h->uid, sizeof(h->uid), st->st_uid);
+    tar_put_number(h->gid, sizeof(h->gid), st->st_gid);
+    tar_put_number(h->size, sizeof(h->size), size);
+    tar_put_number(h->mtime, sizeof(h->mtime), st->st_mtime);
+    h->typeflag = typeflag;
+    if (linkname != NULL)
+        tar_put_string(h->linkname, sizeof(h->linkname), linkname);
+    // GNU magic, since we emit GNU long name entries.
+    memcpy(h->magic, "ustar ", 6);
+    memcpy(h->version, " ", 2);
+    if (typeflag == '3' || typeflag == '4') {
+        tar_put_number(h->devmajor, sizeof(h->devmajor), major(st->st_rdev));
+        tar_put_number(h->devminor, sizeof(h->devminor), minor(st->st_rdev));
+    }
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", tar_checksum(h));
+    h->chksum[7] = ' ';
+}
+
+// Writes a pseudo entry (long name or pax header) carrying data.
+static int tw_write_special(TarWriter* w, const char* name, char typeflag,
+                            const char* data, size_t len) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    TarHeader* h = (TarHeader*) tw_reserve(w, TAR_BLOCK_SIZE);
+    if (h == NULL)
+        return -1;
+    tw_fill_header(h, name, &st, typeflag, NULL, len);
+    if (tw_append(w, data, len) != 0)
+        return -1;
+    return tw_pad(w);
+}
+
+static int tw_write_header(TarWriter* w, const char* name, const struct stat* st,
+                           char typeflag, const char* linkname, unsigned long long size) {
+    if (strlen(name) > sizeof(((TarHeader*) 0)->name) &&
+            tw_write_special(w, LONGLINK_NAME, 'L', name, strlen(name) + 1) != 0)
+        return -1;
+    if (linkname != NULL && strlen(linkname) > sizeof(((TarHeader*) 0)->linkname) &&
+            tw_write_special(w, LONGLINK_NAME, 'K', linkname, strlen(linkname) + 1) != 0)
+        return -1;
+    TarHeader* h = (TarHeader*) tw_reserve(w, TAR_BLOCK_SIZE);
+    if (h == NULL)
+        return -1;
+    tw_fill_header(h, name, st, typeflag, linkname, size);
+    return 0;
+}
+
+// Appends a "<len> <key>=<value>\n" pax record, where len counts itself.
+static char* pax_append(char* records, size_t* records_len, const char* key,
+                        const char* value, size_t value_len) {
+    size_t payload = 1 + strlen(key) + 1 + value_len + 1;
+    size_t len = payload + 1;
+    char digits[24];
+    while (len != payload + snprintf(digits, sizeof(digits), "%zu", len))
+        len = payload + strlen(digits);
+    char* grown = realloc(records, *records_len + len);
+    if (grown == NULL) {
+        free(records);
+        return NULL;
+    }
+    char* p = grown + *records_len;
+    p += sprintf(p, "%zu %s=", len, key);
+    memcpy(p, value, value_len);
+    p[value_len] = '\n';
+    *records_len += len;
+    return grown;
+}
+
+static int tw_write_xattrs(TarWriter* w, const char* path) {
+    char list[TAR_XATTR_LIST_SIZE];
+    ssize_t list_len = llistxattr(path, list, sizeof(list));
+    if (list_len <= 0)
+        return 0;
+
+    char* records = NULL;
+    size_t records_len = 0;
+    char key[TAR_XATTR_LIST_SIZE + sizeof(XATTR_PAX_PREFIX)];
+    char value[TAR_XATTR_VALUE_SIZE];
+    const char* attr;
+    for (attr = list; attr < list + list_len; attr += strlen(attr) + 1) {
+        ssize_t value_len = lgetxattr(path, attr, value, sizeof(value));
+        if (value_len < 0) {
+            fprintf(stderr, "tar: can't read xattr %s of %s (%s)\n", attr, path, strerror(errno));
+            continue;
+        }
+        snprintf(key, sizeof(key), XATTR_PAX_PREFIX "%s", attr);
+        records = pax_append(records, &records_len, key, value, value_len);
+        if (records == NULL)
+            return -1;
+    }
+    if (records == NULL)
+        return 0;
+    int ret = tw_write_special(w, PAXHEADER_NAME, 'x', records, records_len);
+    free(records);
+    return ret;
+}
+
+// Returns the archive name of an earlier entry with the same inode, or
+// remembers this one and returns NULL.
+static const char* tw_find_hardlink(TarWriter* w, const struct stat* st, const char* name) {
+    int i;
+    for (i = 0; i < w->links_count; i++) {
+        if (w->links[i].dev == st->st_dev && w->links[i].ino == st->st_ino)
+            return w->links[i].name;
+    }
+    if (w->links_count == w->links_alloc) {
+        int alloc = w->links_alloc ? w->links_alloc * 2 : 32;
+        HardLink* links = realloc(w->links, alloc * sizeof(HardLink));
+        if (links == NULL)
+            return NULL;
+        w->links = links;
+        w->links_alloc = alloc;
+    }
+    w->links[w->links_count].dev = st->st_dev;
+    w->links[w->links_count].ino = st->st_ino;
+    w->links[w->links_count].name = strdup(name);
+    w->links_count++;
+    return NULL;
+}
+
+// Streams the file straight from read() into the archive buffer.  If the
+// file changes size underneath us the entry is truncated or zero padded
+// to the size recorded in the header, like GNU tar does; a file removed
+// since it was stat'ed is all padding.
+static int tw_write_file_data(TarWriter* w, const char* path, unsigned long long size) {
+    int eof = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT) {
+        fprintf(stderr, "tar: %s: file removed before we read it\n", path);
+        eof = 1;
+    } else if (fd < 0) {
+        fprintf(stderr, "tar: can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    unsigned long long remaining = size;
+    while (remaining > 0) {
+        if (w->used == TAR_BUFFER_SIZE && tw_flush(w) != 0)
+            break;
+        size_t chunk = TAR_BUFFER_SIZE - w->used;
+        if (chunk > remaining)
+            chunk = remaining;
+        ssize_t r = 0;
+        if (!eof) {
+            r = read(fd, w->buffer + w->used, chunk);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                fprintf(stderr, "tar: error reading %s (%s)\n", path, strerror(errno));
+                close(fd);
+                return -1;
+            }
+        }
+        if (r == 0) {
+            eof = 1;
+            memset(w->buffer + w->used, 0, chunk);
+            r = chunk;
+        }
+        w->used += r;
+        remaining -= r;
+        w->stats.bytes += r;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (w->error)
+        return -1;
+    return tw_pad(w);
+}
+
+static int tw_is_excluded(TarWriter* w, const char* name) {
+    const char** e;
+    if (w->excludes == NULL)
+        return 0;
+    for (e = w->excludes; *e != NULL; e++) {
+        if (strcmp(*e, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// path is the filesystem path and name the archive name; both are
+// PATH_MAX buffers that get extended in place while recursing.  Entries
+// removed while the tree is walked (normal on a live /data) are skipped
+// with a warning; any other error fails the archive.
+static int tw_add(TarWriter* w, char* path, char* name) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "tar: %s: file removed before we read it\n", path);
+            return 0;
+        }
+        fprintf(stderr, "tar: can't stat %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (tw_is_excluded(w, name))
+        return 0;
+    if (S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "tar: %s: socket ignored\n", path);
+        return 0;
+    }
+
+    // Read before the xattrs go out, so a link removed in the meantime
+    // doesn't leave them to be applied to the next entry.
+    char target[PATH_MAX];
+    if (S_ISLNK(st.st_mode)) {
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0 && errno == ENOENT) {
+            fprintf(stderr, "tar: %s: file removed before we read it\n", path);
+            return 0;
+        }
+        if (len < 0) {
+            fprintf(stderr, "tar: can't read link %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        target[len] = '\0';
+    }
+
+    if (tw_write_xattrs(w, path) != 0)
+        return -1;
+
+    int ret = 0;
+    if (S_ISDIR(st.st_mode)) {
+        size_t name_len = strlen(name);
+        size_t path_len = strlen(path);
+        if (name_len + 1 >= PATH_MAX || path_len + 1 >= PATH_MAX)
+            return -1;
+        strcpy(name + name_len, "/");
+        ret = tw_write_header(w, name, &st, '5', NULL, 0);
+        name[name_len] = '\0';
+        w->stats.files++;
+        if (w->progress != NULL)
+            w->progress(w->progress_cookie, name, &w->stats);
+        if (ret != 0)
+            return ret;
+
+        DIR* d = opendir(path);
+        if (d == NULL && errno == ENOENT) {
+            fprintf(stderr, "tar: %s: directory removed before we read it\n", path);
+            return 0;
+        }
+        if (d == NULL) {
+            fprintf(stderr, "tar: can't open directory %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        struct dirent* de;
+        while (ret == 0 && (de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            size_t len = strlen(de->d_name);
+            if (name_len + 1 + len >= PATH_MAX || path_len + 1 + len >= PATH_MAX) {
+                fprintf(stderr, "tar: %s/%s: name too long\n", path, de->d_name);
+                ret = -1;
+                break;
+            }
+            name[name_len] = '/';
+            strcpy(name + name_len + 1, de->d_name);
+            path[path_len] = '/';
+            strcpy(path + path_len + 1, de->d_name);
+            ret = tw_add(w, path, name);
+            name[name_len] = '\0';
+            path[path_len] = '\0';
+        }
+        closedir(d);
+        return ret;
+    }
+
+    const char* link_target = NULL;
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+        link_target = tw_find_hardlink(w, &st, name);
+
+    if (link_target != NULL) {
+        ret = tw_write_header(w, name, &st, '1', link_target, 0);
+    } else if (S_ISREG(st.st_mode)) {
+        ret = tw_write_header(w, name, &st, '0', NULL, st.st_size);
+        if (ret == 0)
+            ret = tw_write_file_data(w, path, st.st_size);
+    } else if (S_ISLNK(st.st_mode)) {
+        ret = tw_write_header(w, name, &st, '2', target, 0);
+    } else if (S_ISCHR(st.st_mode)) {
+        ret = tw_write_header(w, name, &st, '3', NULL, 0);
+    } else if (S_ISBLK(st.st_mode)) {
+        ret = tw_write_header(w, name, &st, '4', NULL, 0);
+    } else if (S_ISFIFO(st.st_mode)) {
+        ret = tw_write_header(w, name, &st, '6', NULL, 0);
+    }
+
+    w->stats.files++;
+    if (w->progress != NULL)
+        w->progress(w->progress_cookie, name, &w->stats);
+    return ret;
+}
+
+int tar_create(const char* base_dir, const char* name, const char** excludes,
+               tar_write_fn write, void* cookie,
+               tar_progress_fn progress, void* progress_cookie) {
+    TarWriter w;
+    memset(&w, 0, sizeof(w));
+    w.write = write;
+    w.cookie = cookie;
+    w.progress = progress;
+    w.progress_cookie = progress_cookie;
+    w.excludes = excludes;
+    w.buffer = tar_alloc_buffer();
+    if (w.buffer == NULL)
+        return -1;
+
+    char path[PATH_MAX];
+    char archive_name[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", base_dir, name);
+    snprintf(archive_name, sizeof(archive_name), "%s", name);
+
+    int ret = tw_add(&w, path, archive_name);
+    if (ret == 0) {
+        // End of archive: two zero blocks.
+        if (tw_reserve(&w, 2 * TAR_BLOCK_SIZE) == NULL)
+            ret = -1;
+    }
+    if (tw_flush(&w) != 0)
+        ret = -1;
+
+    int i;
+    for (i = 0; i < w.links_count; i++)
+        free(w.links[i].name);
+    free(w.links);
+    free(w.buffer);
+    return ret;
+}
+
+// ---------------------------------------------------------------------
+// Reader
+// ---------------------------------------------------------------------
+
+typedef struct {
+    char* name;
+    char* value;
+    size_t value_len;
+} XattrRecord;
+
+typedef struct {
+    char* path;
+    struct timeval times[2];
+} DeferredDir;
+
+typedef struct {
+    tar_read_fn read;
+    void* cookie;
+    tar_progress_fn progress;
+    void* progress_cookie;
+
+    char* buffer;
+    size_t pos;
+    size_t len;
+    int eof;
+
+    // State carried from pseudo entries to the next real entry.
+    char* long_name;
+    char* long_link;
+    XattrRecord* xattrs;
+    int xattrs_count;
+
+    // Directory timestamps are applied last, since extracting their
+    // contents would bump them.
+    DeferredDir* dirs;
+    int dirs_count;
+    int dirs_alloc;
+
+    TarStats stats;
+} TarReader;
+
+// Makes at least one byte available, returning the count available or
+// 0 at end of stream, -1 on error.
+static ssize_t tr_available(TarReader* r) {
+    if (r->pos < r->len)
+        return r->len - r->pos;
+    if (r->eof)
+        return 0;
+    r->pos = 0;
+    r->len = 0;
+    while (r->len < TAR_BUFFER_SIZE) {
+        ssize_t n = r->read(r->cookie, r->buffer + r->len, TAR_BUFFER_SIZE - r->len);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            r->eof = 1;
+            break;
+        }
+        r->len += n;
+    }
+    return r->len;
+}
+
+// Copies len bytes out of the stream into dst (or discards them if dst
+// is NULL, or writes them to fd if fd >= 0).
+static int tr_consume(TarReader* r, char* dst, int fd, unsigned long long len) {
+    while (len > 0) {
+        ssize_t avail = tr_available(r);
+        if (avail <= 0) {
+            fprintf(stderr, "tar: unexpected end of archive\n");
+            return -1;
+        }
+        size_t chunk = (unsigned long long) avail < len ? (size_t) avail : (size_t) len;
+        if (fd >= 0) {
+            const char* p = r->buffer + r->pos;
+            size_t left = chunk;
+            while (left > 0) {
+                ssize_t w = write(fd, p, left);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0) {
+                    fprintf(stderr, "tar: write error (%s)\n", strerror(errno));
+                    return -1;
+                }
+                p += w;
+                left -= w;
+            }
+        } else if (dst != NULL) {
+            memcpy(dst, r->buffer + r->pos, chunk);
+            dst += chunk;
+        }
+        r->pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static unsigned long long tar_padded(unsigned long long size) {
+    return (size + TAR_BLOCK_SIZE - 1) & ~(unsigned long long) (TAR_BLOCK_SIZE - 1);
+}
+
+// Reads the payload of a pseudo entry into a NUL terminated buffer.
+static char* tr_read_payload(TarReader* r, unsigned long long size) {
+    if (size > 16 * 1024 * 1024) {
+        fprintf(stderr, "tar: oversized extended header\n");
+        return NULL;
+    }
+    char* data = malloc(size + 1);
+    if (data == NULL)
+        return NULL;
+    if (tr_consume(r, data, -1, size) != 0 ||
+            tr_consume(r, NULL, -1, tar_padded(size) - size) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+static void tr_clear_pending(TarReader* r) {
+    free(r->long_name);
+    free(r->long_link);
+    r->long_name = NULL;
+    r->long_link = NULL;
+    int i;
+    for (i = 0; i < r->xattrs_count; i++) {
+        free(r->xattrs[i].name);
+        free(r->xattrs[i].value);
+    }
+    free(r->xattrs);
+    r->xattrs = NULL;
+    r->xattrs_count = 0;
+}
+
+static int tr_parse_pax(TarReader* r, char* data, size_t size) {
+    char* p = data;
+    char* end = data + size;
+    while (p < end) {
+        char* space;
+        unsigned long len = strtoul(p, &space, 10);
+        if (space == p || *space != ' ' || len == 0 || p + len > end)
+            return -1;
+        char* key = space + 1;
+        char* record_end = p + len - 1;     // the trailing '\n'
+        char* eq = memchr(key, '=', record_end - key);
+        if (eq == NULL)
+            return -1;
+        *eq = '\0';
+        char* value = eq + 1;
+        size_t value_len = record_end - value;
+
+        if (strcmp(key, "path") == 0) {
+            free(r->long_name);
+            r->long_name = strndup(value, value_len);
+        } else if (strcmp(key, "linkpath") == 0) {
+            free(r->long_link);
+            r->long_link = strndup(value, value_len);
+        } else if (strncmp(key, XATTR_PAX_PREFIX, strlen(XATTR_PAX_PREFIX)) == 0) {
+            XattrRecord* xattrs = realloc(r->xattrs, (r->xattrs_count + 1) * sizeof(XattrRecord));
+            if (xattrs == NULL)
+                return -1;
+            r->xattrs = xattrs;
+            XattrRecord* x = &r->xattrs[r->xattrs_count++];
+            x->name = strdup(key + strlen(XATTR_PAX_PREFIX));
+            x->value = malloc(value_len ? value_len : 1);
+            if (x->value != NULL)
+                memcpy(x->value, value, value_len);
+            x->value_len = value_len;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+// Rejects absolute names (by stripping the leading '/', like tar does)
+// and any name that would escape dest_dir.
+static const char* tr_sanitize(const char* name) {
+    while (*name == '/')
+        name++;
+    const char* p = name;
+    while (*p) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return NULL;
+        p = strchr(p, '/');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return name;
+}
+
+static void tr_make_parents(char* path) {
+    char* slash = strrchr(path, '/');
+    if (slash == NULL || slash == path)
+        return;
+    *slash = '\0';
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        tr_make_parents(path);
+        mkdir(path, 0755);
+    }
+    *slash = '/';
+}
+
+static void tr_set_xattrs(TarReader* r, const char* path) {
+    int i;
+    for (i = 0; i < r->xattrs_count; i++) {
+        XattrRecord* x = &r->xattrs[i];
+        if (x->name == NULL || x->value == NULL)
+            continue;
+        if (lsetxattr(path, x->name, x->value, x->value_len, 0) != 0)
+            fprintf(stderr, "tar: can't set xattr %s on %s (%s)\n", x->name, path, strerror(errno));
+    }
+}
+
+static void tr_defer_dir(TarReader* r, const char* path, time_t mtime) {
+    if (r->dirs_count == r->dirs_alloc) {
+        int alloc = r->dirs_alloc ? r->dirs_alloc * 2 : 64;
+        DeferredDir* dirs = realloc(r->dirs, alloc * sizeof(DeferredDir));
+        if (dirs == NULL)
+            return;
+        r->dirs = dirs;
+        r->dirs_alloc = alloc;
+    }
+    DeferredDir* d = &r->dirs[r->dirs_count++];
+    d->path = strdup(path);
+    d->times[0].tv_sec = mtime;
+    d->times[0].tv_usec = 0;
+    d->times[1] = d->times[0];
+}
+
+static int tr_extract_entry(TarReader* r, const char* dest_dir, const TarHeader* h) {
+    char name_buf[sizeof(h->prefix) + 1 + sizeof(h->name) + 1];
+    const char* raw_name;
+    if (r->long_name != NULL) {
+        raw_name = r->long_name;
+    } else if (memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0] != '\0') {
+        // POSIX ustar splits long names into prefix/name.
+        snprintf(name_buf, sizeof(name_buf), "%.*s/%.*s",
+                 (int) sizeof(h->prefix), h->prefix, (int) sizeof(h->name), h->name);
+        raw_name = name_buf;
+    } else {
+        snprintf(name_buf, sizeof(name_buf), "%.*s", (int) sizeof(h->name), h->name);
+        raw_name = name_buf;
+    }
+    char link_buf[sizeof(h->linkname) + 1];
+    const char* linkname = r->long_link;
+    if (linkname == NULL) {
+        snprintf(link_buf, sizeof(link_buf), "%.*s", (int) sizeof(h->linkname), h->linkname);
+        linkname = link_buf;
+    }
+
+    mode_t mode = tar_get_number(h->mode, sizeof(h->mode)) & 07777;
+    uid_t uid = tar_get_number(h->uid, sizeof(h->uid));
+    gid_t gid = tar_get_number(h->gid, sizeof(h->gid));
+    time_t mtime = tar_get_number(h->mtime, sizeof(h->mtime));
+    unsigned long long size = tar_get_number(h->size, sizeof(h->size));
+    char type = h->typeflag;
+    if (type == '1' || type == '2' || type == '3' || type == '4' || type == '5' || type == '6')
+        size = 0;
+
+    const char* name = tr_sanitize(raw_name);
+    char path[PATH_MAX];
+    if (name == NULL || snprintf(path, sizeof(path), "%s/%s", dest_dir, name) >= (int) sizeof(path)) {
+        fprintf(stderr, "tar: skipping unsafe entry %s\n", raw_name);
+        return tr_consume(r, NULL, -1, tar_padded(size));
+    }
+    size_t path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/')
+        path[--path_len] = '\0';
+    tr_make_parents(path);
+
+    struct stat st;
+    if (type != '5' && lstat(path, &st) == 0) {
+        if (S_ISDIR(st.st_mode))
+            rmdir(path);
+        else
+            unlink(path);
+    }
+
+    int ret = 0;
+    switch (type) {
+        case '0':
+        case '\0':
+        case '7': {
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+                fprintf(stderr, "tar: can't create %s (%s)\n", path, strerror(errno));
+                tr_consume(r, NULL, -1, tar_padded(size));
+                return -1;
+            }
+            ret = tr_consume(r, NULL, fd, size);
+            // chown before chmod, since chown clears the setuid bits.
+            fchown(fd, uid, gid);
+            fchmod(fd, mode);
+            if (close(fd) != 0)
+                ret = -1;
+            r->stats.bytes += size;
+            if (ret == 0)
+                ret = tr_consume(r, NULL, -1, tar_padded(size) - size);
+            break;
+        }
+        case '1': {
+            const char* target = tr_sanitize(linkname);
+            char target_path[PATH_MAX];
+            if (target == NULL)
+                return -1;
+            snprintf(target_path, sizeof(target_path), "%s/%s", dest_dir, target);
+            if (link(target_path, path) != 0) {
+                fprintf(stderr, "tar: can't link %s to %s (%s)\n", path, target_path, strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+        case '2':
+            if (symlink(linkname, path) != 0) {
+                fprintf(stderr, "tar: can't symlink %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            lchown(path, uid, gid);
+            tr_set_xattrs(r, path);
+            return 0;
+        case '3':
+        case '4':
+        case '6': {
+            mode_t fmt = type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : S_IFIFO;
+            dev_t dev = makedev(tar_get_number(h->devmajor, sizeof(h->devmajor)),
+                                tar_get_number(h->devminor, sizeof(h->devminor)));
+            if (mknod(path, fmt | mode, type == '6' ? 0 : dev) != 0) {
+                fprintf(stderr, "tar: can't mknod %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            chown(path, uid, gid);
+            chmod(path, mode);
+            break;
+        }
+        case '5':
+            if (mkdir(path, mode) != 0 && errno != EEXIST) {
+                fprintf(stderr, "tar: can't mkdir %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            chown(path, uid, gid);
+            chmod(path, mode);
+            tr_set_xattrs(r, path);
+            tr_defer_dir(r, path, mtime);
+            return 0;
+        default:
+            fprintf(stderr, "tar: %s: unknown file type '%c', skipped\n", name, type);
+            return tr_consume(r, NULL, -1, tar_padded(size));
+    }
+
+    tr_set_xattrs(r, path);
+    struct timeval times[2];
+    times[0].tv_sec = mtime;
+    times[0].tv_usec = 0;
+    times[1] = times[0];
+    utimes(path, times);
+    return ret;
+}
+
+int tar_extract(const char* dest_dir, tar_read_fn read, void* cookie,
+                tar_progress_fn progress, void* progress_cookie) {
+    TarReader r;
+    memset(&r, 0, sizeof(r));
+    r.read = read;
+    r.cookie = cookie;
+    r.progress = progress;
+    r.progress_cookie = progress_cookie;
+    r.buffer = tar_alloc_buffer();
+    if (r.buffer == NULL)
+        return -1;
+
+    int ret = 0;
+    int zero_blocks = 0;
+    while (ret == 0) {
+        TarHeader h;
+        ssize_t avail = tr_available(&r);
+        if (avail == 0)
+            break;
+        if (avail < 0 || tr_consume(&r, (char*) &h, -1, TAR_BLOCK_SIZE) != 0) {
+            ret = -1;
+            break;
+        }
+
+        if (h.name[0] == '\0') {
+            // Two zero blocks end the archive.
+            if (++zero_blocks == 2)
+                break;
+            continue;
+        }
+        zero_blocks = 0;
+
+        unsigned int expected = tar_get_number(h.chksum, sizeof(h.chksum));
+        if (expected != tar_checksum(&h)) {
+            fprintf(stderr, "tar: bad header checksum\n");
+            ret = -1;
+            break;
+        }
+
+        unsigned long long size = tar_get_number(h.size, sizeof(h.size));
+        char* data;
+        switch (h.typeflag) {
+            case 'L':
+                if ((data = tr_read_payload(&r, size)) == NULL) {
+                    ret = -1;
+                    break;
+                }
+                free(r.long_name);
+                r.long_name = data;
+                break;
+            case 'K':
+                if ((data = tr_read_payload(&r, size)) == NULL) {
+                    ret = -1;
+                    break;
+                }
+                free(r.long_link);
+                r.long_link = data;
+                break;
+            case 'x':
+                if ((data = tr_read_payload(&r, size)) == NULL || tr_parse_pax(&r, data, size) != 0) {
+                    fprintf(stderr, "tar: bad pax header\n");
+                    ret = -1;
+                }
+                free(data);
+                break;
+            case 'g':
+                ret = tr_consume(&r, NULL, -1, tar_padded(size));
+                break;
+            default: {
+                ret = tr_extract_entry(&r, dest_dir, &h);
+                r.stats.files++;
+                if (progress != NULL) {
+                    char name[sizeof(h.name) + 1];
+                    snprintf(name, sizeof(name), "%.*s", (int) sizeof(h.name), h.name);
+                    progress(progress_cookie, r.long_name != NULL ? r.long_name : name, &r.stats);
+                }
+                tr_clear_pending(&r);
+                break;
+            }
+        }
+    }
+
+    int i;
+    for (i = r.dirs_count - 1; i >= 0; i--) {
+        if (r.dirs[i].path != NULL) {
+            utimes(r.dirs[i].path, r.dirs[i].times);
+            free(r.dirs[i].path);
+        }
+    }
+    free(r.dirs);
+    tr_clear_pending(&r);
+    free(r.buffer);
+    return ret;
+}
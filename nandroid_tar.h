@@ -0,0 +1,40 @@
+#ifndef NANDROID_TAR_H
+#define NANDROID_TAR_H
+
+#include <sys/types.h>
+
+// In-process tar engine used by nandroid in place of shelling out to
+// busybox tar.  Archives are GNU-flavoured ustar: names longer than 100
+// bytes use ././@LongLink entries, and extended attributes are stored in
+// pax "x" headers as SCHILY.xattr.<name> records, which GNU tar also
+// understands.
+
+// Sink for archive bytes.  Returns 0 on success, nonzero on failure.
+typedef int (*tar_write_fn)(void* cookie, const void* data, size_t len);
+
+// Source of archive bytes.  Returns the number of bytes read, 0 at end
+// of stream, or -1 on error.
+typedef ssize_t (*tar_read_fn)(void* cookie, void* data, size_t len);
+
+typedef struct {
+    unsigned long files;        // entries archived or extracted so far
+    unsigned long long bytes;   // file payload bytes processed so far
+} TarStats;
+
+// Called once per entry after it has been archived or extracted.  The
+// counters in stats are already updated; path is the archive name.
+typedef void (*tar_progress_fn)(void* cookie, const char* path, const TarStats* stats);
+
+// Archive base_dir/name (recursively) under the archive name "name".
+// Archive names listed in the NULL-terminated excludes array (eg
+// "data/media") are skipped along with everything below them.
+int tar_create(const char* base_dir, const char* name, const char** excludes,
+               tar_write_fn write, void* cookie,
+               tar_progress_fn progress, void* progress_cookie);
+
+// Extract an archive below dest_dir, restoring ownership, permissions,
+// timestamps and extended attributes.
+int tar_extract(const char* dest_dir, tar_read_fn read, void* cookie,
+                tar_progress_fn progress, void* progress_cookie);
+
+#endif
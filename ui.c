@@ -31,6 +31,7 @@
 #include "common.h"
 #include <cutils/android_reboot.h>
 #include "minui/minui.h"
+#include "minui/chinese.h"
 #include "recovery_ui.h"
 
 extern int __system(const char *command);
@@ -108,6 +109,30 @@ static int text_col = 0, text_row = 0, text_top = 0;
 static int show_text = 0;
 static int show_text_ever = 0;   // has show_text ever been 1?
 
+// What each log row on the screen showed when it was last drawn, so that
+// ui_print can tell which rows changed and which only moved up.
+static char log_drawn[MAX_ROWS][MAX_COLS];
+static int log_drawn_rows = 0;      // 0 if the screen doesn't show the log
+static int log_drawn_start = 0;     // screen row of the first log row
+static int log_scrollable = 0;      // the background under the log is flat
+
+// Text queued by ui_print for the progress thread to put in text[] and
+// draw.  The ring has one reader, whoever holds gUpdateMutex, and
+// gLogRingMutex keeps ui_print callers from writing into it at the same
+// time; neither of them ever waits for a frame to be drawn.
+#define LOG_RING_SIZE 16384     // a power of two
+static pthread_mutex_t gLogRingMutex = PTHREAD_MUTEX_INITIALIZER;
+static char log_ring[LOG_RING_SIZE];
+static volatile unsigned log_ring_head = 0;    // written by ui_print
+static volatile unsigned log_ring_tail = 0;    // written by the reader
+static volatile unsigned log_ring_prints = 0;  // ui_print calls so far
+static unsigned log_prints_read = 0;    // of those, how many were read
+static int log_dirty = 0;               // text[] changed since last drawn
+
+// Per burst of printing: how many prints were read and in how many
+// frames they were drawn, and how often the ring was full.
+static unsigned burst_prints = 0, burst_frames = 0, burst_full = 0;
+
 static char menu[MENU_MAX_ROWS][MENU_MAX_COLS];
 static int show_menu = 0;
 static int menu_top = 0, menu_items = 0, menu_sel = 0;
@@ -225,7 +250,7 @@ static void draw_text_line(int row, const char* t, int align) {
     int col = 0;
     if (t[0] != '\0') {
         //int length = gr_measure(t);
-        int length = strnlen(t, MENU_MAX_COLS) * CHAR_WIDTH;
+        int length = str_utf8_width(t, strnlen(t, MENU_MAX_COLS)) * CHAR_WIDTH;
         //if (length > MENU_MAX_COLS * CHAR_WIDTH)
         //    length = MENU_MAX_COLS * CHAR_WIDTH;
         switch(align)
@@ -257,10 +282,116 @@ static void draw_text_line(int row, const char* t, int align) {
 //#define NORMAL_TEXT_COLOR 0, 128, 0, 255 //green
 #define HEADER_TEXT_COLOR NORMAL_TEXT_COLOR
 
+// Where the log goes when the menu takes 'menu_rows' rows above it: the
+// screen row it starts on and the text[] line its first row shows.
+// Returns the number of log rows.
+static int get_log_layout_locked(int menu_rows, int* start_row, int* first_line)
+{
+    gr_surface surface = gVirtualKeys;
+    int total_rows = (gr_fb_height() / CHAR_HEIGHT) - (gr_get_height(surface) / CHAR_HEIGHT) - 1;
+    int cur_row = text_row;
+    int available_rows = total_rows - menu_rows - 1;
+    *start_row = menu_rows + 1;
+    if (available_rows < MAX_ROWS)
+        cur_row = (cur_row + (MAX_ROWS - available_rows)) % MAX_ROWS;
+    else
+        *start_row = total_rows - MAX_ROWS;
+    *first_line = cur_row;
+    if (available_rows < 0)
+        return 0;
+    return available_rows < MAX_ROWS ? available_rows : MAX_ROWS;
+}
+
+// Draw the log rows (clipped to whatever gr_clip allows) and remember
+// what each of them shows.  Should only be called with gUpdateMutex locked.
+static void draw_log_locked(int start_row, int first_line, int rows)
+{
+    gr_color(NORMAL_TEXT_COLOR);
+    int r;
+    for (r = 0; r < rows; r++) {
+        const char* line = text[(first_line + r) % MAX_ROWS];
+        draw_text_line(start_row + r, line, LEFT_ALIGN);
+        strcpy(log_drawn[r], line);
+    }
+}
+
+// Append printed text to the log.
+// Should only be called with gUpdateMutex locked.
+static void add_text_locked(const char* s, unsigned len)
+{
+    unsigned i;
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '\n' || text_col >= text_cols) {
+            text[text_row][text_col] = '\0';
+            text_col = 0;
+            text_row = (text_row + 1) % text_rows;
+            if (text_row == text_top) text_top = (text_top + 1) % text_rows;
+        }
+        if (s[i] != '\n') text[text_row][text_col++] = s[i];
+    }
+    text[text_row][text_col] = '\0';
+    log_dirty = 1;
+}
+
+// Move whatever ui_print queued into the log.  Returns 0 if there was
+// nothing queued.
+// Should only be called with gUpdateMutex locked.
+static int read_log_ring_locked(void)
+{
+    // ui_print counts a print after queueing its text, so every print
+    // counted here has its text before 'head'.
+    unsigned prints = log_ring_prints;
+    __sync_synchronize();
+    unsigned head = log_ring_head;
+    unsigned tail = log_ring_tail;
+    if (head == tail) return 0;
+    __sync_synchronize();
+
+    unsigned start = tail & (LOG_RING_SIZE - 1);
+    unsigned len = head - tail;
+    if (start + len > LOG_RING_SIZE) {
+        add_text_locked(log_ring + start, LOG_RING_SIZE - start);
+        add_text_locked(log_ring, len - (LOG_RING_SIZE - start));
+    } else {
+        add_text_locked(log_ring + start, len);
+    }
+
+    __sync_synchronize();
+    log_ring_tail = head;
+    burst_prints += prints - log_prints_read;
+    log_prints_read = prints;
+    return 1;
+}
+
+// Queue text for the log.  Returns -1 if there is no room for it.
+// Should only be called with gLogRingMutex locked.
+static int write_log_ring_locked(const char* s, unsigned len)
+{
+    unsigned head = log_ring_head;
+    if (len > LOG_RING_SIZE - (head - log_ring_tail)) return -1;
+    // Don't overwrite text before the reader is done with it.
+    __sync_synchronize();
+
+    unsigned start = head & (LOG_RING_SIZE - 1);
+    if (start + len > LOG_RING_SIZE) {
+        memcpy(log_ring + start, s, LOG_RING_SIZE - start);
+        memcpy(log_ring, s + (LOG_RING_SIZE - start), len - (LOG_RING_SIZE - start));
+    } else {
+        memcpy(log_ring + start, s, len);
+    }
+
+    __sync_synchronize();
+    log_ring_head = head + len;
+    return 0;
+}
+
 // Redraw everything on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_screen_locked(void)
 {
+    read_log_ring_locked();
+    log_dirty = 0;
+    log_drawn_rows = 0;
     if (!ui_has_initialized) return;
     draw_background_locked(gCurrentIcon);
     draw_progress_locked();
@@ -269,8 +400,6 @@ static void draw_screen_locked(void)
         gr_color(0, 0, 0, 160);
         gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
-        gr_surface surface = gVirtualKeys;
-        int total_rows = (gr_fb_height() / CHAR_HEIGHT) - (gr_get_height(surface) / CHAR_HEIGHT) - 1;
         int i = 0;
         int j = 0;
         int offset = 0;         // offset of separating bar under menus
@@ -333,19 +462,17 @@ static void draw_screen_locked(void)
                     gr_fb_width(), (row-offset)*CHAR_HEIGHT+CHAR_HEIGHT/2+1);
         }
 
-        gr_color(NORMAL_TEXT_COLOR);
-        int cur_row = text_row;
-        int available_rows = total_rows - row - 1;
-        int start_row = row + 1;
-        if (available_rows < MAX_ROWS)
-            cur_row = (cur_row + (MAX_ROWS - available_rows)) % MAX_ROWS;
-        else
-            start_row = total_rows - MAX_ROWS;
-
-        int r;
-        for (r = 0; r < (available_rows < MAX_ROWS ? available_rows : MAX_ROWS); r++) {
-            draw_text_line(start_row + r, text[(cur_row + r) % MAX_ROWS], LEFT_ALIGN);
+        int start_row, first_line;
+        int rows = get_log_layout_locked(row, &start_row, &first_line);
+        if (!show_menu) {
+            // Keep the background under the log, so that ui_print can
+            // redraw rows of it without redrawing the whole screen.
+            log_scrollable = gr_save_rows(start_row * CHAR_HEIGHT,
+                                          rows * CHAR_HEIGHT);
+            log_drawn_rows = rows;
+            log_drawn_start = start_row;
         }
+        draw_log_locked(start_row, first_line, rows);
     }
     draw_virtualkeys_locked(); //added to draw the virtual keys
 }
@@ -359,6 +486,65 @@ static void update_screen_locked(void)
     gr_flip();
 }
 
+// Brings the log on the screen up to date after ui_print, when that can
+// be done without redrawing everything: rows that only moved up are
+// scrolled as pixels if the background under the log is flat, and only
+// the rows that changed are drawn again, over the background saved by
+// the last full redraw.  Returns 0 if it did, -1 if the caller has to
+// redraw the screen.
+// Should only be called with gUpdateMutex locked.
+static int update_log_locked(void)
+{
+    if (!show_text || show_menu || log_drawn_rows == 0) return -1;
+
+    int start_row, first_line;
+    int rows = get_log_layout_locked(0, &start_row, &first_line);
+    if (rows != log_drawn_rows || start_row != log_drawn_start) return -1;
+
+    // Pick how far to scroll: the shift that leaves the fewest rows
+    // to draw again.
+    int shift, best_shift = 0, best_cost = rows + 1;
+    int r;
+    for (shift = 0; shift < (log_scrollable ? rows : 1); shift++) {
+        int cost = shift;
+        for (r = 0; r + shift < rows && cost < best_cost; r++) {
+            if (strcmp(text[(first_line + r) % MAX_ROWS], log_drawn[r + shift]) != 0)
+                cost++;
+        }
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_shift = shift;
+        }
+    }
+
+    char changed[MAX_ROWS];
+    for (r = 0; r < rows; r++) {
+        changed[r] = r + best_shift >= rows ||
+            strcmp(text[(first_line + r) % MAX_ROWS], log_drawn[r + best_shift]) != 0;
+    }
+
+    if (best_shift > 0) {
+        gr_scroll((start_row + best_shift) * CHAR_HEIGHT,
+                  (rows - best_shift) * CHAR_HEIGHT, -best_shift * CHAR_HEIGHT);
+    }
+
+    int end;
+    for (r = 0; r < rows; r = end) {
+        for (end = r + 1; end < rows && changed[end] == changed[r]; end++);
+        if (!changed[r]) continue;
+
+        int y = (start_row + r) * CHAR_HEIGHT;
+        int h = (end - r) * CHAR_HEIGHT;
+        gr_clip(0, y, gr_fb_width(), h);
+        gr_restore_rows(y, h);
+        draw_log_locked(start_row, first_line, rows);
+    }
+    gr_noclip();
+    gr_flip();
+    log_dirty = 0;
+    return 0;
+}
+
 // Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with gUpdateMutex locked.
 static void update_progress_locked(void)
@@ -411,6 +597,26 @@ static void *progress_thread(void *cookie)
             }
         }
 
+        // draw what ui_print queued since the last frame, all at once
+        read_log_ring_locked();
+        if (log_dirty && !show_text) {
+            log_dirty = 0;      // the log isn't on the screen
+        } else if (log_dirty) {
+            burst_frames++;
+            if (!redraw && update_log_locked() != 0) redraw = 1;
+        } else if (burst_prints > 0) {
+            // The printing has stopped for now; say how much of it had
+            // to share a frame.
+            if (burst_frames > 0 &&
+                (burst_prints > burst_frames || burst_full > 0)) {
+                LOGI("ui: %u prints drawn in %u frames (%u coalesced, ring full %u times)\n",
+                     burst_prints, burst_frames,
+                     burst_prints > burst_frames ? burst_prints - burst_frames : 0,
+                     burst_full);
+            }
+            burst_prints = burst_frames = burst_full = 0;
+        }
+
         if (redraw) update_progress_locked();
 
         pthread_mutex_unlock(&gUpdateMutex);
@@ -644,6 +850,7 @@ void ui_init(void)
     ev_init(input_callback, NULL);
 
     gr_surface surface = gVirtualKeys;
+    pthread_mutex_lock(&gUpdateMutex);
     text_col = text_row = 0;
     text_rows = gr_fb_height() / CHAR_HEIGHT;
     max_menu_rows = text_rows - MIN_LOG_ROWS;
@@ -655,6 +862,7 @@ void ui_init(void)
 
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
+    pthread_mutex_unlock(&gUpdateMutex);
 
     int i;
     for (i = 0; BITMAPS[i].name != NULL; ++i) {
@@ -797,21 +1005,22 @@ void ui_print(const char *fmt, ...)
 
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&gUpdateMutex);
-    if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
-        }
-        text[text_row][text_col] = '\0';
-        update_screen_locked();
-    }
+    int ready = text_rows > 0 && text_cols > 0;
     pthread_mutex_unlock(&gUpdateMutex);
+    if (!ready) return;
+
+    // The progress thread draws the text with its next frame.
+    pthread_mutex_lock(&gLogRingMutex);
+    if (write_log_ring_locked(buf, strlen(buf)) != 0) {
+        // It has fallen behind; catch up here rather than lose text.
+        pthread_mutex_lock(&gUpdateMutex);
+        read_log_ring_locked();
+        add_text_locked(buf, strlen(buf));
+        burst_full++;
+        pthread_mutex_unlock(&gUpdateMutex);
+    }
+    log_ring_prints++;
+    pthread_mutex_unlock(&gLogRingMutex);
 }
 
 void ui_printlogtail(int nb_lines) {
@@ -839,6 +1048,7 @@ void ui_printlogtail(int nb_lines) {
 void ui_reset_text_col()
 {
     pthread_mutex_lock(&gUpdateMutex);
+    read_log_ring_locked();
     text_col = 0;
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -366,8 +367,8 @@ Value* PackageExtractDirFn(const char* name, State* state,
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL);
+                                      MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_PARALLEL,
+                                      &timestamp, NULL, NULL);
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
@@ -400,14 +401,16 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done2;
         }
 
-        FILE* f = fopen(dest_path, "wb");
-        if (f == NULL) {
+        // O_LARGEFILE so entries over 2GB can be written on 32-bit targets.
+        int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                      0666);
+        if (fd < 0) {
             fprintf(stderr, "%s: can't open %s for write: %s\n",
                     name, dest_path, strerror(errno));
             goto done2;
         }
-        success = mzExtractZipEntryToFile(za, entry, fileno(f));
-        fclose(f);
+        success = mzExtractZipEntryToFile(za, entry, fd);
+        close(fd);
 
       done2:
         free(zip_path);
@@ -432,6 +435,11 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done1;
         }
 
+        if (mzGetZipEntryUncompLen(entry) > SSIZE_MAX) {
+            fprintf(stderr, "%s: %s is too big to read into memory\n",
+                    name, zip_path);
+            goto done1;
+        }
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
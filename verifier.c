@@ -16,6 +16,7 @@
 
 #include "common.h"
 #include "verifier.h"
+#include "verifier_hash.h"
 
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
@@ -23,23 +24,157 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
 
-int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+#ifndef POSIX_FADV_SEQUENTIAL
+#define POSIX_FADV_SEQUENTIAL 2
+#define posix_fadvise(fd, offset, len, advice) 0
+#endif
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
-        return VERIFY_FAILURE;
+// Reads exactly len bytes at offset; packages may be bigger than 4GB.
+static int read_at(int fd, void* data, size_t len, off64_t offset) {
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t n = pread64(fd, (char*)data + so_far, len - so_far,
+                            offset + so_far);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        so_far += n;
+    }
+    return 0;
+}
+
+// mincrypt's RSA_verify only knows SHA-1 signatures.  SHA-256 ones go
+// through the same e=3 Montgomery exponentiation here, using the n0inv
+// and rr that DumpPublicKey stores with each key.
+
+// a[] -= mod
+static void subM(const RSAPublicKey* key, uint32_t* a) {
+    int64_t A = 0;
+    int i;
+    for (i = 0; i < key->len; ++i) {
+        A += (uint64_t)a[i] - key->n[i];
+        a[i] = (uint32_t)A;
+        A >>= 32;
+    }
+}
+
+// return a[] >= mod
+static int geM(const RSAPublicKey* key, const uint32_t* a) {
+    int i;
+    for (i = key->len; i;) {
+        --i;
+        if (a[i] < key->n[i]) return 0;
+        if (a[i] > key->n[i]) return 1;
+    }
+    return 1;  // equal
+}
+
+// montgomery c[] += a * b[] / R % mod
+static void montMulAdd(const RSAPublicKey* key, uint32_t* c,
+                       const uint32_t a, const uint32_t* b) {
+    uint64_t A = (uint64_t)a * b[0] + c[0];
+    uint32_t d0 = (uint32_t)A * key->n0inv;
+    uint64_t B = (uint64_t)d0 * key->n[0] + (uint32_t)A;
+    int i;
+    for (i = 1; i < key->len; ++i) {
+        A = (A >> 32) + (uint64_t)a * b[i] + c[i];
+        B = (B >> 32) + (uint64_t)d0 * key->n[i] + (uint32_t)A;
+        c[i - 1] = (uint32_t)B;
+    }
+    A = (A >> 32) + (B >> 32);
+    c[i - 1] = (uint32_t)A;
+    if (A >> 32) {
+        subM(key, c);
+    }
+}
+
+// montgomery c[] = a[] * b[] / R % mod
+static void montMul(const RSAPublicKey* key, uint32_t* c,
+                    const uint32_t* a, const uint32_t* b) {
+    int i;
+    for (i = 0; i < key->len; ++i) c[i] = 0;
+    for (i = 0; i < key->len; ++i) montMulAdd(key, c, a[i], b);
+}
+
+// In-place public exponentiation with e = 3, on a big-endian byte array.
+static void modpow3(const RSAPublicKey* key, uint8_t* inout) {
+    uint32_t a[RSANUMWORDS];
+    uint32_t aR[RSANUMWORDS];
+    uint32_t aaR[RSANUMWORDS];
+    uint32_t* aaa = aR;  // re-use location
+    int i;
+
+    for (i = 0; i < key->len; ++i) {
+        const uint8_t* p = inout + (key->len - 1 - i) * 4;
+        a[i] = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    montMul(key, aR, a, key->rr);   // aR = a * RR / R mod M
+    montMul(key, aaR, aR, aR);      // aaR = aR * aR / R mod M
+    montMul(key, aaa, aaR, a);      // aaa = aaR * a / R mod M
+
+    // aaa is at most one modulus too large.
+    if (geM(key, aaa)) {
+        subM(key, aaa);
     }
 
+    for (i = key->len - 1; i >= 0; --i) {
+        *inout++ = aaa[i] >> 24;
+        *inout++ = aaa[i] >> 16;
+        *inout++ = aaa[i] >> 8;
+        *inout++ = aaa[i];
+    }
+}
+
+// PKCS#1 v1.5 DigestInfo prefix for SHA-256.
+static const uint8_t sha256_digest_info[] = {
+    0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01,
+    0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+static int rsa_verify_sha256(const RSAPublicKey* key, const uint8_t* signature,
+                             const uint8_t* sha256) {
+    uint8_t buf[RSANUMBYTES];
+    const int pad_len = RSANUMBYTES - 3 - sizeof(sha256_digest_info) -
+                        SHA256_DIGEST_SIZE;
+    int i;
+
+    if (key->len != RSANUMWORDS) return 0;
+    memcpy(buf, signature, RSANUMBYTES);
+    modpow3(key, buf);
+
+    // 00 01 ff .. ff 00 DigestInfo hash; collect the differences rather
+    // than returning at the first one.
+    uint8_t diff = buf[0] ^ 0x00;
+    diff |= buf[1] ^ 0x01;
+    for (i = 0; i < pad_len; ++i) diff |= buf[2 + i] ^ 0xff;
+    diff |= buf[2 + pad_len];
+    diff |= memcmp(buf + 3 + pad_len, sha256_digest_info,
+                   sizeof(sha256_digest_info)) != 0;
+    diff |= memcmp(buf + RSANUMBYTES - SHA256_DIGEST_SIZE, sha256,
+                   SHA256_DIGEST_SIZE) != 0;
+    return diff == 0;
+}
+
+// Reads the signature footer and the end-of-central-directory record
+// that holds it.  Returns the EOCD record (comment included) in a
+// malloc'd buffer, with its size and how much of the file the signature
+// covers, or NULL if the file isn't signed.
+static unsigned char* read_signature_block(int fd, const char* path,
+                                           off64_t file_size, size_t* eocd_size_out,
+                                           off64_t* signed_len_out) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -51,22 +186,19 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
 #define FOOTER_SIZE 6
 
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
+    if (file_size < FOOTER_SIZE) {
+        LOGE("%s is too short to be signed\n", path);
+        return NULL;
     }
 
     unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
+    if (read_at(fd, footer, FOOTER_SIZE, file_size - FOOTER_SIZE) != 0) {
         LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
+        return NULL;
     }
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
-        fclose(f);
-        return VERIFY_FAILURE;
+        return NULL;
     }
 
     int comment_size = footer[4] + (footer[5] << 8);
@@ -77,8 +209,7 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+        return NULL;
     }
 
 #define EOCD_HEADER_SIZE 22
@@ -87,28 +218,26 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
+    if (file_size < (off64_t)eocd_size) {
+        LOGE("%s is too short for its comment\n", path);
+        return NULL;
     }
 
     // Determine how much of the file is covered by the signature.
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    off64_t signed_len = file_size - eocd_size + EOCD_HEADER_SIZE - 2;
 
     unsigned char* eocd = malloc(eocd_size);
     if (eocd == NULL) {
         LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+        return NULL;
     }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
+    if (read_at(fd, eocd, eocd_size, file_size - eocd_size) != 0) {
         LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
+        free(eocd);
+        return NULL;
     }
 
     // If this is really is the EOCD record, it will begin with the
@@ -116,11 +245,11 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+        free(eocd);
+        return NULL;
     }
 
-    int i;
+    size_t i;
     for (i = 4; i < eocd_size-3; ++i) {
         if (eocd[i  ] == 0x50 && eocd[i+1] == 0x4b &&
             eocd[i+2] == 0x05 && eocd[i+3] == 0x06) {
@@ -129,34 +258,117 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
-            return VERIFY_FAILURE;
+            free(eocd);
+            return NULL;
         }
     }
 
-#define BUFFER_SIZE 4096
+    *eocd_size_out = eocd_size;
+    *signed_len_out = signed_len;
+    return eocd;
+}
+
+// The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
+// the signing tool appends after the signature itself.
+#define SIGNATURE(eocd, eocd_size) ((eocd) + (eocd_size) - 6 - RSANUMBYTES)
+
+static int check_signature(const Certificate* cert, const uint8_t* signature,
+                           const uint8_t* digest) {
+    if (cert->hash_len == SHA256_DIGEST_SIZE) {
+        return rsa_verify_sha256(&cert->public_key, signature, digest);
+    }
+    return RSA_verify(&cert->public_key, signature, RSANUMBYTES, digest);
+}
+
+// What the verification cache remembers about a package it verified.
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime;
+    long long ctime;
+    long long signed_len;
+    int key_index;
+    int hash_len;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+} VerifyRecord;
+
+static void identify_file(const struct stat* st, off64_t file_size,
+                          VerifyRecord* rec) {
+    rec->dev = st->st_dev;
+    rec->ino = st->st_ino;
+    rec->size = file_size;
+    rec->mtime = st->st_mtime;
+    rec->ctime = st->st_ctime;
+}
+
+static int verify_fd(int fd, const char* path, const Certificate *pKeys,
+                     unsigned int numKeys, VerifyRecord* rec) {
+    ui_set_progress(0.0);
+
+    off64_t file_size = lseek64(fd, 0, SEEK_END);
+
+    // Times only have one second resolution, so a file changed in the
+    // second the record is taken could change again without them
+    // moving.  Only files that were last touched earlier are recorded.
+    struct stat before;
+    time_t started = time(NULL);
+    if (rec != NULL && (fstat(fd, &before) != 0 ||
+                        before.st_mtime >= started ||
+                        before.st_ctime >= started)) {
+        rec = NULL;
+    }
+
+    size_t eocd_size;
+    off64_t signed_len;
+    unsigned char* eocd = read_signature_block(fd, path, file_size,
+                                               &eocd_size, &signed_len);
+    if (eocd == NULL) {
+        return VERIFY_FAILURE;
+    }
 
-    SHA_CTX ctx;
-    SHA_init(&ctx);
+// Big reads keep the hash busy; the sequential hint lets the kernel read
+// further ahead while it works.
+#define BUFFER_SIZE (4 * 1024 * 1024)
+
+    bool need_sha1 = false;
+    bool need_sha256 = false;
+    unsigned int i;
+    for (i = 0; i < numKeys; ++i) {
+        if (pKeys[i].hash_len == SHA256_DIGEST_SIZE) {
+            need_sha256 = true;
+        } else {
+            need_sha1 = true;
+        }
+    }
+
+    HASH_CTX sha1_ctx;
+    HASH_CTX sha256_ctx;
+    hash_init(&sha1_ctx, HASH_SHA1_SIZE);
+    hash_init(&sha256_ctx, HASH_SHA256_SIZE);
     unsigned char* buffer = malloc(BUFFER_SIZE);
     if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
+        LOGE("failed to alloc memory for hash buffer\n");
+        free(eocd);
         return VERIFY_FAILURE;
     }
+    LOGI("hashing %lld bytes (%s)\n", (long long)signed_len,
+         hash_implementation());
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
     double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
+    off64_t so_far = 0;
     while (so_far < signed_len) {
         int size = BUFFER_SIZE;
         if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
+        if (read_at(fd, buffer, size, so_far) != 0) {
             LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
+            free(eocd);
+            free(buffer);
             return VERIFY_FAILURE;
         }
-        SHA_update(&ctx, buffer, size);
+        if (need_sha1) hash_update(&sha1_ctx, buffer, size);
+        if (need_sha256) hash_update(&sha256_ctx, buffer, size);
         so_far += size;
         double f = so_far / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
@@ -164,17 +376,29 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             frac = f;
         }
     }
-    fclose(f);
     free(buffer);
 
-    const uint8_t* sha1 = SHA_final(&ctx);
+    const uint8_t* sha1 = hash_final(&sha1_ctx);
+    const uint8_t* sha256 = hash_final(&sha256_ctx);
     for (i = 0; i < numKeys; ++i) {
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
-                       RSANUMBYTES, sha1)) {
+        const uint8_t* digest =
+                pKeys[i].hash_len == SHA256_DIGEST_SIZE ? sha256 : sha1;
+        if (check_signature(pKeys + i, SIGNATURE(eocd, eocd_size), digest)) {
             LOGI("whole-file signature verified against key %d\n", i);
             free(eocd);
+            // Only remember the file if it didn't change while it was
+            // being hashed.
+            struct stat after;
+            if (rec != NULL && fstat(fd, &after) == 0 &&
+                after.st_mtime == before.st_mtime &&
+                after.st_ctime == before.st_ctime &&
+                lseek64(fd, 0, SEEK_END) == file_size) {
+                identify_file(&before, file_size, rec);
+                rec->signed_len = signed_len;
+                rec->key_index = i;
+                rec->hash_len = pKeys[i].hash_len;
+                memcpy(rec->digest, digest, pKeys[i].hash_len);
+            }
             return VERIFY_SUCCESS;
         }
     }
@@ -182,3 +406,202 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
+
+// Look for an RSA signature embedded in the .ZIP file comment given
+// the path to the zip.  Verify it matches one of the given public
+// keys.
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys) {
+    int fd = open(path, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    int result = verify_fd(fd, path, pKeys, numKeys, NULL);
+    close(fd);
+    return result;
+}
+
+// The verification cache is a text file with one package per line:
+//
+//   dev ino size mtime ctime signed_len key_index hash_len digest
+//
+// newest first, digest in hex.  It only ever lets a package skip the
+// hash: the signature is still checked against the remembered digest,
+// so a record can't vouch for a package that isn't signed by a loaded
+// key, and anything that doesn't match exactly means a full check.
+
+#define VERIFY_CACHE_ENTRIES 16
+
+static int read_record(FILE* f, VerifyRecord* rec) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    if (fscanf(f, "%llu %llu %lld %lld %lld %lld %d %d %64s",
+               &rec->dev, &rec->ino, &rec->size, &rec->mtime, &rec->ctime,
+               &rec->signed_len, &rec->key_index, &rec->hash_len, hex) != 9) {
+        return -1;
+    }
+    if (rec->hash_len != SHA_DIGEST_SIZE && rec->hash_len != SHA256_DIGEST_SIZE) {
+        return -1;
+    }
+    if (strlen(hex) != (size_t)rec->hash_len * 2) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < rec->hash_len; ++i) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        rec->digest[i] = byte;
+    }
+    return 0;
+}
+
+static void write_record(FILE* f, const VerifyRecord* rec) {
+    fprintf(f, "%llu %llu %lld %lld %lld %lld %d %d ",
+            rec->dev, rec->ino, rec->size, rec->mtime, rec->ctime,
+            rec->signed_len, rec->key_index, rec->hash_len);
+    int i;
+    for (i = 0; i < rec->hash_len; ++i) {
+        fprintf(f, "%02x", rec->digest[i]);
+    }
+    fputc('\n', f);
+}
+
+static bool same_file(const VerifyRecord* a, const VerifyRecord* b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+// Returns VERIFY_SUCCESS if the cache remembers verifying this very file,
+// and its signature still checks out against the remembered digest.
+static int verify_fd_cached(int fd, const char* path, const Certificate *pKeys,
+                            unsigned int numKeys, const char* cache_file) {
+    FILE* f = fopen(cache_file, "r");
+    if (f == NULL) return VERIFY_FAILURE;
+
+    struct stat st;
+    off64_t file_size = lseek64(fd, 0, SEEK_END);
+    VerifyRecord now, rec;
+    bool found = false;
+    if (fstat(fd, &st) == 0) {
+        identify_file(&st, file_size, &now);
+        while (!found && read_record(f, &rec) == 0) {
+            found = same_file(&now, &rec);
+        }
+    }
+    fclose(f);
+    if (!found) return VERIFY_FAILURE;
+
+    if (rec.key_index < 0 || rec.key_index >= (int)numKeys ||
+        pKeys[rec.key_index].hash_len != rec.hash_len) {
+        return VERIFY_FAILURE;
+    }
+    size_t eocd_size;
+    off64_t signed_len;
+    unsigned char* eocd = read_signature_block(fd, path, file_size,
+                                               &eocd_size, &signed_len);
+    if (eocd == NULL) return VERIFY_FAILURE;
+    int ok = signed_len == rec.signed_len &&
+             check_signature(pKeys + rec.key_index, SIGNATURE(eocd, eocd_size),
+                             rec.digest);
+    free(eocd);
+    if (!ok) return VERIFY_FAILURE;
+
+    LOGI("whole-file signature of %s verified against key %d from %s\n",
+         path, rec.key_index, cache_file);
+    ui_set_progress(1.0);
+    return VERIFY_SUCCESS;
+}
+
+// Puts rec at the front of the cache, dropping any older record for the
+// same inode and the oldest ones beyond VERIFY_CACHE_ENTRIES.
+static void store_record(const char* cache_file, const VerifyRecord* rec) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_file);
+    FILE* out = fopen(tmp, "w");
+    if (out == NULL) {
+        LOGW("can't write %s (%s)\n", tmp, strerror(errno));
+        return;
+    }
+    write_record(out, rec);
+
+    FILE* in = fopen(cache_file, "r");
+    if (in != NULL) {
+        VerifyRecord old;
+        int count = 1;
+        while (count < VERIFY_CACHE_ENTRIES && read_record(in, &old) == 0) {
+            if (old.dev != rec->dev || old.ino != rec->ino) {
+                write_record(out, &old);
+                ++count;
+            }
+        }
+        fclose(in);
+    }
+    if (fclose(out) != 0 || rename(tmp, cache_file) != 0) {
+        LOGW("can't update %s (%s)\n", cache_file, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+struct VerifyJob {
+    pthread_t thread;
+    const char* path;
+    const Certificate* pKeys;
+    unsigned int numKeys;
+    const char* cache_file;
+    VerifyRecord record;
+    bool record_valid;
+    int result;
+};
+
+static void* verify_thread(void* cookie) {
+    VerifyJob* job = (VerifyJob*)cookie;
+    int fd = open(job->path, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("failed to open %s (%s)\n", job->path, strerror(errno));
+        return NULL;
+    }
+    if (job->cache_file != NULL &&
+        verify_fd_cached(fd, job->path, job->pKeys, job->numKeys,
+                         job->cache_file) == VERIFY_SUCCESS) {
+        job->result = VERIFY_SUCCESS;
+    } else {
+        job->record.hash_len = 0;
+        job->result = verify_fd(fd, job->path, job->pKeys, job->numKeys,
+                                job->cache_file != NULL ? &job->record : NULL);
+        job->record_valid = job->result == VERIFY_SUCCESS &&
+                            job->record.hash_len != 0;
+    }
+    close(fd);
+    return NULL;
+}
+
+VerifyJob* verify_file_start(const char* path, const Certificate *pKeys,
+                             unsigned int numKeys, const char* cache_file) {
+    VerifyJob* job = malloc(sizeof(VerifyJob));
+    if (job == NULL) return NULL;
+    job->path = path;
+    job->pKeys = pKeys;
+    job->numKeys = numKeys;
+    job->cache_file = cache_file;
+    job->record_valid = false;
+    job->result = VERIFY_FAILURE;
+    if (pthread_create(&job->thread, NULL, verify_thread, job) != 0) {
+        LOGE("failed to start verification thread\n");
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+int verify_file_finish(VerifyJob* job) {
+    pthread_join(job->thread, NULL);
+    int result = job->result;
+    if (job->record_valid) {
+        store_record(job->cache_file, &job->record);
+    }
+    free(job);
+    return result;
+}
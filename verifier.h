@@ -19,10 +19,37 @@
 
 #include "mincrypt/rsa.h"
 
+/* A public key and the digest the packages it signs are hashed with:
+ * SHA_DIGEST_SIZE for SHA-1, SHA256_DIGEST_SIZE for SHA-256.
+ */
+#ifndef SHA256_DIGEST_SIZE
+#define SHA256_DIGEST_SIZE    32
+#endif
+
+typedef struct {
+    int hash_len;
+    RSAPublicKey public_key;
+} Certificate;
+
 /* Look in the file for a signature footer, and verify that it
  * matches one of the given keys.  Return one of the constants below.
  */
-int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys);
+int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
+
+/* Runs verify_file on a background thread, so the caller can get the
+ * package ready meanwhile.  The keys must stay valid until
+ * verify_file_finish, which waits for the result and frees the job.
+ * Returns NULL if the thread can't be started.
+ *
+ * If cache_file isn't NULL, a package it has a record of (same device,
+ * inode, size, mtime and ctime) has its signature checked against the
+ * remembered digest instead of being hashed again; anything else gets
+ * the full check, and verify_file_finish records it on success.
+ */
+typedef struct VerifyJob VerifyJob;
+VerifyJob* verify_file_start(const char* path, const Certificate *pKeys,
+                             unsigned int numKeys, const char* cache_file);
+int verify_file_finish(VerifyJob* job);
 
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
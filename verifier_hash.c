@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "verifier_hash.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define HASH_X86_SHA 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRYPTO)
+#define HASH_ARM_SHA 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*block_fn)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+#define SHA1_STEP(f, k) do {                                      \
+        uint32_t tmp = ROL(a, 5) + (f) + e + (k) + W[t];          \
+        e = d;                                                    \
+        d = c;                                                    \
+        c = ROL(b, 30);                                           \
+        b = a;                                                    \
+        a = tmp;                                                  \
+    } while (0)
+
+static void sha1_blocks_c(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32_t W[80];
+    while (blocks--) {
+        int t;
+        for (t = 0; t < 16; ++t) W[t] = load_be32(data + t * 4);
+        for (; t < 80; ++t) W[t] = ROL(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16], 1);
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (t = 0; t < 20; ++t) SHA1_STEP(d ^ (b & (c ^ d)), 0x5a827999);
+        for (; t < 40; ++t) SHA1_STEP(b ^ c ^ d, 0x6ed9eba1);
+        for (; t < 60; ++t) SHA1_STEP((b & c) | (d & (b | c)), 0x8f1bbcdc);
+        for (; t < 80; ++t) SHA1_STEP(b ^ c ^ d, 0xca62c1d6);
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        data += 64;
+    }
+}
+
+static void sha256_blocks_c(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32_t W[64];
+    while (blocks--) {
+        int t;
+        for (t = 0; t < 16; ++t) W[t] = load_be32(data + t * 4);
+        for (; t < 64; ++t) {
+            uint32_t s0 = ROR(W[t-15], 7) ^ ROR(W[t-15], 18) ^ (W[t-15] >> 3);
+            uint32_t s1 = ROR(W[t-2], 17) ^ ROR(W[t-2], 19) ^ (W[t-2] >> 10);
+            W[t] = W[t-16] + s0 + W[t-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (t = 0; t < 64; ++t) {
+            uint32_t S1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+            uint32_t ch = g ^ (e & (f ^ g));
+            uint32_t t1 = h + S1 + ch + K256[t] + W[t];
+            uint32_t S0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+            uint32_t maj = (a & b) | (c & (a | b));
+            uint32_t t2 = S0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef HASH_X86_SHA
+
+// The SHA extensions do four rounds per instruction, so each step below
+// is one 16-byte group of message words.  The groups rotate through four
+// variables; written out in full they stay in registers.
+
+#define SHA1_NI_LOAD(w, i) \
+    w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + (i) * 16)), mask)
+#define SHA1_NI_SCHEDULE(w0, w1, w2, w3) \
+    w0 = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w0, w1), w2), w3)
+#define SHA1_NI_ROUNDS(w, f) do {                                 \
+        e = _mm_sha1nexte_epu32(prev, w);                         \
+        prev = abcd;                                              \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, f);                   \
+    } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks--) {
+        __m128i abcd_save = abcd;
+        __m128i w0, w1, w2, w3, e, prev;
+
+        SHA1_NI_LOAD(w0, 0);
+        e = _mm_add_epi32(e0, w0);
+        prev = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+        SHA1_NI_LOAD(w1, 1); SHA1_NI_ROUNDS(w1, 0);
+        SHA1_NI_LOAD(w2, 2); SHA1_NI_ROUNDS(w2, 0);
+        SHA1_NI_LOAD(w3, 3); SHA1_NI_ROUNDS(w3, 0);
+        SHA1_NI_SCHEDULE(w0, w1, w2, w3); SHA1_NI_ROUNDS(w0, 0);
+        SHA1_NI_SCHEDULE(w1, w2, w3, w0); SHA1_NI_ROUNDS(w1, 1);
+        SHA1_NI_SCHEDULE(w2, w3, w0, w1); SHA1_NI_ROUNDS(w2, 1);
+        SHA1_NI_SCHEDULE(w3, w0, w1, w2); SHA1_NI_ROUNDS(w3, 1);
+        SHA1_NI_SCHEDULE(w0, w1, w2, w3); SHA1_NI_ROUNDS(w0, 1);
+        SHA1_NI_SCHEDULE(w1, w2, w3, w0); SHA1_NI_ROUNDS(w1, 1);
+        SHA1_NI_SCHEDULE(w2, w3, w0, w1); SHA1_NI_ROUNDS(w2, 2);
+        SHA1_NI_SCHEDULE(w3, w0, w1, w2); SHA1_NI_ROUNDS(w3, 2);
+        SHA1_NI_SCHEDULE(w0, w1, w2, w3); SHA1_NI_ROUNDS(w0, 2);
+        SHA1_NI_SCHEDULE(w1, w2, w3, w0); SHA1_NI_ROUNDS(w1, 2);
+        SHA1_NI_SCHEDULE(w2, w3, w0, w1); SHA1_NI_ROUNDS(w2, 2);
+        SHA1_NI_SCHEDULE(w3, w0, w1, w2); SHA1_NI_ROUNDS(w3, 3);
+        SHA1_NI_SCHEDULE(w0, w1, w2, w3); SHA1_NI_ROUNDS(w0, 3);
+        SHA1_NI_SCHEDULE(w1, w2, w3, w0); SHA1_NI_ROUNDS(w1, 3);
+        SHA1_NI_SCHEDULE(w2, w3, w0, w1); SHA1_NI_ROUNDS(w2, 3);
+        SHA1_NI_SCHEDULE(w3, w0, w1, w2); SHA1_NI_ROUNDS(w3, 3);
+        e0 = _mm_sha1nexte_epu32(prev, e0);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#define SHA256_NI_LOAD(w, i) \
+    w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + (i) * 16)), mask)
+#define SHA256_NI_SCHEDULE(w0, w1, w2, w3) \
+    w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), \
+                                            _mm_alignr_epi8(w3, w2, 4)), w3)
+#define SHA256_NI_ROUNDS(w, g) do {                                               \
+        __m128i msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i*)&K256[(g) * 4])); \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                      \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e)); \
+    } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);     // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);          // CDGH
+
+    while (blocks--) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i w0, w1, w2, w3;
+
+        SHA256_NI_LOAD(w0, 0); SHA256_NI_ROUNDS(w0, 0);
+        SHA256_NI_LOAD(w1, 1); SHA256_NI_ROUNDS(w1, 1);
+        SHA256_NI_LOAD(w2, 2); SHA256_NI_ROUNDS(w2, 2);
+        SHA256_NI_LOAD(w3, 3); SHA256_NI_ROUNDS(w3, 3);
+        SHA256_NI_SCHEDULE(w0, w1, w2, w3); SHA256_NI_ROUNDS(w0, 4);
+        SHA256_NI_SCHEDULE(w1, w2, w3, w0); SHA256_NI_ROUNDS(w1, 5);
+        SHA256_NI_SCHEDULE(w2, w3, w0, w1); SHA256_NI_ROUNDS(w2, 6);
+        SHA256_NI_SCHEDULE(w3, w0, w1, w2); SHA256_NI_ROUNDS(w3, 7);
+        SHA256_NI_SCHEDULE(w0, w1, w2, w3); SHA256_NI_ROUNDS(w0, 8);
+        SHA256_NI_SCHEDULE(w1, w2, w3, w0); SHA256_NI_ROUNDS(w1, 9);
+        SHA256_NI_SCHEDULE(w2, w3, w0, w1); SHA256_NI_ROUNDS(w2, 10);
+        SHA256_NI_SCHEDULE(w3, w0, w1, w2); SHA256_NI_ROUNDS(w3, 11);
+        SHA256_NI_SCHEDULE(w0, w1, w2, w3); SHA256_NI_ROUNDS(w0, 12);
+        SHA256_NI_SCHEDULE(w1, w2, w3, w0); SHA256_NI_ROUNDS(w1, 13);
+        SHA256_NI_SCHEDULE(w2, w3, w0, w1); SHA256_NI_ROUNDS(w2, 14);
+        SHA256_NI_SCHEDULE(w3, w0, w1, w2); SHA256_NI_ROUNDS(w3, 15);
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);                 // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);              // DCHG
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static int cpu_has_sha() {
+    unsigned int a, b, c, d;
+    if (__get_cpuid_max(0, NULL) < 7) return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    if (!(b & (1 << 29))) return 0;             // SHA
+    __cpuid(1, a, b, c, d);
+    return (c & (1 << 19)) && (c & (1 << 9));   // SSE4.1, SSSE3
+}
+
+#endif  // HASH_X86_SHA
+
+#ifdef HASH_ARM_SHA
+
+static void sha1_blocks_arm(uint32_t* state, const uint8_t* data, size_t blocks) {
+    static const uint32_t K[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e0 = state[4];
+
+    while (blocks--) {
+        uint32x4_t abcd_save = abcd;
+        uint32_t e_save = e0;
+        uint32x4_t W[4];
+        uint32_t e = e0;
+        int g;
+        for (g = 0; g < 20; ++g) {
+            uint32x4_t w;
+            if (g < 4) {
+                w = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+            } else {
+                w = vsha1su0q_u32(W[g & 3], W[(g + 1) & 3], W[(g + 2) & 3]);
+                w = vsha1su1q_u32(w, W[(g + 3) & 3]);
+            }
+            W[g & 3] = w;
+            uint32x4_t wk = vaddq_u32(w, vdupq_n_u32(K[g / 5]));
+            uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (g < 5) {
+                abcd = vsha1cq_u32(abcd, e, wk);
+            } else if (g < 10 || g >= 15) {
+                abcd = vsha1pq_u32(abcd, e, wk);
+            } else {
+                abcd = vsha1mq_u32(abcd, e, wk);
+            }
+            e = e_next;
+        }
+        e0 = e + e_save;
+        abcd = vaddq_u32(abcd, abcd_save);
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+
+static void sha256_blocks_arm(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        uint32x4_t abcd_save = state0;
+        uint32x4_t efgh_save = state1;
+        uint32x4_t W[4];
+        int g;
+        for (g = 0; g < 16; ++g) {
+            uint32x4_t w;
+            if (g < 4) {
+                w = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+            } else {
+                w = vsha256su0q_u32(W[g & 3], W[(g + 1) & 3]);
+                w = vsha256su1q_u32(w, W[(g + 2) & 3], W[(g + 3) & 3]);
+            }
+            W[g & 3] = w;
+            uint32x4_t wk = vaddq_u32(w, vld1q_u32(&K256[g * 4]));
+            uint32x4_t prev = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, prev, wk);
+        }
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+#endif  // HASH_ARM_SHA
+
+static block_fn sha1_blocks = sha1_blocks_c;
+static block_fn sha256_blocks = sha256_blocks_c;
+static const char* implementation = "c";
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_blocks() {
+#if defined(HASH_ARM_SHA)
+    sha1_blocks = sha1_blocks_arm;
+    sha256_blocks = sha256_blocks_arm;
+    implementation = "armv8-ce";
+#elif defined(HASH_X86_SHA)
+    if (cpu_has_sha()) {
+        sha1_blocks = sha1_blocks_shani;
+        sha256_blocks = sha256_blocks_shani;
+        implementation = "sha-ni";
+    }
+#endif
+}
+
+const char* hash_implementation() {
+    pthread_once(&select_once, select_blocks);
+    return implementation;
+}
+
+static void run_blocks(HASH_CTX* ctx, const uint8_t* data, size_t blocks) {
+    if (ctx->size == HASH_SHA256_SIZE) {
+        sha256_blocks(ctx->state, data, blocks);
+    } else {
+        sha1_blocks(ctx->state, data, blocks);
+    }
+}
+
+void hash_init(HASH_CTX* ctx, int size) {
+    static const uint32_t sha1_iv[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    static const uint32_t sha256_iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    pthread_once(&select_once, select_blocks);
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->size = size;
+    if (size == HASH_SHA256_SIZE) {
+        memcpy(ctx->state, sha256_iv, sizeof(sha256_iv));
+    } else {
+        memcpy(ctx->state, sha1_iv, sizeof(sha1_iv));
+    }
+}
+
+void hash_update(HASH_CTX* ctx, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t used = ctx->count & 63;
+    ctx->count += len;
+
+    if (used > 0) {
+        size_t n = 64 - used;
+        if (n > len) n = len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64) return;
+        run_blocks(ctx, ctx->buf, 1);
+    }
+    // Whole blocks are hashed straight from the caller's buffer.
+    if (len >= 64) {
+        run_blocks(ctx, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+const uint8_t* hash_final(HASH_CTX* ctx) {
+    uint64_t bits = ctx->count * 8;
+    size_t used = ctx->count & 63;
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        run_blocks(ctx, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; ++i) {
+        ctx->buf[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    run_blocks(ctx, ctx->buf, 1);
+
+    for (i = 0; i < ctx->size / 4; ++i) {
+        ctx->digest[i * 4 + 0] = ctx->state[i] >> 24;
+        ctx->digest[i * 4 + 1] = ctx->state[i] >> 16;
+        ctx->digest[i * 4 + 2] = ctx->state[i] >> 8;
+        ctx->digest[i * 4 + 3] = ctx->state[i];
+    }
+    return ctx->digest;
+}
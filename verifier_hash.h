@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_VERIFIER_HASH_H
+#define _RECOVERY_VERIFIER_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-1 and SHA-256 for whole-file signature checks.  The block
+// functions use the CPU's SHA instructions when it has them: SHA-NI on
+// x86 (detected at run time), and the ARMv8 crypto extensions when the
+// file is built with them enabled (-march=armv8-a+crypto, or
+// -mfpu=crypto-neon-fp-armv8 for 32-bit ARM).
+
+#define HASH_SHA1_SIZE      20
+#define HASH_SHA256_SIZE    32
+
+typedef struct {
+    uint32_t state[8];      // SHA-1 uses the first five
+    uint64_t count;
+    uint8_t buf[64];
+    uint8_t digest[HASH_SHA256_SIZE];
+    int size;               // HASH_SHA1_SIZE or HASH_SHA256_SIZE
+} HASH_CTX;
+
+void hash_init(HASH_CTX* ctx, int size);
+void hash_update(HASH_CTX* ctx, const void* data, size_t len);
+const uint8_t* hash_final(HASH_CTX* ctx);
+
+// Which block functions are in use, e.g. "sha-ni" or "c".
+const char* hash_implementation();
+
+#endif  // _RECOVERY_VERIFIER_HASH_H
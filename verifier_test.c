@@ -14,15 +14,26 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 
+#include "mincrypt/sha.h"
 #include "verifier.h"
+#include "verifier_hash.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
 
 // This is build/target/product/security/testkey.x509.pem after being
 // dumped out by dumpkey.jar.
-RSAPublicKey test_key =
+Certificate test_key = { SHA_DIGEST_SIZE,
     { 64, 0xc926ad21,
       { 1795090719, 2141396315, 950055447, -1713398866,
         -26044131, 1920809988, 546586521, -795969498,
@@ -56,7 +67,7 @@ RSAPublicKey test_key =
         1117190829, -57654514, 1825108855, -1281819325,
         1111251351, -1726129724, 1684324211, -1773988491,
         367251975, 810756730, -1941182952, 1175080310 }
-    };
+    } };
 
 void ui_print(const char* fmt, ...) {
     char buf[256];
@@ -71,9 +82,114 @@ void ui_print(const char* fmt, ...) {
 void ui_set_progress(float fraction) {
 }
 
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#define BENCH_CHUNK (4 * 1024 * 1024)
+
+// Writes a package of about size bytes with a signature footer.  The
+// signature is zeros, so it never verifies, but verify_file still reads
+// and hashes everything it covers.
+static int make_bench_package(const char* path, long long size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    unsigned char* chunk = malloc(BENCH_CHUNK);
+    unsigned int seed = 1;
+    int i;
+    for (i = 0; i < BENCH_CHUNK; ++i) {
+        chunk[i] = (seed = seed * 1103515245 + 12345) >> 16;
+    }
+    long long done;
+    for (done = 0; done < size; done += BENCH_CHUNK) {
+        chunk[0] = done >> 22;                  // no two chunks alike
+        if (write(fd, chunk, BENCH_CHUNK) != BENCH_CHUNK) {
+            fprintf(stderr, "can't write %s: %s\n", path, strerror(errno));
+            close(fd);
+            free(chunk);
+            return -1;
+        }
+    }
+    free(chunk);
+
+    // EOCD of an empty archive, then a comment holding the signature
+    // and its footer.
+    const int comment_size = RSANUMBYTES + 6;
+    unsigned char tail[22 + RSANUMBYTES + 6];
+    memset(tail, 0, sizeof(tail));
+    tail[0] = 0x50; tail[1] = 0x4b; tail[2] = 0x05; tail[3] = 0x06;
+    tail[20] = comment_size & 0xff;
+    tail[21] = comment_size >> 8;
+    unsigned char* footer = tail + sizeof(tail) - 6;
+    footer[0] = comment_size & 0xff;
+    footer[1] = comment_size >> 8;
+    footer[2] = 0xff;
+    footer[3] = 0xff;
+    footer[4] = comment_size & 0xff;
+    footer[5] = comment_size >> 8;
+    int ok = write(fd, tail, sizeof(tail)) == sizeof(tail);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Times the hash alone, in memory, and verify_file on a synthetic
+// package of size_mb megabytes, for SHA-1 and SHA-256 keys.
+static int benchmark(long long size_mb, const char* path) {
+    long long size = size_mb << 20;
+    unsigned char* chunk = malloc(BENCH_CHUNK);
+    memset(chunk, 0x5a, BENCH_CHUNK);
+    printf("hash implementation: %s\n", hash_implementation());
+
+    int hash_len;
+    for (hash_len = SHA_DIGEST_SIZE; hash_len <= SHA256_DIGEST_SIZE;
+         hash_len += SHA256_DIGEST_SIZE - SHA_DIGEST_SIZE) {
+        const char* name = hash_len == SHA_DIGEST_SIZE ? "sha1" : "sha256";
+        HASH_CTX ctx;
+        hash_init(&ctx, hash_len);
+        double start = now();
+        long long done;
+        for (done = 0; done < 1024LL << 20; done += BENCH_CHUNK) {
+            hash_update(&ctx, chunk, BENCH_CHUNK);
+        }
+        hash_final(&ctx);
+        printf("%-6s in memory:   %.1f MB/s\n", name, 1024 / (now() - start));
+    }
+    free(chunk);
+
+    if (make_bench_package(path, size) != 0) return 1;
+    for (hash_len = SHA_DIGEST_SIZE; hash_len <= SHA256_DIGEST_SIZE;
+         hash_len += SHA256_DIGEST_SIZE - SHA_DIGEST_SIZE) {
+        const char* name = hash_len == SHA_DIGEST_SIZE ? "sha1" : "sha256";
+        Certificate key = test_key;
+        key.hash_len = hash_len;
+        double start = now();
+        verify_file(path, &key, 1);     // fails on the fake signature
+        double t = now() - start;
+        printf("%-6s verify_file: %lld MB in %.2fs, %.1f MB/s\n",
+               name, size_mb, t, size_mb / t);
+    }
+    unlink(path);
+    return 0;
+}
+
 int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+        return benchmark(atoll(argv[2]),
+                         argc > 3 ? argv[3] : "/tmp/verifier_bench.zip");
+    }
+    if (argc == 3 && strcmp(argv[1], "-sha256") == 0) {
+        test_key.hash_len = SHA256_DIGEST_SIZE;
+        ++argv;
+        --argc;
+    }
     if (argc != 2) {
-        fprintf(stderr, "Usage: %s <package>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-sha256] <package>\n"
+                "       %s -b <size in MB> [scratch file]\n", argv[0], argv[0]);
         return 2;
     }
 